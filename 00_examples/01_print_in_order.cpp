@@ -9,6 +9,8 @@
 #include <thread>
 #include <vector>
 
+#include "unique_function.hpp"
+
 void print_first(std::ostream &os) {
   os << "first ";
 }
@@ -28,7 +30,7 @@ private:
   std::condition_variable cv;
 
 public:
-  void first(std::function<void(std::ostream &)> const &func, std::ostream &os) {
+  void first(unique_function<void(std::ostream &)> func, std::ostream &os) {
     std::unique_lock<std::mutex> lck(mtx);
     func(os);
     next = 2;
@@ -36,7 +38,7 @@ public:
     cv.notify_all();
   }
 
-  void second(std::function<void(std::ostream &)> const &func, std::ostream &os) {
+  void second(unique_function<void(std::ostream &)> func, std::ostream &os) {
     std::unique_lock<std::mutex> lck(mtx);
     cv.wait(lck, [this]() { return this->next == 2; });
     func(os);
@@ -45,7 +47,7 @@ public:
     cv.notify_all();
   }
 
-  void third(std::function<void(std::ostream &)> const &func, std::ostream &os) {
+  void third(unique_function<void(std::ostream &)> func, std::ostream &os) {
     std::unique_lock<std::mutex> lck(mtx);
     cv.wait(lck, [this]() { return this->next == 3; });
     func(os);
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cache_line.hpp"
+#include "wait_strategy.hpp" // spin_until
+
+// Hands out turns in sequence order, like Foo in 01_print_in_order.cpp, but for
+// any number of steps and without waking every waiter on every step: each turn
+// maps to its own mutex and condition variable in a ring, so complete() only
+// wakes the waiter(s) of the next turn.
+class sequencer
+{
+private:
+  struct alignas(CACHE_LINE_SIZE) turn
+  {
+    std::mutex _m;
+    std::condition_variable _cond;
+  };
+
+  std::atomic<std::uint64_t> _next{0};
+  std::vector<turn> _turns;
+
+public:
+  explicit sequencer(std::size_t ring_size = 64) : _turns(ring_size) {}
+
+  /// Block until all the turns before seq have completed
+  void
+  wait_for_turn(std::uint64_t seq) {
+    if (_next.load(std::memory_order_acquire) == seq) {
+      return;
+    }
+    turn &t = _turns[seq % _turns.size()];
+    std::unique_lock<std::mutex> lk(t._m);
+    t._cond.wait(lk, [this, seq] {
+      return _next.load(std::memory_order_acquire) == seq;
+    });
+  }
+
+  /// Pass the turn on to seq + 1. Must only be called by the owner of turn seq.
+  void
+  complete(std::uint64_t seq) {
+    turn &t = _turns[(seq + 1) % _turns.size()];
+    {
+      // publish under the mutex the next waiter checks the turn with, so that
+      // it can't miss the notification
+      std::lock_guard<std::mutex> lk(t._m);
+      _next.store(seq + 1, std::memory_order_release);
+    }
+    // only waiters whose turns map to the same slot of the ring are woken, and
+    // all but the owner of seq + 1 go back to sleep
+    t._cond.notify_all();
+  }
+};
+
+// Ring of depth slots, indexed by sequence number, where workers put their
+// results in any order and a single consumer takes them out in sequence order.
+// The state of each slot encodes whose result it is waiting for: 2 * seq while
+// empty and 2 * seq + 1 once the result of seq is there. A worker whose result
+// is depth or more ahead of the consumer finds its slot still in use and waits,
+// which bounds the number of results in flight.
+template <typename T>
+class reorder_buffer
+{
+private:
+  struct alignas(CACHE_LINE_SIZE) slot
+  {
+    std::atomic<std::uint64_t> _state{0};
+    std::optional<T> _value;
+  };
+
+  std::vector<slot> _slots;
+  std::uint64_t _next{0};
+
+public:
+  explicit reorder_buffer(std::size_t depth) : _slots(depth) {
+    for (std::size_t i = 0; i < _slots.size(); ++i) {
+      _slots[i]._state.store(2 * i, std::memory_order_relaxed);
+    }
+  }
+
+  reorder_buffer(reorder_buffer const &) = delete;
+  reorder_buffer(reorder_buffer &&) = delete;
+  reorder_buffer &
+  operator=(reorder_buffer const &) = delete;
+  reorder_buffer &
+  operator=(reorder_buffer &&) = delete;
+  ~reorder_buffer() = default;
+
+  /// Store the result of seq. Called by any number of workers, each seq once.
+  void
+  put(std::uint64_t seq, T value) {
+    slot &s = _slots[seq % _slots.size()];
+    spin_until(
+        [&] { return s._state.load(std::memory_order_acquire) == 2 * seq; });
+    s._value.emplace(std::move(value));
+    s._state.store(2 * seq + 1, std::memory_order_release);
+  }
+
+  /// Take the next result in sequence order if it's ready. Single consumer.
+  bool
+  try_pop(T &value) {
+    slot &s = _slots[_next % _slots.size()];
+    if (s._state.load(std::memory_order_acquire) != 2 * _next + 1) {
+      return false;
+    }
+    value = std::move(*s._value);
+    s._value.reset();
+    // hand the slot over to the result depth places ahead
+    s._state.store(2 * (_next + _slots.size()), std::memory_order_release);
+    ++_next;
+    return true;
+  }
+
+  /// Wait for the next result in sequence order. Single consumer.
+  void
+  pop(T &value) {
+    spin_until([&] { return try_pop(value); });
+  }
+};
+
+// Apply func to every element of [first, last) on num_workers threads, and call
+// sink with the results in the order of the input, on the calling thread.
+// At most depth results are buffered while waiting for earlier ones.
+template <typename RandomIt, typename Func, typename Sink>
+void
+ordered_parallel_transform(RandomIt first,
+                           RandomIt last,
+                           Func func,
+                           Sink sink,
+                           unsigned num_workers
+                           = std::max(std::thread::hardware_concurrency(), 1U),
+                           std::size_t depth = 1024) {
+  using result_type = decltype(func(*first));
+
+  auto const length = static_cast<std::uint64_t>(std::distance(first, last));
+  reorder_buffer<result_type> buffer(depth);
+  std::atomic<std::uint64_t> next_seq{0};
+
+  // items are claimed in increasing order, so the oldest item in flight never
+  // waits for buffer space and the workers can't deadlock
+  auto worker = [&] {
+    for (std::uint64_t seq = next_seq.fetch_add(1); seq < length;
+         seq = next_seq.fetch_add(1)) {
+      buffer.put(seq, func(first[static_cast<std::ptrdiff_t>(seq)]));
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned w = 0; w < num_workers; ++w) {
+    workers.emplace_back(worker);
+  }
+
+  result_type result{};
+  for (std::uint64_t seq = 0; seq < length; ++seq) {
+    buffer.pop(result);
+    sink(std::move(result));
+  }
+
+  std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+}
+
+int
+main() {
+  // print in order, with the three steps started in reverse
+  {
+    sequencer seq;
+    std::ostringstream ss;
+    std::vector<std::thread> threads;
+    std::string_view const words[] = {"first ", "second ", "third"};
+    for (std::uint64_t step = 3; step-- > 0;) {
+      threads.emplace_back([&seq, &ss, &words, step] {
+        seq.wait_for_turn(step);
+        ss << words[step];
+        seq.complete(step);
+      });
+    }
+    std::for_each(
+        threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+
+    assert(ss.str() == "first second third");
+    std::cout << ss.str() << '\n';
+  }
+
+  // process in parallel, emit in order
+  {
+    static constexpr unsigned NUM_ITEMS = 1'000'000;
+    std::vector<unsigned> input(NUM_ITEMS);
+    for (unsigned i = 0; i < NUM_ITEMS; ++i) {
+      input[i] = i;
+    }
+
+    // uneven amount of work per item, so that results finish out of order
+    auto work = [](unsigned value) {
+      unsigned long hash = value;
+      for (unsigned round = 0; round < value % 64; ++round) {
+        hash = hash * 6'364'136'223'846'793'005UL + 1'442'695'040'888'963'407UL;
+      }
+      return std::make_pair(value, hash);
+    };
+
+    unsigned expected = 0;
+    bool in_order = true;
+    auto const start = std::chrono::steady_clock::now();
+    ordered_parallel_transform(
+        input.begin(),
+        input.end(),
+        work,
+        [&expected, &in_order](std::pair<unsigned, unsigned long> const &res) {
+          in_order = in_order && res.first == expected;
+          ++expected;
+        });
+    std::chrono::duration<double> const elapsed
+        = std::chrono::steady_clock::now() - start;
+
+    assert(in_order && expected == NUM_ITEMS);
+    std::cout << "Processed " << NUM_ITEMS << " items in order in "
+              << elapsed.count() << "s\n";
+  }
+
+  return 0;
+}
@@ -1,6 +1,7 @@
-#include <iostream>
 #include <thread>
 
+#include "async_logger.hpp"
+
 class thread_guard {
 private:
   std::thread &_t;
@@ -25,7 +26,7 @@ struct func {
 
   void operator()() {
     for (unsigned j = 0; j < 1'000'000; ++j) {
-      std::cout << _i << "\n";
+      log_line(_i);
     }
   }
 };
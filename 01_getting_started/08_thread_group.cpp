@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h> // pthread_getname_np
+#include <sched.h>   // sched_getcpu
+
+#include "thread_group.hpp"
+
+// Like parallel_accumulate in 07_parallel_accumulate.cpp, but every worker
+// allocates and fills its own block before summing it, so with placement that
+// keeps the worker on one node its block lives in that node's memory.
+template <typename T>
+T
+local_blocks_accumulate(std::size_t length, placement where) {
+  std::vector<T> results;
+  {
+    thread_group group("accumulate", where);
+    std::size_t const num_threads
+        = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::size_t const block_size = length / num_threads;
+    results.resize(num_threads);
+    for (std::size_t i = 0; i < num_threads; ++i) {
+      std::size_t const size
+          = i + 1 == num_threads ? length - i * block_size : block_size;
+      group.spawn([size, &result = results[i]] {
+        std::vector<T> block(size);
+        std::iota(block.begin(), block.end(), T{0});
+        result = std::accumulate(block.begin(), block.end(), T{0});
+      });
+    }
+  }
+  return std::accumulate(results.begin(), results.end(), T{0});
+}
+
+int
+main() {
+  std::map<unsigned, std::vector<unsigned>> const nodes = numa_nodes();
+  std::cout << nodes.size() << " NUMA node(s)\n";
+  for (auto const &node : nodes) {
+    std::cout << "  node " << node.first << ": " << node.second.size()
+              << " CPU(s)\n";
+  }
+
+  // every thread runs on the CPUs of its slot and carries its name
+  for (placement where : {placement::per_cpu, placement::per_numa_node}) {
+    std::mutex m;
+    std::vector<std::string> names;
+    std::atomic<bool> placed{true};
+    {
+      thread_group group("worker", where);
+      for (std::size_t i = 0; i < 2 * group.num_slots(); ++i) {
+        std::vector<unsigned> const cpus = group.cpus_of(i);
+        group.spawn([cpus, &m, &names, &placed] {
+          auto const cpu = static_cast<unsigned>(sched_getcpu());
+          if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end()) {
+            placed = false;
+          }
+          char name[16] = {};
+          pthread_getname_np(pthread_self(), name, sizeof(name));
+          std::lock_guard<std::mutex> lk(m);
+          names.emplace_back(name);
+        });
+      }
+      // joined here
+    }
+    assert(placed);
+    std::sort(names.begin(), names.end());
+    std::cout << names.size() << " threads placed, " << names.front() << " to "
+              << names.back() << '\n';
+  }
+
+  try {
+    thread_group group("bad", placement::per_cpu, {CPU_SETSIZE - 1});
+    assert(false);
+  } catch (std::invalid_argument const &e) {
+    std::cout << "Rejected: " << e.what() << '\n';
+  }
+
+  static constexpr std::size_t LENGTH = 1 << 24;
+  for (placement where : {placement::none, placement::per_numa_node}) {
+    auto const start = std::chrono::steady_clock::now();
+    unsigned long const sum
+        = local_blocks_accumulate<unsigned long>(LENGTH, where);
+    std::chrono::duration<double> const elapsed
+        = std::chrono::steady_clock::now() - start;
+    std::cout << (where == placement::none ? "unpinned: " : "per node: ")
+              << sum << " in " << elapsed.count() << "s\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap, madvise
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close, sysconf
+
+#include "thread_group.hpp"
+
+// parallel_accumulate in 07_parallel_accumulate.cpp needs its input in memory,
+// which for a large file means reading all of it into a vector first: twice the
+// memory, and all the I/O done by one thread before any work starts.
+// Mapping the file instead lets every thread fault in and reduce its own chunk
+// straight from the page cache, without copying anything.
+
+/// Read-only mapping of a whole file
+class mapped_file
+{
+private:
+  int _fd{-1};
+  void *_data{nullptr};
+  std::size_t _size{0};
+
+public:
+  explicit mapped_file(std::string const &path) {
+    _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat st
+    {};
+    if (::fstat(_fd, &st) != 0) {
+      int const err = errno;
+      ::close(_fd);
+      throw std::system_error(err, std::generic_category(), "fstat " + path);
+    }
+    _size = static_cast<std::size_t>(st.st_size);
+    if (_size == 0) {
+      // empty files can't be mapped, and there is nothing to read anyway
+      return;
+    }
+    _data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (_data == MAP_FAILED) {
+      int const err = errno;
+      ::close(_fd);
+      throw std::system_error(err, std::generic_category(), "mmap " + path);
+    }
+    // every chunk is read front to back, so let the kernel read ahead
+    // aggressively and drop the pages behind us early
+    ::madvise(_data, _size, MADV_SEQUENTIAL);
+  }
+
+  mapped_file(mapped_file const &) = delete;
+  mapped_file(mapped_file &&) = delete;
+  mapped_file &
+  operator=(mapped_file const &) = delete;
+  mapped_file &
+  operator=(mapped_file &&) = delete;
+
+  ~mapped_file() {
+    if (_data != nullptr) {
+      ::munmap(_data, _size);
+    }
+    ::close(_fd);
+  }
+
+  void const *
+  data() const {
+    return _data;
+  }
+
+  std::size_t
+  size() const {
+    return _size;
+  }
+
+  std::string_view
+  view() const {
+    return {static_cast<char const *>(_data), _size};
+  }
+
+  /// Ask the kernel to start reading [offset, offset + length) in
+  void
+  will_need(std::size_t offset, std::size_t length) const {
+    // madvise wants a page-aligned start
+    static std::size_t const page_size
+        = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    std::size_t const aligned = offset - offset % page_size;
+    ::madvise(static_cast<char *>(_data) + aligned,
+              length + (offset - aligned),
+              MADV_WILLNEED);
+  }
+};
+
+// the number of threads parallel_accumulate would use for length units of work,
+// with at least min_per_thread units each
+inline std::size_t
+num_workers(std::size_t length, std::size_t min_per_thread) {
+  std::size_t const max_threads
+      = (length + min_per_thread - 1) / min_per_thread;
+  std::size_t const hardware_threads = std::thread::hardware_concurrency();
+  return std::max<std::size_t>(
+      std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads), 1);
+}
+
+// reduce every [bounds[i], bounds[i + 1]) byte range of file on its own thread
+// with reduce_chunk(offset, length), and combine the results with op
+template <typename T, typename ReduceChunk, typename BinaryOp>
+T
+reduce_chunks(mapped_file const &file,
+              std::vector<std::size_t> const &bounds,
+              T init,
+              ReduceChunk reduce_chunk,
+              BinaryOp op) {
+  std::size_t const num_chunks = bounds.size() - 1;
+  std::vector<T> results(num_chunks, init);
+  {
+    thread_group group("reduce", placement::per_numa_node);
+    for (std::size_t i = 0; i < num_chunks; ++i) {
+      group.spawn([&file, &bounds, &reduce_chunk, &result = results[i], i] {
+        std::size_t const length = bounds[i + 1] - bounds[i];
+        file.will_need(bounds[i], length);
+        result = reduce_chunk(bounds[i], length);
+      });
+    }
+  }
+
+  // init went into every chunk, so it must be op's identity
+  return std::accumulate(results.begin() + 1, results.end(), results[0], op);
+}
+
+/// Reduce a file of packed, native-endian T records, e.g. a dump of a
+/// std::vector<T>, with op. init must be the identity of op. The chunks are
+/// whole pages and whole records, so no page is shared between two threads.
+template <typename T, typename BinaryOp = std::plus<T>>
+T
+parallel_accumulate_records(mapped_file const &file,
+                            T init,
+                            BinaryOp op = BinaryOp()) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "records are read straight from the file");
+
+  std::size_t const num_records = file.size() / sizeof(T);
+  if (num_records == 0) {
+    return init;
+  }
+
+  static std::size_t const page_size
+      = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  // smallest unit that is both a whole number of pages and of records
+  std::size_t const unit = std::lcm(page_size, sizeof(T));
+  std::size_t const num_bytes = num_records * sizeof(T);
+  std::size_t const num_units = (num_bytes + unit - 1) / unit;
+  // at least 1MiB per thread
+  std::size_t const threads
+      = num_workers(num_units, std::max<std::size_t>(1, (1U << 20U) / unit));
+  std::size_t const units_per_thread = num_units / threads;
+
+  std::vector<std::size_t> bounds;
+  for (std::size_t i = 0; i < threads; ++i) {
+    bounds.push_back(i * units_per_thread * unit);
+  }
+  bounds.push_back(num_bytes);
+
+  // mmap returns page-aligned memory, so the records are properly aligned
+  T const *const records = static_cast<T const *>(file.data());
+  return reduce_chunks(
+      file,
+      bounds,
+      init,
+      [records, init, &op](std::size_t offset, std::size_t length) {
+        T const *const first = records + offset / sizeof(T);
+        return std::accumulate(first, first + length / sizeof(T), init, op);
+      },
+      op);
+}
+
+/// Reduce a newline-delimited file: map(line) turns every line into a T, and
+/// the results are combined with op. init must be the identity of op. The
+/// chunks are cut at line boundaries, so every line is seen by exactly one
+/// thread, as a std::string_view into the mapping.
+template <typename T, typename LineMap, typename BinaryOp = std::plus<T>>
+T
+parallel_accumulate_lines(mapped_file const &file,
+                          T init,
+                          LineMap map,
+                          BinaryOp op = BinaryOp()) {
+  std::string_view const text = file.view();
+  if (text.empty()) {
+    return init;
+  }
+
+  // at least 1MiB per thread
+  std::size_t const threads = num_workers(text.size(), 1U << 20U);
+  std::size_t const chunk_size = text.size() / threads;
+
+  // cut roughly every chunk_size bytes, just after the next newline
+  std::vector<std::size_t> bounds{0};
+  for (std::size_t i = 1; i < threads; ++i) {
+    std::size_t const newline
+        = text.find('\n', std::max(i * chunk_size, bounds.back()));
+    if (newline == std::string_view::npos) {
+      break;
+    }
+    bounds.push_back(newline + 1);
+  }
+  if (bounds.back() != text.size()) {
+    bounds.push_back(text.size());
+  }
+
+  return reduce_chunks(
+      file,
+      bounds,
+      init,
+      [text, init, &map, &op](std::size_t offset, std::size_t length) {
+        T result = init;
+        std::string_view chunk = text.substr(offset, length);
+        while (!chunk.empty()) {
+          std::size_t const newline = chunk.find('\n');
+          std::string_view const line = chunk.substr(0, newline);
+          result = op(std::move(result), map(line));
+          chunk.remove_prefix(newline == std::string_view::npos ? chunk.size()
+                                                                : newline + 1);
+        }
+        return result;
+      },
+      op);
+}
+
+int
+main(int argc, char *argv[]) {
+  // sum the numbers in a file given on the command line, one per line
+  if (argc > 1) {
+    try {
+      mapped_file const file(argv[1]);
+      auto const start = std::chrono::steady_clock::now();
+      long const sum
+          = parallel_accumulate_lines(file, 0L, [](std::string_view line) {
+              long value = 0;
+              std::from_chars(line.data(), line.data() + line.size(), value);
+              return value;
+            });
+      std::chrono::duration<double> const elapsed
+          = std::chrono::steady_clock::now() - start;
+      std::cout << "Sum " << sum << " in " << elapsed.count() << "s\n";
+      return 0;
+    } catch (std::system_error const &e) {
+      std::cerr << e.what() << '\n';
+      return 1;
+    }
+  }
+
+  static constexpr std::uint64_t NUM_VALUES = 4'000'000;
+  std::filesystem::path const dir = std::filesystem::temp_directory_path();
+  std::string const binary_path = (dir / "mapped_file_accumulate.bin").string();
+  std::string const text_path = (dir / "mapped_file_accumulate.txt").string();
+
+  std::vector<std::uint64_t> values(NUM_VALUES);
+  std::iota(values.begin(), values.end(), std::uint64_t{1});
+  [[maybe_unused]] std::uint64_t const expected
+      = NUM_VALUES * (NUM_VALUES + 1) / 2;
+  {
+    std::ofstream binary(binary_path, std::ios::binary);
+    void const *const bytes = values.data();
+    auto const num_bytes
+        = static_cast<std::streamsize>(values.size() * sizeof(values[0]));
+    binary.write(static_cast<char const *>(bytes), num_bytes);
+    std::ofstream text(text_path);
+    for (std::uint64_t v : values) {
+      text << v << '\n';
+    }
+  }
+
+  {
+    mapped_file const file(binary_path);
+    std::uint64_t const sum
+        = parallel_accumulate_records(file, std::uint64_t{0});
+    std::uint64_t const max = parallel_accumulate_records(
+        file, std::uint64_t{0}, [](std::uint64_t lhs, std::uint64_t rhs) {
+          return std::max(lhs, rhs);
+        });
+    assert(sum == expected && max == NUM_VALUES);
+    std::cout << "Binary file: sum " << sum << ", max " << max << '\n';
+  }
+
+  {
+    mapped_file const file(text_path);
+    auto const count_line = [](std::string_view) { return std::uint64_t{1}; };
+    std::uint64_t const lines
+        = parallel_accumulate_lines(file, std::uint64_t{0}, count_line);
+    std::uint64_t const sum = parallel_accumulate_lines(
+        file, std::uint64_t{0}, [](std::string_view line) {
+          std::uint64_t value = 0;
+          std::from_chars(line.data(), line.data() + line.size(), value);
+          return value;
+        });
+    assert(lines == NUM_VALUES && sum == expected);
+    std::cout << "Text file: " << lines << " lines, sum " << sum << '\n';
+  }
+
+  std::filesystem::remove(binary_path);
+  std::filesystem::remove(text_path);
+
+  return 0;
+}
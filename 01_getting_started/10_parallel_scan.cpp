@@ -0,0 +1,600 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint32_t, std::uint64_t
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h> // _mm_add_epi32, _mm_slli_si128, ...
+#endif
+
+// Prefix sums turn the counts of a histogram into the offsets of its buckets,
+// and the keep/drop flags of a stream compaction into the positions the kept
+// elements are written to, but std::inclusive_scan and std::exclusive_scan run
+// on a single thread. The scans below split the input in blocks the way
+// parallel_accumulate in 07_parallel_accumulate.cpp does, and go over them
+// twice:
+//   1. the total of every block but the last is reduced, in parallel
+//   2. the totals are scanned, which gives every block the value it starts at
+//   3. every block is scanned from that value, in parallel
+// so op must be associative, but not commutative. Arithmetic types summed with
+// std::plus are reduced and scanned with SSE2 inside the blocks, which for
+// floating point types adds the values in another order than a serial scan.
+
+#if defined(__SSE2__)
+// SSE2 operations on the lanes of a register, for the types that have them
+template <typename T, typename Enable = void>
+struct sse2_plus
+{
+  static constexpr bool enabled = false;
+};
+
+// loads and stores go through void pointers: the data doesn't have to be
+// aligned, so these don't need the alignment of the register type
+inline __m128i
+sse2_load(void const *p) {
+  return _mm_loadu_si128(static_cast<__m128i const *>(p));
+}
+
+inline void
+sse2_store(void *p, __m128i x) {
+  _mm_storeu_si128(static_cast<__m128i *>(p), x);
+}
+
+template <typename T>
+struct sse2_plus<T,
+                 std::enable_if_t<std::is_integral<T>::value && sizeof(T) == 4>>
+{
+  static constexpr bool enabled = true;
+  static constexpr std::size_t LANES = 4;
+  using reg = __m128i;
+
+  static reg
+  load(T const *p) {
+    return sse2_load(p);
+  }
+  static void
+  store(T *p, reg x) {
+    sse2_store(p, x);
+  }
+  static reg
+  add(reg lhs, reg rhs) {
+    return _mm_add_epi32(lhs, rhs);
+  }
+  // every lane moved up by one, with a zero in the first
+  static reg
+  shift_lane(reg x) {
+    return _mm_slli_si128(x, 4);
+  }
+  // the inclusive scan of the lanes
+  static reg
+  scan(reg x) {
+    x = add(x, _mm_slli_si128(x, 4));
+    return add(x, _mm_slli_si128(x, 8));
+  }
+  // the last lane in every lane
+  static reg
+  broadcast_last(reg x) {
+    return _mm_shuffle_epi32(x, 0xFF);
+  }
+};
+
+template <typename T>
+struct sse2_plus<T,
+                 std::enable_if_t<std::is_integral<T>::value && sizeof(T) == 8>>
+{
+  static constexpr bool enabled = true;
+  static constexpr std::size_t LANES = 2;
+  using reg = __m128i;
+
+  static reg
+  load(T const *p) {
+    return sse2_load(p);
+  }
+  static void
+  store(T *p, reg x) {
+    sse2_store(p, x);
+  }
+  static reg
+  add(reg lhs, reg rhs) {
+    return _mm_add_epi64(lhs, rhs);
+  }
+  static reg
+  shift_lane(reg x) {
+    return _mm_slli_si128(x, 8);
+  }
+  static reg
+  scan(reg x) {
+    return add(x, _mm_slli_si128(x, 8));
+  }
+  static reg
+  broadcast_last(reg x) {
+    return _mm_shuffle_epi32(x, 0xEE);
+  }
+};
+
+template <>
+struct sse2_plus<float>
+{
+  static constexpr bool enabled = true;
+  static constexpr std::size_t LANES = 4;
+  using reg = __m128;
+
+  static reg
+  load(float const *p) {
+    return _mm_loadu_ps(p);
+  }
+  static void
+  store(float *p, reg x) {
+    _mm_storeu_ps(p, x);
+  }
+  static reg
+  add(reg lhs, reg rhs) {
+    return _mm_add_ps(lhs, rhs);
+  }
+  static reg
+  shift_lane(reg x) {
+    return _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4));
+  }
+  static reg
+  scan(reg x) {
+    x = add(x, shift_lane(x));
+    return add(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+  }
+  static reg
+  broadcast_last(reg x) {
+    return _mm_shuffle_ps(x, x, 0xFF);
+  }
+};
+
+template <>
+struct sse2_plus<double>
+{
+  static constexpr bool enabled = true;
+  static constexpr std::size_t LANES = 2;
+  using reg = __m128d;
+
+  static reg
+  load(double const *p) {
+    return _mm_loadu_pd(p);
+  }
+  static void
+  store(double *p, reg x) {
+    _mm_storeu_pd(p, x);
+  }
+  static reg
+  add(reg lhs, reg rhs) {
+    return _mm_add_pd(lhs, rhs);
+  }
+  static reg
+  shift_lane(reg x) {
+    return _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(x), 8));
+  }
+  static reg
+  scan(reg x) {
+    return add(x, shift_lane(x));
+  }
+  static reg
+  broadcast_last(reg x) {
+    return _mm_unpackhi_pd(x, x);
+  }
+};
+
+// value in every lane
+template <typename T>
+typename sse2_plus<T>::reg
+sse2_broadcast(T value) {
+  std::array<T, sse2_plus<T>::LANES> lanes;
+  lanes.fill(value);
+  return sse2_plus<T>::load(lanes.data());
+}
+
+template <typename T>
+T
+sse2_last_lane(typename sse2_plus<T>::reg x) {
+  std::array<T, sse2_plus<T>::LANES> lanes;
+  sse2_plus<T>::store(lanes.data(), x);
+  return lanes.back();
+}
+
+/// The sum of [first, last)
+template <typename T>
+T
+sse2_reduce(T const *first, T const *last) {
+  using S = sse2_plus<T>;
+  typename S::reg acc = sse2_broadcast(T{0});
+  for (; static_cast<std::size_t>(last - first) >= S::LANES;
+       first += S::LANES) {
+    acc = S::add(acc, S::load(first));
+  }
+  std::array<T, S::LANES> lanes;
+  S::store(lanes.data(), acc);
+  return std::accumulate(
+      first, last, std::accumulate(lanes.begin(), lanes.end(), T{0}));
+}
+
+/// Write the running sums of [first, last), starting at init, to d_first.
+/// With inclusive, every sum includes the element it is written for.
+template <typename T>
+T *
+sse2_scan(T const *first, T const *last, T *d_first, T init, bool inclusive) {
+  using S = sse2_plus<T>;
+  typename S::reg carry = sse2_broadcast(init);
+  for (; static_cast<std::size_t>(last - first) >= S::LANES;
+       first += S::LANES, d_first += S::LANES) {
+    typename S::reg const sums = S::scan(S::load(first));
+    S::store(d_first, S::add(inclusive ? sums : S::shift_lane(sums), carry));
+    carry = S::add(S::broadcast_last(sums), carry);
+  }
+  T const acc = sse2_last_lane<T>(carry);
+  return inclusive
+             ? std::inclusive_scan(first, last, d_first, std::plus<>(), acc)
+             : std::exclusive_scan(first, last, d_first, acc);
+}
+#endif
+
+// iterators over elements that are next to each other in memory, as far as
+// can be told without C++20's std::contiguous_iterator
+template <typename Iterator>
+constexpr bool is_contiguous_iterator
+    = std::is_pointer<Iterator>::value
+      || std::is_same<Iterator,
+                      typename std::vector<typename std::iterator_traits<
+                          Iterator>::value_type>::iterator>::value
+      || std::is_same<Iterator,
+                      typename std::vector<typename std::iterator_traits<
+                          Iterator>::value_type>::const_iterator>::value;
+
+// whether the blocks can be reduced and scanned with sse2_reduce and sse2_scan
+template <typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+constexpr bool
+use_sse2() {
+#if defined(__SSE2__)
+  // std::vector<bool> isn't contiguous, but bool has no sse2_plus either
+  if constexpr (sse2_plus<T>::enabled) {
+    return (std::is_same<BinaryOp, std::plus<T>>::value
+            || std::is_same<BinaryOp, std::plus<>>::value)
+           && is_contiguous_iterator<InputIt>
+           && is_contiguous_iterator<OutputIt>
+           && std::is_same<typename std::iterator_traits<InputIt>::value_type,
+                           T>::value
+           && std::is_same<typename std::iterator_traits<OutputIt>::value_type,
+                           T>::value;
+  }
+#endif
+  return false;
+}
+
+/// op of the elements of [first, last), which must not be empty
+template <typename T, typename InputIt, typename BinaryOp>
+T
+reduce_block(InputIt first, InputIt last, BinaryOp op) {
+#if defined(__SSE2__)
+  if constexpr (use_sse2<InputIt, InputIt, T, BinaryOp>()) {
+    T const *const p = std::addressof(*first);
+    return sse2_reduce(p, p + std::distance(first, last));
+  }
+#endif
+  T first_value = *first;
+  return std::accumulate(std::next(first), last, std::move(first_value), op);
+}
+
+/// Scan [first, last), which must not be empty, starting at init
+template <typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+OutputIt
+scan_block(InputIt first,
+           InputIt last,
+           OutputIt d_first,
+           T init,
+           BinaryOp op,
+           bool inclusive) {
+#if defined(__SSE2__)
+  if constexpr (use_sse2<InputIt, OutputIt, T, BinaryOp>()) {
+    T const *const p = std::addressof(*first);
+    T *const d = std::addressof(*d_first);
+    sse2_scan(p, p + std::distance(first, last), d, init, inclusive);
+    return std::next(d_first, std::distance(first, last));
+  }
+#endif
+  return inclusive ? std::inclusive_scan(first, last, d_first, op, init)
+                   : std::exclusive_scan(first, last, d_first, init, op);
+}
+
+// run f(i) for every block i < num_blocks, the last one on the calling thread
+template <typename Function>
+void
+for_each_block(unsigned long num_blocks, Function f) {
+  std::vector<std::thread> threads(num_blocks - 1);
+  for (unsigned long i = 0; i < num_blocks - 1; ++i) {
+    threads[i] = std::thread(f, i);
+  }
+  f(num_blocks - 1);
+
+  std::for_each(
+      threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+}
+
+template <typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+OutputIt
+parallel_scan(InputIt first,
+              InputIt last,
+              OutputIt d_first,
+              T init,
+              BinaryOp op,
+              bool inclusive) {
+  auto const length = static_cast<unsigned long>(std::distance(first, last));
+
+  if (length == 0) {
+    return d_first;
+  }
+
+  // a thread takes about as long to start as scanning a few ten thousand
+  // elements, so there is no point in giving it fewer
+  unsigned long const min_per_thread = 64 * 1024;
+  unsigned long const max_threads
+      = (length + min_per_thread - 1) / min_per_thread;
+  unsigned long const hardware_threads = std::thread::hardware_concurrency();
+
+  unsigned long const num_threads
+      = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
+
+  unsigned long const block_size = length / num_threads;
+
+  std::vector<InputIt> block_starts(num_threads + 1, first);
+  std::vector<OutputIt> d_block_starts(num_threads, d_first);
+  for (unsigned long i = 1; i < num_threads; ++i) {
+    block_starts[i] = std::next(block_starts[i - 1], block_size);
+    d_block_starts[i] = std::next(d_block_starts[i - 1], block_size);
+  }
+  block_starts[num_threads] = last;
+
+  // the total of the last block isn't needed
+  std::vector<T> offsets(num_threads, init);
+  if (num_threads > 1) {
+    std::vector<T> totals(num_threads - 1);
+    for_each_block(num_threads - 1, [&](unsigned long i) {
+      totals[i] = reduce_block<T>(block_starts[i], block_starts[i + 1], op);
+    });
+    for (unsigned long i = 1; i < num_threads; ++i) {
+      offsets[i] = op(offsets[i - 1], totals[i - 1]);
+    }
+  }
+
+  for_each_block(num_threads, [&](unsigned long i) {
+    scan_block(block_starts[i],
+               block_starts[i + 1],
+               d_block_starts[i],
+               offsets[i],
+               op,
+               inclusive);
+  });
+
+  return std::next(d_first, static_cast<long>(length));
+}
+
+/// std::inclusive_scan on as many threads as the hardware has. op must be
+/// associative, and the result type T default constructible.
+template <typename InputIt, typename OutputIt, typename BinaryOp, typename T>
+OutputIt
+parallel_inclusive_scan(
+    InputIt first, InputIt last, OutputIt d_first, BinaryOp op, T init) {
+  return parallel_scan(first, last, d_first, std::move(init), op, true);
+}
+
+template <typename InputIt, typename OutputIt, typename BinaryOp>
+OutputIt
+parallel_inclusive_scan(InputIt first,
+                        InputIt last,
+                        OutputIt d_first,
+                        BinaryOp op) {
+  if (first == last) {
+    return d_first;
+  }
+  // the first element starts the scan
+  typename std::iterator_traits<InputIt>::value_type init = *first;
+  *d_first = init;
+  return parallel_inclusive_scan(
+      std::next(first), last, std::next(d_first), op, std::move(init));
+}
+
+template <typename InputIt, typename OutputIt>
+OutputIt
+parallel_inclusive_scan(InputIt first, InputIt last, OutputIt d_first) {
+  return parallel_inclusive_scan(first, last, d_first, std::plus<>());
+}
+
+/// std::exclusive_scan on as many threads as the hardware has. op must be
+/// associative, and T default constructible.
+template <typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+OutputIt
+parallel_exclusive_scan(
+    InputIt first, InputIt last, OutputIt d_first, T init, BinaryOp op) {
+  return parallel_scan(first, last, d_first, std::move(init), op, false);
+}
+
+template <typename InputIt, typename OutputIt, typename T>
+OutputIt
+parallel_exclusive_scan(InputIt first,
+                        InputIt last,
+                        OutputIt d_first,
+                        T init) {
+  return parallel_exclusive_scan(
+      first, last, d_first, std::move(init), std::plus<>());
+}
+
+// x -> a * x + b modulo 2^32: composing these is associative but not
+// commutative, so the scans must keep the elements in order
+struct affine
+{
+  std::uint32_t _a{1};
+  std::uint32_t _b{0};
+
+  friend bool
+  operator==(affine const &lhs, affine const &rhs) {
+    return lhs._a == rhs._a && lhs._b == rhs._b;
+  }
+};
+
+// first applied, then second
+affine
+compose(affine const &first, affine const &second) {
+  return {second._a * first._a, second._a * first._b + second._b};
+}
+
+template <typename T>
+void
+check_scans(std::vector<T> const &values) {
+  std::vector<T> expected(values.size());
+  std::vector<T> result(values.size());
+
+  std::inclusive_scan(values.begin(), values.end(), expected.begin());
+  parallel_inclusive_scan(values.begin(), values.end(), result.begin());
+  assert(result == expected);
+
+  std::exclusive_scan(values.begin(), values.end(), expected.begin(), T{3});
+  parallel_exclusive_scan(values.begin(), values.end(), result.begin(), T{3});
+  assert(result == expected);
+
+  // in place, as allowed by std::inclusive_scan
+  result = values;
+  std::inclusive_scan(values.begin(), values.end(), expected.begin());
+  parallel_inclusive_scan(result.begin(), result.end(), result.begin());
+  assert(result == expected);
+}
+
+template <typename Function>
+double
+time_ns_per_element(std::size_t num_elements, Function f) {
+  auto const start = std::chrono::steady_clock::now();
+  f();
+  std::chrono::duration<double, std::nano> const elapsed
+      = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / static_cast<double>(num_elements);
+}
+
+int
+main() {
+  std::mt19937 gen(42);
+
+  // around the block and lane boundaries, and large enough for every thread
+  for (std::size_t size : {0UL, 1UL, 3UL, 1000UL, (1UL << 20U) + 7}) {
+    std::uniform_int_distribution<int> dist(-1000, 1000);
+    std::vector<int> ints(size);
+    std::vector<std::uint64_t> longs(size);
+    std::vector<float> floats(size);
+    std::vector<double> doubles(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      ints[i] = dist(gen);
+      longs[i] = static_cast<std::uint64_t>(dist(gen)) * 1'000'003U;
+      // small integers, whose sums are exact in any order
+      floats[i] = static_cast<float>(dist(gen) % 8);
+      doubles[i] = static_cast<double>(dist(gen));
+    }
+    check_scans(ints);
+    check_scans(longs);
+    check_scans(floats);
+    check_scans(doubles);
+
+    std::vector<affine> maps(size);
+    for (affine &m : maps) {
+      m = {static_cast<std::uint32_t>(gen()),
+           static_cast<std::uint32_t>(gen())};
+    }
+    std::vector<affine> expected(size);
+    std::vector<affine> result(size);
+    std::inclusive_scan(maps.begin(), maps.end(), expected.begin(), compose);
+    parallel_inclusive_scan(maps.begin(), maps.end(), result.begin(), compose);
+    assert(result == expected);
+    std::exclusive_scan(
+        maps.begin(), maps.end(), expected.begin(), affine{}, compose);
+    parallel_exclusive_scan(
+        maps.begin(), maps.end(), result.begin(), affine{}, compose);
+    assert(result == expected);
+  }
+  std::cout << "Parallel scans match std::inclusive_scan and "
+               "std::exclusive_scan\n";
+
+  static constexpr std::size_t NUM_VALUES = 1U << 24U;
+  std::vector<std::uint32_t> values(NUM_VALUES);
+  std::generate(values.begin(), values.end(), std::ref(gen));
+
+  // stream compaction: the exclusive scan of the keep flags is where every
+  // kept element goes
+  {
+    std::vector<std::uint32_t> keep(NUM_VALUES);
+    std::transform(values.begin(),
+                   values.end(),
+                   keep.begin(),
+                   [](std::uint32_t v) { return (v % 3 == 0) ? 1U : 0U; });
+    std::vector<std::uint32_t> positions(NUM_VALUES);
+    parallel_exclusive_scan(
+        keep.begin(), keep.end(), positions.begin(), std::uint32_t{0});
+    std::vector<std::uint32_t> kept(positions.back() + keep.back());
+    for (std::size_t i = 0; i < NUM_VALUES; ++i) {
+      if (keep[i] != 0) {
+        kept[positions[i]] = values[i];
+      }
+    }
+
+    std::vector<std::uint32_t> expected;
+    std::copy_if(values.begin(),
+                 values.end(),
+                 std::back_inserter(expected),
+                 [](std::uint32_t v) { return v % 3 == 0; });
+    assert(kept == expected);
+    std::cout << "Compacted " << NUM_VALUES << " values to " << kept.size()
+              << '\n';
+  }
+
+  // histogram to offsets: the exclusive scan of the bucket counts is where
+  // every bucket starts, as in a counting sort
+  {
+    static constexpr std::size_t NUM_BUCKETS = 1U << 16U;
+    std::vector<std::uint64_t> counts(NUM_BUCKETS);
+    for (std::uint32_t v : values) {
+      ++counts[v % NUM_BUCKETS];
+    }
+    std::vector<std::uint64_t> offsets(NUM_BUCKETS);
+    parallel_exclusive_scan(
+        counts.begin(), counts.end(), offsets.begin(), std::uint64_t{0});
+
+    std::vector<std::uint32_t> sorted(NUM_VALUES);
+    for (std::uint32_t v : values) {
+      sorted[offsets[v % NUM_BUCKETS]++] = v;
+    }
+    assert(std::is_sorted(sorted.begin(),
+                          sorted.end(),
+                          [](std::uint32_t lhs, std::uint32_t rhs) {
+                            return lhs % NUM_BUCKETS < rhs % NUM_BUCKETS;
+                          }));
+    std::cout << "Bucketed " << NUM_VALUES << " values into " << NUM_BUCKETS
+              << " buckets\n";
+  }
+
+  std::vector<std::uint32_t> sums(NUM_VALUES);
+  double const serial = time_ns_per_element(NUM_VALUES, [&] {
+    std::inclusive_scan(values.begin(), values.end(), sums.begin());
+  });
+  std::vector<std::uint32_t> parallel_sums(NUM_VALUES);
+  double const parallel = time_ns_per_element(NUM_VALUES, [&] {
+    parallel_inclusive_scan(
+        values.begin(), values.end(), parallel_sums.begin());
+  });
+  assert(parallel_sums == sums);
+  std::cout << "std::inclusive_scan:      " << serial << " ns/element\n"
+            << "parallel_inclusive_scan:  " << parallel << " ns/element\n";
+
+  return 0;
+}
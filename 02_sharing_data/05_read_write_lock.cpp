@@ -3,23 +3,32 @@
 #include <functional> // std::mem_fn
 #include <iostream>
 #include <map>
+#include <memory_resource>
 #include <mutex>
 #include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
 class dns_entry
 {};
 
+// the nodes of the map, and the domain names in them, are allocated from the
+// memory resource given on construction
 class dns_cache
 {
-  std::map<std::string, dns_entry> _entries;
+  // std::less<> looks the domains up without building a std::pmr::string
+  std::pmr::map<std::pmr::string, dns_entry, std::less<>> _entries;
   mutable std::shared_mutex _entry_mutex;
 
 public:
+  explicit dns_cache(
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : _entries(resource) {}
+
   dns_entry
-  find_entry(std::string const &domain) const {
+  find_entry(std::string_view domain) const {
     // multiple readers
     std::shared_lock<std::shared_mutex> lk(_entry_mutex);
     auto find_it = _entries.find(domain);
@@ -30,7 +39,12 @@ public:
   update_or_add_entry(std::string const &domain, dns_entry const &dns_details) {
     // single writer
     std::lock_guard<std::shared_mutex> lk(_entry_mutex);
-    _entries[domain] = dns_details;
+    auto const find_it = _entries.find(std::string_view(domain));
+    if (find_it == _entries.end()) {
+      _entries.emplace(std::string_view(domain), dns_details);
+    } else {
+      find_it->second = dns_details;
+    }
   }
 
   void
@@ -56,7 +70,9 @@ main() {
                                             "maps.google.com",
                                             "wordpress.org"};
 
-  dns_cache cache;
+  // the writers share one pool of nodes
+  std::pmr::synchronized_pool_resource pool;
+  dns_cache cache(&pool);
 
   std::vector<std::thread> threads;
   for (std::string const &domain : domains) {
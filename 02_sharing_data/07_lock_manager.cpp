@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// swap() in 03_deadlock_solution.cpp locks two mutexes with std::lock, which
+// locks one of them and try_lock()s the others, and backs off and starts over
+// when one of them is taken. With many mutexes under contention that loop can
+// spin for a long time.
+// Deadlocks can also be avoided by always locking in the same global order:
+// if every transaction locks its set of mutexes in increasing (rank, address)
+// order, no cycle of transactions waiting for each other can form, so every
+// lock can simply block, without retries.
+
+enum class lock_mode
+{
+  shared,
+  exclusive
+};
+
+struct lock_request
+{
+  std::shared_mutex *_mutex;
+  lock_mode _mode;
+  // mutexes of lower rank are locked first, mutexes of the same rank by
+  // address
+  unsigned _rank{0};
+};
+
+struct lock_stats
+{
+  // number of acquire() calls
+  unsigned long _acquisitions;
+  // number of mutexes locked, after merging duplicates
+  unsigned long _locks;
+  // number of mutexes that were held by someone else when we tried them
+  unsigned long _contended;
+  // total time spent blocked on contended mutexes
+  std::chrono::nanoseconds _wait_time;
+};
+
+class lock_manager
+{
+public:
+  // RAII owner of the mutexes of a transaction, unlocks them in reverse order
+  class lock_set
+  {
+  private:
+    std::vector<lock_request> _held;
+
+  public:
+    lock_set() = default;
+    explicit lock_set(std::vector<lock_request> held)
+        : _held(std::move(held)) {}
+
+    ~lock_set() {
+      release();
+    }
+
+    lock_set(lock_set const &) = delete;
+    lock_set &
+    operator=(lock_set const &) = delete;
+
+    lock_set(lock_set &&other) noexcept : _held(std::move(other._held)) {
+      other._held.clear();
+    }
+
+    lock_set &
+    operator=(lock_set &&other) noexcept {
+      if (this != &other) {
+        release();
+        _held = std::move(other._held);
+        other._held.clear();
+      }
+      return *this;
+    }
+
+    void
+    release() {
+      for (auto it = _held.rbegin(); it != _held.rend(); ++it) {
+        if (it->_mode == lock_mode::exclusive) {
+          it->_mutex->unlock();
+        } else {
+          it->_mutex->unlock_shared();
+        }
+      }
+      _held.clear();
+    }
+
+    std::size_t
+    size() const {
+      return _held.size();
+    }
+  };
+
+private:
+  std::atomic<unsigned long> _acquisitions{0};
+  std::atomic<unsigned long> _locks{0};
+  std::atomic<unsigned long> _contended{0};
+  std::atomic<long long> _wait_ns{0};
+
+  // sort in the global lock order and merge the requests for the same mutex,
+  // where exclusive wins over shared
+  static void
+  normalize(std::vector<lock_request> &requests) {
+    std::sort(requests.begin(),
+              requests.end(),
+              [](lock_request const &lhs, lock_request const &rhs) {
+                if (lhs._rank != rhs._rank) {
+                  return lhs._rank < rhs._rank;
+                }
+                return std::less<std::shared_mutex *>()(lhs._mutex,
+                                                        rhs._mutex);
+              });
+
+    auto out = requests.begin();
+    for (auto in = requests.begin(); in != requests.end(); ++in) {
+      if (out != requests.begin() && std::prev(out)->_mutex == in->_mutex) {
+        if (in->_mode == lock_mode::exclusive) {
+          std::prev(out)->_mode = lock_mode::exclusive;
+        }
+        continue;
+      }
+      *out++ = *in;
+    }
+    requests.erase(out, requests.end());
+  }
+
+  void
+  lock_one(lock_request const &request) {
+    bool const exclusive = request._mode == lock_mode::exclusive;
+    if (exclusive ? request._mutex->try_lock()
+                  : request._mutex->try_lock_shared()) {
+      return;
+    }
+
+    _contended.fetch_add(1, std::memory_order_relaxed);
+    auto const start = std::chrono::steady_clock::now();
+    if (exclusive) {
+      request._mutex->lock();
+    } else {
+      request._mutex->lock_shared();
+    }
+    auto const waited = std::chrono::steady_clock::now() - start;
+    _wait_ns.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count(),
+        std::memory_order_relaxed);
+  }
+
+public:
+  lock_manager() = default;
+  lock_manager(lock_manager const &) = delete;
+  lock_manager(lock_manager &&) = delete;
+  lock_manager &
+  operator=(lock_manager const &) = delete;
+  lock_manager &
+  operator=(lock_manager &&) = delete;
+  ~lock_manager() = default;
+
+  /// Lock all the requested mutexes, in the global lock order. Every lock
+  /// blocks until it is acquired, there is no try-and-back-off. Requests may
+  /// name the same mutex more than once.
+  lock_set
+  acquire(std::vector<lock_request> requests) {
+    normalize(requests);
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+      try {
+        lock_one(requests[i]);
+      } catch (...) {
+        // release what we already hold before reporting the error
+        requests.resize(i);
+        lock_set partial(std::move(requests));
+        throw;
+      }
+    }
+
+    _acquisitions.fetch_add(1, std::memory_order_relaxed);
+    _locks.fetch_add(requests.size(), std::memory_order_relaxed);
+    return lock_set(std::move(requests));
+  }
+
+  lock_stats
+  stats() const {
+    return lock_stats{
+        _acquisitions.load(std::memory_order_relaxed),
+        _locks.load(std::memory_order_relaxed),
+        _contended.load(std::memory_order_relaxed),
+        std::chrono::nanoseconds(_wait_ns.load(std::memory_order_relaxed))};
+  }
+};
+
+struct account
+{
+  std::shared_mutex _m;
+  long _balance{0};
+};
+
+int
+main() {
+  static constexpr std::size_t NUM_ACCOUNTS = 64;
+  static constexpr long INITIAL_BALANCE = 1'000;
+  static constexpr unsigned TRANSACTIONS_PER_THREAD = 20'000;
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+
+  std::vector<account> accounts(NUM_ACCOUNTS);
+  for (account &a : accounts) {
+    a._balance = INITIAL_BALANCE;
+  }
+
+  lock_manager manager;
+  std::atomic<bool> audits_ok{true};
+
+  auto worker = [&](unsigned id) {
+    std::mt19937 gen(id);
+    std::uniform_int_distribution<std::size_t> pick(0, NUM_ACCOUNTS - 1);
+    std::uniform_int_distribution<std::size_t> set_size(2, 50);
+
+    for (unsigned t = 0; t < TRANSACTIONS_PER_THREAD; ++t) {
+      if (t % 100 == 0) {
+        // audit: a consistent read of every account
+        std::vector<lock_request> requests;
+        for (account &a : accounts) {
+          requests.push_back({&a._m, lock_mode::shared});
+        }
+        lock_manager::lock_set const locks = manager.acquire(requests);
+        long total = 0;
+        for (account const &a : accounts) {
+          total += a._balance;
+        }
+        if (total != INITIAL_BALANCE * static_cast<long>(NUM_ACCOUNTS)) {
+          audits_ok = false;
+        }
+        continue;
+      }
+
+      // move one unit around a random set of accounts, which may name the
+      // same account twice
+      std::vector<std::size_t> involved(set_size(gen));
+      std::generate(
+          involved.begin(), involved.end(), [&] { return pick(gen); });
+      std::vector<lock_request> requests;
+      for (std::size_t i : involved) {
+        requests.push_back({&accounts[i]._m, lock_mode::exclusive});
+      }
+      lock_manager::lock_set const locks = manager.acquire(requests);
+      for (std::size_t i = 0; i < involved.size(); ++i) {
+        --accounts[involved[i]]._balance;
+        ++accounts[involved[(i + 1) % involved.size()]]._balance;
+      }
+    }
+  };
+
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned id = 0; id < num_threads; ++id) {
+    threads.emplace_back(worker, id);
+  }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  std::chrono::duration<double> const elapsed
+      = std::chrono::steady_clock::now() - start;
+
+  long total = 0;
+  for (account const &a : accounts) {
+    total += a._balance;
+  }
+  assert(audits_ok);
+  assert(total == INITIAL_BALANCE * static_cast<long>(NUM_ACCOUNTS));
+
+  lock_stats const stats = manager.stats();
+  std::cout << stats._acquisitions << " transactions in " << elapsed.count()
+            << "s\n";
+  std::cout << "  " << stats._locks << " mutexes locked, " << stats._contended
+            << " of them contended\n";
+  std::cout << "  "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   stats._wait_time)
+                   .count()
+            << "ms spent waiting\n";
+  std::cout << "  total balance " << total << '\n';
+
+  return 0;
+}
@@ -2,73 +2,101 @@
 #include <iostream>
 #include <mutex>
 #include <queue>
+#include <string>
 #include <thread>
-#include <atomic>
 #include <algorithm>
+#include <chrono>
 #include <functional>
+#include <vector>
 
-std::atomic<size_t> remaining_producers = 4;
+#include "latency_histogram.hpp"
+
+using namespace std::chrono_literals;
+
+// The producers push on a fixed schedule, one item every INTERVAL whether or
+// not the consumers keep up. Every item carries the time it was due and the
+// time it was pushed: from push is what the queue costs, from due also counts
+// the time an item waited for a producer that fell behind.
+constexpr std::chrono::steady_clock::duration INTERVAL = 50us;
+constexpr int ITEMS_PER_PRODUCER = 2'000;
+
+size_t remaining_producers = 0;
 std::mutex mut;
-std::queue<int> data_queue;
+struct timed_item {
+  std::chrono::steady_clock::time_point _due;
+  std::chrono::steady_clock::time_point _pushed;
+};
+std::queue<timed_item> data_queue;
 std::condition_variable data_cond;
+// the consumers merge theirs into them when they stop
+latency_histogram latencies_from_push;
+latency_histogram latencies_from_due;
 
-void data_preparation_thread() {
-  for (int i = 0; i < 10; ++i) {
+void data_preparation_thread(std::chrono::steady_clock::time_point start) {
+  for (int i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+    std::chrono::steady_clock::time_point const due = start + i * INTERVAL;
+    std::this_thread::sleep_until(due);
+    timed_item const item{due, std::chrono::steady_clock::now()};
     {
       std::lock_guard<std::mutex> lk(mut);
-      data_queue.push(i);
+      data_queue.push(item);
     }
     data_cond.notify_one();
   }
-  --remaining_producers;
+  {
+    std::lock_guard<std::mutex> lk(mut);
+    --remaining_producers;
+  }
+  // the consumers waiting on the empty queue have to see it
+  data_cond.notify_all();
 }
 
 void data_processing_thread() {
+  latency_histogram local_from_push;
+  latency_histogram local_from_due;
+  std::unique_lock<std::mutex> lk(mut);
   while (true) {
-    int data = 0;
-    {
-      std::unique_lock<std::mutex> lk(mut);
-      if (remaining_producers == 0 && data_queue.empty()) {
-        return;
-      }
-      data_cond.wait(lk, [] { return !data_queue.empty(); });
-      data = data_queue.front();
-      data_queue.pop();
-      std::cout << "Consumer " << std::this_thread::get_id() << " got " << data << '\n';
-      lk.unlock();
+    data_cond.wait(lk, [] { return !data_queue.empty() || remaining_producers == 0; });
+    if (data_queue.empty()) {
+      break;
     }
+    timed_item const item = data_queue.front();
+    data_queue.pop();
+    lk.unlock();
+    auto const popped = std::chrono::steady_clock::now();
+    local_from_push.record(popped - item._pushed);
+    local_from_due.record(popped - item._due);
+    lk.lock();
   }
+  latencies_from_push.merge(local_from_push);
+  latencies_from_due.merge(local_from_due);
 }
 
-int main() {
-  std::cout << "One producer, four consumers\n";
-  remaining_producers = 1;
+void run(char const *label, unsigned num_producers, unsigned num_consumers) {
+  remaining_producers = num_producers;
+  latencies_from_push.clear();
+  latencies_from_due.clear();
+
   std::vector<std::thread> threads;
-  threads.emplace_back(data_preparation_thread);
-  for (unsigned p = 0; p < 4; ++p) {
+  for (unsigned c = 0; c < num_consumers; ++c) {
     threads.emplace_back(data_processing_thread);
   }
-  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
-  threads.clear();
-
-  std::cout << "Four producers, one consumer\n";
-  remaining_producers = 4;
-  for (unsigned p = 0; p < 4; ++p) {
-    threads.emplace_back(data_preparation_thread);
+  // staggered, so that the producers don't all push at the same instants
+  auto const start = std::chrono::steady_clock::now() + 1ms;
+  for (unsigned p = 0; p < num_producers; ++p) {
+    threads.emplace_back(data_preparation_thread, start + p * INTERVAL / num_producers);
   }
-  threads.emplace_back(data_processing_thread);
   std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
-  threads.clear();
 
-  std::cout << "Four producers, four consumers\n";
-  remaining_producers = 4;
-  for (unsigned p = 0; p < 4; ++p) {
-    threads.emplace_back(data_preparation_thread);
-  }
-  for (unsigned p = 0; p < 4; ++p) {
-    threads.emplace_back(data_processing_thread);
-  }
-  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  latency_report_row(std::cout, std::string(label) + " from push", latencies_from_push);
+  latency_report_row(std::cout, std::string(label) + " from due", latencies_from_due);
+}
+
+int main() {
+  latency_report_header(std::cout);
+  run("1 producer, 4 consumers", 1, 4);
+  run("4 producers, 1 consumer", 4, 1);
+  run("4 producers, 4 consumers", 4, 4);
 
   return 0;
 }
@@ -1,20 +1,49 @@
 #include <algorithm>
-#include <condition_variable>
+#include <chrono>
+#include <filesystem>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
-template <typename T>
+#include "async_logger.hpp"
+#include "latency_histogram.hpp"
+#include "storage_policy.hpp"
+#include "trace.hpp"
+#include "wait_strategy.hpp"
+
+// WaitStrategy decides how wait_and_pop() waits for data; see wait_strategy.hpp
+// The elements are always stored by value, Storage decides what the pops that
+// return the element give back: a new shared_ptr to it, or the element moved
+// into a std::optional; see storage_policy.hpp
+template <typename T,
+          typename WaitStrategy = blocking_wait,
+          typename Storage = shared_storage>
 class threadsafe_queue
 {
+public:
+  using element_type = typename Storage::template element<T>;
+
 private:
   mutable std::mutex _m;
   std::queue<T> _q;
-  std::condition_variable _cond;
+  WaitStrategy _waiter;
   bool _production_done{false};
 
+  // must be called with the mutex held and the queue not empty
+  element_type
+  pop_front() {
+    element_type p(Storage::template make<T>(std::move(_q.front())));
+    _q.pop();
+    return p;
+  }
+
 public:
   threadsafe_queue() = default;
   threadsafe_queue(threadsafe_queue const &) = delete;
@@ -29,7 +58,23 @@ public:
   push(T const &val) {
     std::lock_guard<std::mutex> lk(_m);
     _q.push(val);
-    _cond.notify_one();
+    _waiter.notify_one();
+  }
+
+  void
+  push(T &&val) {
+    std::lock_guard<std::mutex> lk(_m);
+    _q.push(std::move(val));
+    _waiter.notify_one();
+  }
+
+  /// Construct the element from args in place, at the back of the queue
+  template <typename... Args>
+  void
+  emplace(Args &&...args) {
+    std::lock_guard<std::mutex> lk(_m);
+    _q.emplace(std::forward<Args>(args)...);
+    _waiter.notify_one();
   }
 
   bool
@@ -40,47 +85,75 @@ public:
       return false;
     }
 
-    val = _q.front();
+    val = std::move(_q.front());
     _q.pop();
     return true;
   }
 
-  std::shared_ptr<T>
+  element_type
   try_pop() {
     std::lock_guard<std::mutex> lk(_m);
 
     if (_q.empty()) {
-      return std::shared_ptr<T>(nullptr);
+      return element_type();
     }
 
-    std::shared_ptr<T> p(std::make_shared(_q.front()));
-    _q.pop();
-    return p;
+    return pop_front();
   }
 
   void
   wait_and_pop(T &val) {
     std::unique_lock<std::mutex> lk(_m);
-    _cond.wait(lk, [this] { return !_q.empty() || _production_done; });
+    _waiter.wait(lk, [this] { return !_q.empty() || _production_done; });
 
     if (!_q.empty()) {
-      val = _q.front();
+      val = std::move(_q.front());
       _q.pop();
     }
   }
 
-  std::shared_ptr<T>
+  element_type
   wait_and_pop() {
     std::unique_lock<std::mutex> lk(_m);
-    _cond.wait(lk, [this] { return !_q.empty() || _production_done; });
+    _waiter.wait(lk, [this] { return !_q.empty() || _production_done; });
 
     if (!_q.empty()) {
-      std::shared_ptr<T> p(std::make_shared<T>(_q.front()));
-      _q.pop();
-      return p;
+      return pop_front();
     } else {
-      return nullptr;
+      return element_type();
+    }
+  }
+
+  // returns false if no data arrived within timeout, or if production is done
+  // and the queue is drained
+  template <typename Rep, typename Period>
+  bool
+  wait_and_pop_for(T &val, std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<std::mutex> lk(_m);
+    _waiter.wait_for(
+        lk, timeout, [this] { return !_q.empty() || _production_done; });
+
+    if (_q.empty()) {
+      return false;
     }
+
+    val = std::move(_q.front());
+    _q.pop();
+    return true;
+  }
+
+  template <typename Rep, typename Period>
+  element_type
+  wait_and_pop_for(std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<std::mutex> lk(_m);
+    _waiter.wait_for(
+        lk, timeout, [this] { return !_q.empty() || _production_done; });
+
+    if (_q.empty()) {
+      return element_type();
+    }
+
+    return pop_front();
   }
 
   bool
@@ -101,57 +174,105 @@ public:
       std::lock_guard<std::mutex> lk(_m);
       _production_done = true;
     }
-    _cond.notify_all();
+    _waiter.notify_all();
   }
 };
 
-template <typename T>
+// what the producers push: when the item was due, on the producer's fixed
+// schedule, and when it was actually pushed
+struct timed_item
+{
+  unsigned _seq;
+  std::chrono::steady_clock::time_point _due;
+  std::chrono::steady_clock::time_point _pushed;
+};
+
+// the latencies seen by one consumer: from the push, and from when the item
+// was due, which also counts the time the producer fell behind its schedule
+struct consumer_latencies
+{
+  latency_histogram _from_push;
+  latency_histogram _from_due;
+};
+
+// push the items [begin, end), one every interval from start, whatever the
+// consumers do: an open loop, so a stalled queue delays every item due in the
+// meantime instead of the producer quietly sending fewer of them
+template <typename WaitStrategy, typename Storage>
 void
-produce_data(threadsafe_queue<T> &q, T begin, T end) {
+produce_data(threadsafe_queue<timed_item, WaitStrategy, Storage> &q,
+             unsigned begin,
+             unsigned end,
+             std::chrono::steady_clock::time_point start,
+             std::chrono::steady_clock::duration interval) {
   for (unsigned d = begin; d < end; ++d) {
-    q.push(d);
+    std::chrono::steady_clock::time_point const due
+        = start + static_cast<int>(d - begin) * interval;
+    std::this_thread::sleep_until(due);
+    q.push(timed_item{d, due, std::chrono::steady_clock::now()});
+    trace_instant("push", d);
   }
 }
 
-template <typename T>
+// the hand-offs are traced rather than printed: a lock around std::cout would
+// serialize the consumers it is supposed to be watching
+template <typename WaitStrategy, typename Storage>
 void
-consume_data(threadsafe_queue<T> &q, unsigned id) {
-  static std::mutex cout_mtx;
-
+consume_data(threadsafe_queue<timed_item, WaitStrategy, Storage> &q,
+             unsigned id,
+             consumer_latencies &latencies) {
+  unsigned consumed = 0;
   while (true) {
-    auto p = q.wait_and_pop();
-    if (p == nullptr) {
-      {
-        std::lock_guard<std::mutex> lk(cout_mtx);
-        std::cout << "Consumer " << id << " stopping\n";
-      }
+    typename threadsafe_queue<timed_item, WaitStrategy, Storage>::element_type
+        p;
+    {
+      trace_scope scope("wait_and_pop");
+      p = q.wait_and_pop();
+    }
+    if (!p) {
+      log_line("Consumer ", id, " stopping after ", consumed, " items");
       return;
-    } else {
-      {
-        std::lock_guard<std::mutex> lk(cout_mtx);
-        std::cout << "Consumer " << id << " got " << *p << "\n";
-      }
     }
+    auto const popped = std::chrono::steady_clock::now();
+    latencies._from_push.record(popped - p->_pushed);
+    latencies._from_due.record(popped - p->_due);
+    trace_instant("pop", p->_seq);
+    ++consumed;
   }
 }
 
-int
-main() {
-  static constexpr size_t NUM_PRODUCERS = 20;
-  static constexpr size_t NUM_CONSUMERS = 5;
-  static constexpr size_t STEP_SIZE = 10;
+template <typename WaitStrategy, typename Storage = shared_storage>
+consumer_latencies
+run_producers_consumers() {
+  using namespace std::chrono_literals;
+  static constexpr unsigned NUM_PRODUCERS = 4;
+  static constexpr unsigned NUM_CONSUMERS = 2;
+  static constexpr unsigned ITEMS_PER_PRODUCER = 5'000;
+  // 25'000 items/s per producer
+  static constexpr std::chrono::steady_clock::duration INTERVAL = 40us;
 
-  threadsafe_queue<unsigned> q;
-
-  std::vector<std::thread> producers;
-  for (unsigned i = 0; i < NUM_PRODUCERS; ++i) {
-    producers.emplace_back(
-        produce_data<unsigned>, std::ref(q), i * STEP_SIZE, (i + 1) * STEP_SIZE);
-  }
+  threadsafe_queue<timed_item, WaitStrategy, Storage> q;
 
+  std::vector<consumer_latencies> latencies(NUM_CONSUMERS);
   std::vector<std::thread> consumers;
   for (unsigned i = 0; i < NUM_CONSUMERS; ++i) {
-    consumers.emplace_back(consume_data<unsigned>, std::ref(q), i);
+    consumers.emplace_back(consume_data<WaitStrategy, Storage>,
+                           std::ref(q),
+                           i,
+                           std::ref(latencies[i]));
+  }
+
+  // the schedules start once every thread is up, staggered so that the
+  // producers don't all push at the same instants
+  auto const start = std::chrono::steady_clock::now() + 1ms;
+  std::vector<std::thread> producers;
+  for (unsigned i = 0; i < NUM_PRODUCERS; ++i) {
+    producers.emplace_back(produce_data<WaitStrategy, Storage>,
+                           std::ref(q),
+                           i * ITEMS_PER_PRODUCER,
+                           (i + 1) * ITEMS_PER_PRODUCER,
+                           start + i * INTERVAL / NUM_PRODUCERS,
+                           INTERVAL);
   }
 
   std::for_each(
@@ -159,6 +280,76 @@ main() {
   q.notify_production_done();
   std::for_each(
       consumers.begin(), consumers.end(), std::mem_fn(&std::thread::join));
+  log_flush();
+
+  consumer_latencies total;
+  for (consumer_latencies const &l : latencies) {
+    total._from_push.merge(l._from_push);
+    total._from_due.merge(l._from_due);
+  }
+  return total;
+}
+
+int
+main() {
+  using namespace std::chrono_literals;
+
+  std::string const trace_path
+      = (std::filesystem::temp_directory_path() / "thread_safe_queue.json")
+            .string();
+  auto exporter = std::make_unique<trace_exporter>(trace_path);
+
+  std::vector<std::pair<std::string, consumer_latencies>> results;
+  std::cout << "Blocking consumers" << std::endl;
+  results.emplace_back("blocking", run_producers_consumers<blocking_wait>());
+
+  // spinning consumers only make sense when they have a core each, the
+  // yielding variant keeps this demo usable on a small machine
+  std::cout << "Spinning consumers" << std::endl;
+  results.emplace_back("spin_yield",
+                       run_producers_consumers<spin_yield_wait<>>());
+
+  std::cout << "Spin-then-park consumers" << std::endl;
+  results.emplace_back("spin_park",
+                       run_producers_consumers<spin_park_wait<>>());
+
+  // no allocation per element: the elements are moved in and out by value
+  std::cout << "Consumers popping by value" << std::endl;
+  results.emplace_back(
+      "blocking by value",
+      run_producers_consumers<blocking_wait, value_storage>());
+
+  exporter.reset();
+
+  // from push is what the queue costs; from due adds the time the producers
+  // fell behind their schedule, which a closed-loop benchmark never sees
+  latency_report_header(std::cout);
+  for (auto const &result : results) {
+    latency_report_row(
+        std::cout, result.first + " from push", result.second._from_push);
+    latency_report_row(
+        std::cout, result.first + " from due", result.second._from_due);
+  }
+
+  std::cout << "Queue hand-offs traced to " << trace_path
+            << ", open it in chrome://tracing or ui.perfetto.dev\n";
+
+  threadsafe_queue<std::string, blocking_wait, value_storage> messages;
+  messages.emplace(3, '!');
+  messages.push("hello");
+  std::optional<std::string> message = messages.try_pop();
+  std::cout << "Popped " << *message << '\n';
+  message = messages.try_pop();
+  std::cout << "Popped " << *message << '\n';
+  if (!messages.try_pop()) {
+    std::cout << "Nothing left to pop\n";
+  }
+
+  threadsafe_queue<unsigned, busy_spin_wait> q;
+  unsigned val = 0;
+  if (!q.wait_and_pop_for(val, 10ms)) {
+    std::cout << "Timed out waiting on an empty queue\n";
+  }
 
   return 0;
 }
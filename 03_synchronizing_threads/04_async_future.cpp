@@ -1,6 +1,13 @@
+#include <cassert>
+#include <chrono>
 #include <future>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "lean_future.hpp"
 
 int find_the_answer_to_ltuae() {
   return 42;
@@ -10,10 +17,78 @@ void do_other_stuff() {
   return;
 }
 
+// nanoseconds per promise/future pair, fulfilled in batches of BATCH promises by the calling thread, or by another
+// thread while the calling thread waits on the futures
+template <template <typename> class Promise>
+double ns_per_future(bool cross_thread) {
+  constexpr int ROUNDS = 1'000;
+  constexpr int BATCH = 1'000;
+  long long sum = 0;
+  auto const start = std::chrono::steady_clock::now();
+  for (int round = 0; round < ROUNDS; ++round) {
+    std::vector<Promise<int>> promises(BATCH);
+    std::vector<decltype(promises[0].get_future())> futures;
+    futures.reserve(BATCH);
+    for (auto &promise : promises) {
+      futures.push_back(promise.get_future());
+    }
+    auto fulfill = [&promises] {
+      for (int i = 0; i < BATCH; ++i) {
+        promises[static_cast<std::size_t>(i)].set_value(i);
+      }
+    };
+    std::thread setter;
+    if (cross_thread) {
+      setter = std::thread(fulfill);
+    } else {
+      fulfill();
+    }
+    for (auto &future : futures) {
+      sum += future.get();
+    }
+    if (setter.joinable()) {
+      setter.join();
+    }
+  }
+  auto const elapsed = std::chrono::steady_clock::now() - start;
+  assert(sum == static_cast<long long>(ROUNDS) * (BATCH * (BATCH - 1) / 2));
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count())
+         / (ROUNDS * BATCH);
+}
+
 int main() {
   std::future<int> the_answer = std::async(find_the_answer_to_ltuae);
   do_other_stuff();
   std::cout << "The answer is " << the_answer.get() << std::endl;
+
+  // the same through a lean_promise, fulfilled by another thread
+  lean_promise<int> promise;
+  lean_future<int> lean_answer = promise.get_future();
+  std::thread answerer([p = std::move(promise)]() mutable { p.set_value(find_the_answer_to_ltuae()); });
+  std::cout << "The lean answer is " << lean_answer.get() << std::endl;
+  answerer.join();
+
+  // exceptions and broken promises reach get() like with std::future
+  lean_promise<void> failing;
+  lean_future<void> failed = failing.get_future();
+  failing.set_exception(std::make_exception_ptr(std::runtime_error("no answer")));
+  try {
+    failed.get();
+    assert(false);
+  } catch (std::runtime_error const &) {
+  }
+  lean_future<std::string> abandoned = lean_promise<std::string>().get_future();
+  try {
+    abandoned.get();
+    assert(false);
+  } catch ([[maybe_unused]] std::future_error const &e) {
+    assert(e.code() == std::future_errc::broken_promise);
+  }
+
+  std::cout << "std::promise, same thread:   " << ns_per_future<std::promise>(false) << " ns\n";
+  std::cout << "lean_promise, same thread:   " << ns_per_future<lean_promise>(false) << " ns\n";
+  std::cout << "std::promise, other thread:  " << ns_per_future<std::promise>(true) << " ns\n";
+  std::cout << "lean_promise, other thread:  " << ns_per_future<lean_promise>(true) << " ns\n";
 }
 
 // run in a new thread
@@ -1,43 +1,132 @@
-#include <deque>
-#include <future>
-#include <mutex>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
-std::mutex m;
-// the type of tasks would be double(int, float&) if it expected functions with return type double and argumentts an int
-// and a float reference
-std::deque<std::packaged_task<void()>> tasks;
+#include <unistd.h> // pipe, read, write, close
 
-bool gui_shutdown_message_received();
+#include "lean_future.hpp"
+#include "run_loop.hpp"
+#include "unique_function.hpp"
 
-void get_and_process_gui_message();
+// the gui thread sleeps in the loop until a task is posted or a gui message arrives, instead of polling for both.
+// Tasks are any move-only callable: the function and a lean_promise when the poster wants a future, or the bare
+// function, which small captures keep free of allocations
+run_loop gui_loop;
+// the window system writes the gui messages into gui_messages[1], one byte each
+int gui_messages[2];
+bool shutdown_message_received = false; // only used by the gui thread
+
+bool gui_shutdown_message_received() {
+  return shutdown_message_received;
+}
+
+void get_and_process_gui_message() {
+  char message = 0;
+  if (read(gui_messages[0], &message, 1) == 1 && message == 'q') {
+    shutdown_message_received = true;
+  }
+}
 
 void gui_thread() {
-  while (!gui_shutdown_message_received()) {
+  gui_loop.watch(gui_messages[0], [] {
     get_and_process_gui_message();
-    std::packaged_task<void()> task;
+    if (gui_shutdown_message_received()) {
+      gui_loop.stop();
+    }
+  });
+  gui_loop.run();
+}
 
-    {
-      std::lock_guard<std::mutex> lk(m);
-      if (tasks.empty()) {
-        continue;
+// a std::packaged_task would allocate a shared state and lock its mutex to store the result, a lean_promise takes
+// its state from a per-thread pool and stores the result with one atomic operation
+template <typename Func>
+lean_future<std::invoke_result_t<Func &>> post_task_for_gui_thread(Func f,
+                                                                   run_priority priority = run_priority::normal) {
+  using result_type = std::invoke_result_t<Func &>;
+  lean_promise<result_type> promise;
+  lean_future<result_type> res = promise.get_future();
+  auto task = [f = std::move(f), promise = std::move(promise)]() mutable {
+    try {
+      if constexpr (std::is_void<result_type>::value) {
+        f();
+        promise.set_value();
+      } else {
+        promise.set_value(f());
       }
-      task = std::move(tasks.front());
-      tasks.pop_front();
+    } catch (...) {
+      promise.set_exception(std::current_exception());
     }
+  };
+  gui_loop.post(std::move(task), priority);
+  return res;
+}
 
-    task();
-  }
+// for tasks nobody waits for: no shared state to allocate
+template <typename Func>
+void post_for_gui_thread(Func f, run_priority priority = run_priority::normal) {
+  gui_loop.post(std::move(f), priority);
 }
 
-std::thread gui_bg_thread(gui_thread);
+// a repaint draws the current state, so it serves all the requests that arrived before it ran
+constexpr std::uint64_t REPAINT = 1;
+int repaints = 0; // only used by the gui thread
 
-template <typename Func>
-std::future<void> post_task_for_gui_thread(Func f) {
-  std::packaged_task<void()> task(f);
-  std::future<void> res = task.get_future();
-  std::lock_guard<std::mutex> lk(m);
-  tasks.push_back(std::move(task));
-  return res;
+void request_repaint() {
+  gui_loop.post_coalesced(REPAINT, [] { ++repaints; });
+}
+
+int main() {
+  if (pipe(gui_messages) != 0) {
+    return 1;
+  }
+
+  // posted before the loop runs, so the first wake-up takes both: the high priority one goes first
+  std::vector<std::string> order; // only used by the gui thread
+  post_for_gui_thread([&order] { order.push_back("normal"); });
+  post_for_gui_thread([&order] { order.push_back("high"); }, run_priority::high);
+
+  std::thread gui_bg_thread(gui_thread);
+
+  // posted and waited for outside the asserts, which NDEBUG compiles out
+  [[maybe_unused]] std::vector<std::string> const ran = post_task_for_gui_thread([&order] { return order; }).get();
+  assert((ran == std::vector<std::string>{"high", "normal"}));
+  [[maybe_unused]] int const answer = post_task_for_gui_thread([] { return 6 * 7; }).get();
+  assert(answer == 42);
+
+  // a burst of repaint requests, coalesced into a few repaints
+  for (int i = 0; i < 1'000; ++i) {
+    request_repaint();
+  }
+  int const painted = post_task_for_gui_thread([] { return repaints; }).get();
+  assert(painted >= 1 && painted < 1'000);
+  std::cout << "1000 repaint requests, " << painted << " repaints\n";
+
+  // a burst of tasks, taken by the gui thread a batch at a time
+  constexpr int BURST = 1'000'000;
+  int counter = 0; // only used by the gui thread
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BURST; ++i) {
+    post_for_gui_thread([&counter] { ++counter; });
+  }
+  [[maybe_unused]] int const counted = post_task_for_gui_thread([&counter] { return counter; }).get();
+  auto const elapsed = std::chrono::steady_clock::now() - start;
+  assert(counted == BURST);
+  std::cout << BURST << " tasks in " << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+            << " ms\n";
+
+  char const quit = 'q';
+  if (write(gui_messages[1], &quit, 1) != 1) {
+    return 1;
+  }
+  gui_bg_thread.join();
+  close(gui_messages[0]);
+  close(gui_messages[1]);
+  return 0;
 }
@@ -0,0 +1,455 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint> // std::uint32_t, std::uint64_t
+#include <future>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "unique_function.hpp"
+
+// identifies a scheduled timer, so that it can be cancelled. The generation
+// makes a stale id (of a timer that already fired) harmless, even if its node
+// has been reused by a newer timer.
+struct timer_id
+{
+  std::uint32_t _index;
+  std::uint32_t _generation;
+};
+
+// Hashed hierarchical timing wheel (Varghese & Lauck).
+// Time is divided in ticks of the given resolution. Level 0 has one slot per
+// tick for the next SLOTS ticks, and every next level has slots SLOTS times
+// wider than the previous one. A timer is put in the lowest level that covers
+// its expiry, which is O(1), and it is moved down a level ("cascaded") when the
+// wheel of the level below completes a rotation.
+// Timers are linked in intrusive doubly linked lists, so cancelling is O(1),
+// and their nodes are recycled, so scheduling doesn't allocate once the wheel
+// has warmed up.
+// A single timer thread advances the wheel and runs all the tasks that expired
+// in a tick as one batch, without holding the lock.
+class timer_wheel
+{
+private:
+  using clock = std::chrono::steady_clock;
+
+  static constexpr unsigned LEVEL_BITS = 8;
+  static constexpr std::size_t SLOTS = std::size_t{1} << LEVEL_BITS;
+  static constexpr std::uint64_t SLOT_MASK = SLOTS - 1;
+  static constexpr unsigned LEVELS = 4;
+  static constexpr std::uint64_t MAX_DELTA
+      = (std::uint64_t{1} << (LEVEL_BITS * LEVELS)) - 1;
+  static constexpr std::uint32_t NIL
+      = std::numeric_limits<std::uint32_t>::max();
+
+  enum class node_state
+  {
+    free,
+    pending,
+    running,
+    cancelled
+  };
+
+  struct node
+  {
+    unique_function<void()> _task;
+    std::uint64_t _expiry{0};
+    // 0 for one-shot timers
+    std::uint64_t _period{0};
+    std::uint32_t _generation{0};
+    std::uint32_t _prev{NIL};
+    std::uint32_t _next{NIL};
+    // slot list the node is linked in, only meaningful while pending
+    std::uint32_t *_list{nullptr};
+    node_state _state{node_state::free};
+  };
+
+  struct expired_task
+  {
+    std::uint32_t _index;
+    bool _periodic;
+    unique_function<void()> _task;
+  };
+
+  clock::duration const _resolution;
+  clock::time_point const _start;
+
+  std::mutex _m;
+  std::condition_variable _cond;
+  std::array<std::array<std::uint32_t, SLOTS>, LEVELS> _slots;
+  std::vector<node> _nodes;
+  std::uint32_t _free_list{NIL};
+  std::uint64_t _current_tick{0};
+  std::size_t _pending{0};
+  bool _idle{false};
+  bool _stop{false};
+  std::vector<expired_task> _expired;
+  std::thread _timer_thread;
+
+  std::uint64_t
+  tick_of(clock::time_point tp) const {
+    if (tp <= _start) {
+      return 0;
+    }
+    // round up, so that a timer never fires before its delay has passed
+    return static_cast<std::uint64_t>(
+        (tp - _start + _resolution - clock::duration{1}) / _resolution);
+  }
+
+  clock::time_point
+  time_of(std::uint64_t tick) const {
+    return _start + static_cast<clock::duration::rep>(tick) * _resolution;
+  }
+
+  std::uint32_t
+  allocate_node() {
+    if (_free_list == NIL) {
+      _nodes.emplace_back();
+      return static_cast<std::uint32_t>(_nodes.size() - 1);
+    }
+    std::uint32_t const index = _free_list;
+    _free_list = _nodes[index]._next;
+    return index;
+  }
+
+  void
+  free_node(std::uint32_t index) {
+    node &n = _nodes[index];
+    n._task = nullptr;
+    n._state = node_state::free;
+    ++n._generation;
+    n._prev = NIL;
+    n._next = _free_list;
+    _free_list = index;
+  }
+
+  void
+  link(std::uint32_t index) {
+    node &n = _nodes[index];
+    std::uint64_t const delta
+        = n._expiry > _current_tick
+              ? std::min(n._expiry - _current_tick, MAX_DELTA)
+              : 0;
+    unsigned level = 0;
+    while ((delta >> (LEVEL_BITS * (level + 1))) != 0) {
+      ++level;
+    }
+    // a timer that is past its expiry goes to the current slot of level 0,
+    // which is processed right after cascading
+    std::uint64_t const expiry = _current_tick + delta;
+    std::uint32_t &head
+        = _slots[level][(expiry >> (LEVEL_BITS * level)) & SLOT_MASK];
+
+    n._list = &head;
+    n._prev = NIL;
+    n._next = head;
+    if (head != NIL) {
+      _nodes[head]._prev = index;
+    }
+    head = index;
+  }
+
+  void
+  unlink(std::uint32_t index) {
+    node &n = _nodes[index];
+    if (n._prev != NIL) {
+      _nodes[n._prev]._next = n._next;
+    } else {
+      *n._list = n._next;
+    }
+    if (n._next != NIL) {
+      _nodes[n._next]._prev = n._prev;
+    }
+    n._list = nullptr;
+  }
+
+  // true when the wheels of all levels below level wrap around at tick
+  static bool
+  completes_rotation(std::uint64_t tick, unsigned level) {
+    return (tick & ((std::uint64_t{1} << (LEVEL_BITS * level)) - 1)) == 0;
+  }
+
+  // re-insert all the timers of a slot relative to the current tick, which
+  // moves them to lower levels
+  void
+  cascade(unsigned level) {
+    std::uint32_t &head
+        = _slots[level][(_current_tick >> (LEVEL_BITS * level)) & SLOT_MASK];
+    std::uint32_t index = head;
+    head = NIL;
+    while (index != NIL) {
+      std::uint32_t const next = _nodes[index]._next;
+      link(index);
+      index = next;
+    }
+  }
+
+  // move to the next tick and collect the timers that expire on it
+  void
+  advance() {
+    ++_current_tick;
+    // cascade the highest level first, so that its timers can be cascaded
+    // again by the levels below if needed
+    unsigned top = 0;
+    while (top + 1 < LEVELS && completes_rotation(_current_tick, top + 1)) {
+      ++top;
+    }
+    for (unsigned level = top; level > 0; --level) {
+      cascade(level);
+    }
+
+    std::uint32_t &head = _slots[0][_current_tick & SLOT_MASK];
+    std::uint32_t index = head;
+    head = NIL;
+    while (index != NIL) {
+      node &n = _nodes[index];
+      std::uint32_t const next = n._next;
+      _expired.push_back(
+          expired_task{index, n._period != 0, std::move(n._task)});
+      --_pending;
+      if (n._period == 0) {
+        free_node(index);
+      } else {
+        n._state = node_state::running;
+        n._list = nullptr;
+      }
+      index = next;
+    }
+  }
+
+  // called by the timer thread after running a periodic task
+  void
+  reschedule(expired_task &done) {
+    node &n = _nodes[done._index];
+    if (n._state == node_state::cancelled) {
+      free_node(done._index);
+      return;
+    }
+    n._task = std::move(done._task);
+    n._state = node_state::pending;
+    // keep the original phase, unless the task overran its period
+    n._expiry = std::max(n._expiry + n._period, _current_tick + 1);
+    link(done._index);
+    ++_pending;
+  }
+
+  void
+  run() {
+    std::unique_lock<std::mutex> lk(_m);
+    std::vector<expired_task> batch;
+    while (!_stop) {
+      if (_pending == 0) {
+        _idle = true;
+        _cond.wait(lk, [this] { return _stop || _pending != 0; });
+        _idle = false;
+        continue;
+      }
+
+      std::uint64_t const now_tick = tick_of(clock::now());
+      while (_current_tick < now_tick) {
+        advance();
+      }
+
+      if (_expired.empty()) {
+        _cond.wait_until(
+            lk, time_of(_current_tick + 1), [this] { return _stop; });
+        continue;
+      }
+
+      batch.swap(_expired);
+      lk.unlock();
+      for (expired_task &expired : batch) {
+        expired._task();
+      }
+      lk.lock();
+      // the nodes of one-shot timers were freed when they expired, and may
+      // have been reused while the lock was released
+      for (expired_task &expired : batch) {
+        if (expired._periodic) {
+          reschedule(expired);
+        }
+      }
+      batch.clear();
+    }
+  }
+
+  timer_id
+  schedule(clock::duration delay,
+           clock::duration period,
+           unique_function<void()> task) {
+    std::uint64_t const period_ticks
+        = period == clock::duration::zero()
+              ? 0
+              : std::max<std::uint64_t>(tick_of(_start + period), 1);
+
+    std::lock_guard<std::mutex> lk(_m);
+    if (_pending == 0) {
+      // nothing can expire while the wheel is empty, so skip the ticks the
+      // timer thread slept through instead of walking them one by one
+      _current_tick = std::max(_current_tick, tick_of(clock::now()));
+    }
+
+    std::uint32_t const index = allocate_node();
+    node &n = _nodes[index];
+    n._task = std::move(task);
+    n._expiry = std::max(tick_of(clock::now() + delay), _current_tick + 1);
+    n._period = period_ticks;
+    n._state = node_state::pending;
+    link(index);
+    ++_pending;
+
+    // the timer thread only sleeps until the next tick while there are pending
+    // timers, so it only needs waking if it was idle
+    if (_idle) {
+      _cond.notify_one();
+    }
+    return timer_id{index, n._generation};
+  }
+
+public:
+  explicit timer_wheel(clock::duration resolution
+                       = std::chrono::milliseconds(1))
+      : _resolution(resolution),
+        _start(clock::now()) {
+    for (auto &level : _slots) {
+      level.fill(NIL);
+    }
+    _timer_thread = std::thread(&timer_wheel::run, this);
+  }
+
+  ~timer_wheel() {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _stop = true;
+    }
+    _cond.notify_one();
+    _timer_thread.join();
+  }
+
+  timer_wheel(timer_wheel const &) = delete;
+  timer_wheel(timer_wheel &&) = delete;
+  timer_wheel &operator=(timer_wheel const &) = delete;
+  timer_wheel &operator=(timer_wheel &&) = delete;
+
+  /// Run task once, after delay. Pass a std::packaged_task to wait for it
+  /// through its future.
+  timer_id
+  schedule_after(clock::duration delay, unique_function<void()> task) {
+    return schedule(delay, clock::duration::zero(), std::move(task));
+  }
+
+  /// Run task every period, starting one period from now. The same task runs
+  /// every time, so it can't be a std::packaged_task, which only runs once.
+  timer_id
+  schedule_every(clock::duration period, unique_function<void()> task) {
+    return schedule(period, period, std::move(task));
+  }
+
+  /// Returns true if the timer was cancelled before it fired. A cancelled
+  /// one-shot task is destroyed, so its future reports a broken promise.
+  bool
+  cancel(timer_id id) {
+    std::lock_guard<std::mutex> lk(_m);
+    if (id._index >= _nodes.size()) {
+      return false;
+    }
+    node &n = _nodes[id._index];
+    if (n._generation != id._generation) {
+      return false;
+    }
+    switch (n._state) {
+    case node_state::pending:
+      unlink(id._index);
+      --_pending;
+      free_node(id._index);
+      return true;
+    case node_state::running:
+      // a periodic task that is running right now, don't reschedule it
+      n._state = node_state::cancelled;
+      return true;
+    case node_state::free:
+    case node_state::cancelled:
+      break;
+    }
+    return false;
+  }
+};
+
+int
+main() {
+  using namespace std::chrono_literals;
+
+  timer_wheel wheel;
+
+  // one-shot timers fire in the order of their delays, even when the delays
+  // span different levels of the wheel
+  std::mutex order_mtx;
+  std::vector<int> order;
+  std::vector<std::future<void>> futures;
+  for (int delay_ms : {300, 5, 50, 1}) {
+    std::packaged_task<void()> task([&order_mtx, &order, delay_ms] {
+      std::lock_guard<std::mutex> lk(order_mtx);
+      order.push_back(delay_ms);
+    });
+    futures.push_back(task.get_future());
+    wheel.schedule_after(std::chrono::milliseconds(delay_ms), std::move(task));
+  }
+
+  // a cancelled timer never runs and its future is abandoned
+  std::packaged_task<void()> cancelled_task([] { assert(false); });
+  std::future<void> cancelled_future = cancelled_task.get_future();
+  timer_id const cancelled
+      = wheel.schedule_after(100ms, std::move(cancelled_task));
+  [[maybe_unused]] bool const first_cancel = wheel.cancel(cancelled);
+  [[maybe_unused]] bool const second_cancel = wheel.cancel(cancelled);
+  assert(first_cancel && !second_cancel);
+
+  // periodic timer, cancelled after a few runs
+  std::atomic<int> ticks{0};
+  timer_id const periodic = wheel.schedule_every(10ms, [&ticks] { ++ticks; });
+
+  for (std::future<void> &f : futures) {
+    f.wait();
+  }
+  assert((order == std::vector<int>{1, 5, 50, 300}));
+  [[maybe_unused]] bool const periodic_cancelled = wheel.cancel(periodic);
+  assert(periodic_cancelled && ticks > 0);
+
+  try {
+    cancelled_future.get();
+    assert(false);
+  } catch (std::future_error const &e) {
+    assert(e.code() == std::future_errc::broken_promise);
+  }
+
+  // many short timers, expiring in batches: the tasks are stored in the nodes,
+  // so scheduling them allocates nothing
+  static constexpr int NUM_TIMERS = 100'000;
+  std::atomic<int> fired{0};
+  std::promise<void> all_fired;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < NUM_TIMERS; ++i) {
+    wheel.schedule_after(std::chrono::milliseconds(i % 100),
+                         [&fired, &all_fired] {
+                           if (++fired == NUM_TIMERS) {
+                             all_fired.set_value();
+                           }
+                         });
+  }
+  std::chrono::duration<double> const elapsed
+      = std::chrono::steady_clock::now() - start;
+  all_fired.get_future().wait();
+
+  std::cout << "Periodic timer fired " << ticks << " times\n";
+  std::cout << "Scheduled " << NUM_TIMERS << " timers at "
+            << NUM_TIMERS / elapsed.count() << " timers/s\n";
+
+  return 0;
+}
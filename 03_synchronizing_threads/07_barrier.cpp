@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef> // std::size_t, std::ptrdiff_t
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cache_line.hpp"
+#include "wait_strategy.hpp" // spin_until
+
+// Single-use countdown: threads block in wait() until count_down() has been
+// called expected times in total.
+class latch
+{
+private:
+  std::atomic<std::ptrdiff_t> _count;
+  std::mutex _m;
+  std::condition_variable _cond;
+
+public:
+  explicit latch(std::ptrdiff_t expected) : _count(expected) {}
+
+  latch(latch const &) = delete;
+  latch(latch &&) = delete;
+  latch &
+  operator=(latch const &) = delete;
+  latch &
+  operator=(latch &&) = delete;
+  ~latch() = default;
+
+  void
+  count_down(std::ptrdiff_t n = 1) {
+    if (_count.fetch_sub(n, std::memory_order_acq_rel) == n) {
+      // take the mutex, so that a waiter that just found the count non-zero
+      // is already waiting on the condition variable when we notify it
+      { std::lock_guard<std::mutex> lk(_m); }
+      _cond.notify_all();
+    }
+  }
+
+  bool
+  try_wait() const {
+    return _count.load(std::memory_order_acquire) == 0;
+  }
+
+  void
+  wait() {
+    if (try_wait()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lk(_m);
+    _cond.wait(lk, [this] { return try_wait(); });
+  }
+
+  void
+  arrive_and_wait(std::ptrdiff_t n = 1) {
+    count_down(n);
+    wait();
+  }
+};
+
+// Reusable barrier for a fixed set of num_threads threads, each of which passes
+// its id in [0, num_threads) to arrive_and_wait().
+// Threads are grouped FanIn at a time under the leaves of a tree. The last
+// thread to arrive at a node goes on to arrive at its parent, and the last one
+// at the root starts the release, which travels back down the tree: every node
+// has its own sense flag that only its waiters spin on. An arrival touches
+// O(log(num_threads)) cache lines and no cache line is spun on by more than
+// FanIn threads.
+// Sense reversal (every phase waits for the flags to flip to the opposite
+// value of the previous phase) makes the barrier reusable without resetting the
+// flags.
+template <unsigned FanIn = 4>
+class tree_barrier
+{
+  static_assert(FanIn >= 2, "a tree node needs to combine at least 2 arrivals");
+
+private:
+  static constexpr std::size_t NO_PARENT = static_cast<std::size_t>(-1);
+
+  struct alignas(CACHE_LINE_SIZE) node
+  {
+    std::atomic<unsigned> _count{0};
+    std::atomic<bool> _sense{false};
+    unsigned _fan_in{0};
+    std::size_t _parent{NO_PARENT};
+  };
+
+  struct alignas(CACHE_LINE_SIZE) thread_state
+  {
+    bool _sense{true};
+  };
+
+  std::vector<node> _nodes;
+  std::vector<thread_state> _threads;
+
+  void
+  arrive(std::size_t index, bool sense) {
+    node &n = _nodes[index];
+    if (n._count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      if (n._parent != NO_PARENT) {
+        arrive(n._parent, sense);
+      }
+      // nobody touches the count until they see the flag flip
+      n._count.store(n._fan_in, std::memory_order_relaxed);
+      n._sense.store(sense, std::memory_order_release);
+    } else {
+      spin_until([&n, sense] {
+        return n._sense.load(std::memory_order_acquire) == sense;
+      });
+    }
+  }
+
+  static std::size_t
+  count_nodes(std::size_t children) {
+    std::size_t total = 0;
+    do {
+      children = (children + FanIn - 1) / FanIn;
+      total += children;
+    } while (children > 1);
+    return total;
+  }
+
+public:
+  explicit tree_barrier(unsigned num_threads)
+      : _nodes(count_nodes(num_threads)),
+        _threads(num_threads) {
+    // build the tree bottom-up, one level at a time. The first level has the
+    // threads as children, the next ones the nodes of the level below.
+    std::size_t level_begin = 0;
+    std::size_t children = num_threads;
+    while (true) {
+      std::size_t const width = (children + FanIn - 1) / FanIn;
+      for (std::size_t i = 0; i < width; ++i) {
+        std::size_t const first_child = i * FanIn;
+        unsigned const fan_in = static_cast<unsigned>(
+            std::min<std::size_t>(FanIn, children - first_child));
+        node &n = _nodes[level_begin + i];
+        n._fan_in = fan_in;
+        n._count.store(fan_in, std::memory_order_relaxed);
+        if (width > 1) {
+          n._parent = level_begin + width + i / FanIn;
+        }
+      }
+      if (width <= 1) {
+        break;
+      }
+      level_begin += width;
+      children = width;
+    }
+  }
+
+  tree_barrier(tree_barrier const &) = delete;
+  tree_barrier(tree_barrier &&) = delete;
+  tree_barrier &
+  operator=(tree_barrier const &) = delete;
+  tree_barrier &
+  operator=(tree_barrier &&) = delete;
+  ~tree_barrier() = default;
+
+  void
+  arrive_and_wait(unsigned id) {
+    bool const sense = _threads[id]._sense;
+    arrive(id / FanIn, sense);
+    _threads[id]._sense = !sense;
+  }
+};
+
+// Reusable barrier for a fixed set of num_threads threads, each of which passes
+// its id in [0, num_threads) to arrive_and_wait().
+// There is no shared counter at all: in round k every thread signals thread
+// (id + 2^k) % num_threads and waits for the signal of thread
+// (id - 2^k) % num_threads. After ceil(log2(num_threads)) rounds every thread
+// has transitively heard from every other one. Every thread spins only on its
+// own cache line.
+// The flags alternate between two sets (parity), and the value that means
+// "signalled" flips every two phases, so they never need to be reset.
+class dissemination_barrier
+{
+private:
+  static constexpr unsigned MAX_ROUNDS = 32;
+
+  struct alignas(CACHE_LINE_SIZE) thread_state
+  {
+    unsigned _parity{0};
+    bool _sense{true};
+    // written by the partners, so keep them off the line of the fields above
+    alignas(CACHE_LINE_SIZE)
+        std::array<std::array<std::atomic<bool>, MAX_ROUNDS>, 2> _flags{};
+  };
+
+  std::vector<thread_state> _threads;
+  unsigned _rounds{0};
+
+public:
+  explicit dissemination_barrier(unsigned num_threads) : _threads(num_threads) {
+    while ((1U << _rounds) < num_threads) {
+      ++_rounds;
+    }
+  }
+
+  dissemination_barrier(dissemination_barrier const &) = delete;
+  dissemination_barrier(dissemination_barrier &&) = delete;
+  dissemination_barrier &
+  operator=(dissemination_barrier const &) = delete;
+  dissemination_barrier &
+  operator=(dissemination_barrier &&) = delete;
+  ~dissemination_barrier() = default;
+
+  void
+  arrive_and_wait(unsigned id) {
+    auto const num_threads = static_cast<unsigned>(_threads.size());
+    thread_state &self = _threads[id];
+    unsigned const parity = self._parity;
+    bool const sense = self._sense;
+
+    for (unsigned round = 0; round < _rounds; ++round) {
+      unsigned const partner = (id + (1U << round)) % num_threads;
+      _threads[partner]._flags[parity][round].store(sense,
+                                                    std::memory_order_release);
+      std::atomic<bool> &flag = self._flags[parity][round];
+      spin_until([&flag, sense] {
+        return flag.load(std::memory_order_acquire) == sense;
+      });
+    }
+
+    if (parity == 1) {
+      self._sense = !sense;
+    }
+    self._parity = 1 - parity;
+  }
+};
+
+// every thread writes its slot of one of two buffers and, after the barrier,
+// checks the slot of its neighbour. The buffers alternate between phases, so a
+// single barrier per phase is enough.
+template <typename Barrier>
+void
+run_phases(Barrier &barrier,
+           std::array<std::vector<unsigned>, 2> &buffers,
+           unsigned id,
+           unsigned num_phases,
+           std::atomic<bool> &all_ok) {
+  auto const num_threads = static_cast<unsigned>(buffers[0].size());
+  bool ok = true;
+  for (unsigned phase = 0; phase < num_phases; ++phase) {
+    std::vector<unsigned> &buffer = buffers[phase % 2];
+    buffer[id] = phase;
+    barrier.arrive_and_wait(id);
+    ok = ok && buffer[(id + 1) % num_threads] == phase;
+  }
+  if (!ok) {
+    all_ok = false;
+  }
+}
+
+template <typename Barrier>
+double
+time_phases(unsigned num_threads, unsigned num_phases) {
+  Barrier barrier(num_threads);
+  std::array<std::vector<unsigned>, 2> buffers{
+      std::vector<unsigned>(num_threads), std::vector<unsigned>(num_threads)};
+  std::atomic<bool> all_ok{true};
+
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned id = 0; id < num_threads; ++id) {
+    threads.emplace_back(run_phases<Barrier>,
+                         std::ref(barrier),
+                         std::ref(buffers),
+                         id,
+                         num_phases,
+                         std::ref(all_ok));
+  }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  std::chrono::duration<double> const elapsed
+      = std::chrono::steady_clock::now() - start;
+
+  assert(all_ok);
+  return elapsed.count() / num_phases;
+}
+
+// the alternative without a barrier: start and join the threads for every phase
+double
+time_join_per_phase(unsigned num_threads, unsigned num_phases) {
+  std::vector<unsigned> buffer(num_threads);
+
+  auto const start = std::chrono::steady_clock::now();
+  for (unsigned phase = 0; phase < num_phases; ++phase) {
+    std::vector<std::thread> threads;
+    for (unsigned id = 0; id < num_threads; ++id) {
+      threads.emplace_back([&buffer, id, phase] { buffer[id] = phase; });
+    }
+    std::for_each(
+        threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  }
+  std::chrono::duration<double> const elapsed
+      = std::chrono::steady_clock::now() - start;
+
+  return elapsed.count() / num_phases;
+}
+
+int
+main() {
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+  static constexpr unsigned NUM_PHASES = 2'000;
+
+  // the workers initialize and the main thread waits for all of them
+  {
+    latch ready(num_threads);
+    std::vector<unsigned> initialized(num_threads, 0);
+    std::vector<std::thread> threads;
+    for (unsigned id = 0; id < num_threads; ++id) {
+      threads.emplace_back([&ready, &initialized, id] {
+        initialized[id] = 1;
+        ready.count_down();
+      });
+    }
+    ready.wait();
+    assert(std::count(initialized.begin(), initialized.end(), 1U)
+           == static_cast<std::ptrdiff_t>(num_threads));
+    std::for_each(
+        threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  }
+
+  // odd thread counts exercise partially filled tree nodes and wrapping
+  // dissemination partners
+  for (unsigned n : {1U, 3U, 7U}) {
+    time_phases<tree_barrier<>>(n, 100);
+    time_phases<tree_barrier<2>>(n, 100);
+    time_phases<dissemination_barrier>(n, 100);
+  }
+
+  std::cout << "Cost per phase with " << num_threads << " threads\n";
+  std::cout << "  tree barrier:          "
+            << time_phases<tree_barrier<>>(num_threads, NUM_PHASES) * 1e6
+            << "us\n";
+  std::cout << "  dissemination barrier: "
+            << time_phases<dissemination_barrier>(num_threads, NUM_PHASES)
+                   * 1e6
+            << "us\n";
+  std::cout << "  join and respawn:      "
+            << time_join_per_phase(num_threads, NUM_PHASES) * 1e6 << "us\n";
+
+  return 0;
+}
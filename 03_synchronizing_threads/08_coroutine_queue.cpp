@@ -0,0 +1,543 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef> // std::size_t
+#include <deque>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "thread_group.hpp"
+
+// wait_and_pop() in 03_thread_safe_queue.cpp and future::get() in
+// 04_async_future.cpp block the calling thread until the data is there, so
+// every waiter costs a whole thread. A coroutine that co_awaits an
+// async_queue::pop() is suspended instead: the waiter is just its coroutine
+// frame, parked in the queue until a push() hands it a value and resumes it.
+
+template <typename T>
+class task;
+
+template <typename T>
+class task_promise_base
+{
+  // when the task finishes, continue with whoever co_awaited it
+  struct final_awaiter
+  {
+    bool
+    await_ready() noexcept {
+      return false;
+    }
+
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> h) noexcept {
+      return h.promise()._continuation;
+    }
+
+    void
+    await_resume() noexcept {}
+  };
+
+public:
+  std::coroutine_handle<> _continuation{std::noop_coroutine()};
+  std::exception_ptr _exception;
+
+  // tasks are lazy: they start when they are co_awaited
+  std::suspend_always
+  initial_suspend() noexcept {
+    return {};
+  }
+
+  final_awaiter
+  final_suspend() noexcept {
+    return {};
+  }
+
+  void
+  unhandled_exception() {
+    _exception = std::current_exception();
+  }
+};
+
+template <typename T>
+class task_promise : public task_promise_base<T>
+{
+private:
+  std::optional<T> _value;
+
+public:
+  task<T>
+  get_return_object();
+
+  template <typename U>
+  void
+  return_value(U &&value) {
+    _value.emplace(std::forward<U>(value));
+  }
+
+  T
+  result() {
+    if (this->_exception) {
+      std::rethrow_exception(this->_exception);
+    }
+    return std::move(*_value);
+  }
+};
+
+template <>
+class task_promise<void> : public task_promise_base<void>
+{
+public:
+  task<void>
+  get_return_object();
+
+  void
+  return_void() {}
+
+  void
+  result() {
+    if (_exception) {
+      std::rethrow_exception(_exception);
+    }
+  }
+};
+
+/// Coroutine returning a T. It starts running when it is co_awaited, on the
+/// thread of the awaiter, which resumes when it co_returns.
+template <typename T = void>
+class task
+{
+public:
+  using promise_type = task_promise<T>;
+
+private:
+  std::coroutine_handle<promise_type> _handle;
+
+public:
+  explicit task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  task(task const &) = delete;
+  task &
+  operator=(task const &) = delete;
+
+  task(task &&other) noexcept
+      : _handle(std::exchange(other._handle, nullptr)) {}
+
+  task &
+  operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (_handle) {
+        _handle.destroy();
+      }
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+
+  ~task() {
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+  auto
+  operator co_await() && noexcept {
+    struct awaiter
+    {
+      std::coroutine_handle<promise_type> _handle;
+
+      bool
+      await_ready() noexcept {
+        return _handle.done();
+      }
+
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        _handle.promise()._continuation = awaiting;
+        // switch straight to the task, without growing the stack
+        return _handle;
+      }
+
+      T
+      await_resume() {
+        return _handle.promise().result();
+      }
+    };
+    return awaiter{_handle};
+  }
+};
+
+template <typename T>
+task<T>
+task_promise<T>::get_return_object() {
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void>
+task_promise<void>::get_return_object() {
+  return task<void>(
+      std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// Coroutine that starts right away and destroys itself when it's done; used to
+// run a task without anyone co_awaiting it
+struct detached_task
+{
+  struct promise_type
+  {
+    detached_task
+    get_return_object() noexcept {
+      return {};
+    }
+
+    std::suspend_never
+    initial_suspend() noexcept {
+      return {};
+    }
+
+    std::suspend_never
+    final_suspend() noexcept {
+      return {};
+    }
+
+    void
+    return_void() noexcept {}
+
+    void
+    unhandled_exception() noexcept {
+      std::terminate();
+    }
+  };
+};
+
+/// Worker threads that resume coroutines
+class coroutine_pool
+{
+public:
+  struct schedule_awaiter
+  {
+    coroutine_pool &_pool;
+
+    bool
+    await_ready() noexcept {
+      return false;
+    }
+
+    void
+    await_suspend(std::coroutine_handle<> h) {
+      _pool.schedule(h);
+    }
+
+    void
+    await_resume() noexcept {}
+  };
+
+private:
+  std::mutex _m;
+  std::condition_variable _cond;
+  std::deque<std::coroutine_handle<>> _ready;
+  bool _stop{false};
+  // last, so that the workers are joined before the members they use go away
+  thread_group _workers;
+
+  void
+  run() {
+    while (true) {
+      std::unique_lock<std::mutex> lk(_m);
+      _cond.wait(lk, [this] { return !_ready.empty() || _stop; });
+      if (_ready.empty()) {
+        return;
+      }
+      std::coroutine_handle<> const h = _ready.front();
+      _ready.pop_front();
+      lk.unlock();
+      h.resume();
+    }
+  }
+
+  static detached_task
+  run_detached(coroutine_pool &pool, task<void> t) {
+    co_await pool.schedule();
+    co_await std::move(t);
+  }
+
+public:
+  explicit coroutine_pool(
+      unsigned num_threads = std::max(std::thread::hardware_concurrency(), 1U))
+      : _workers("coroutines", placement::none) {
+    for (unsigned i = 0; i < num_threads; ++i) {
+      _workers.spawn([this] { run(); });
+    }
+  }
+
+  coroutine_pool(coroutine_pool const &) = delete;
+  coroutine_pool(coroutine_pool &&) = delete;
+  coroutine_pool &
+  operator=(coroutine_pool const &) = delete;
+  coroutine_pool &
+  operator=(coroutine_pool &&) = delete;
+
+  /// Finishes the coroutines that are ready to run, those that are still
+  /// suspended on something else are left alone
+  ~coroutine_pool() {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _stop = true;
+    }
+    _cond.notify_all();
+    _workers.join();
+  }
+
+  /// Resume h on one of the workers
+  void
+  schedule(std::coroutine_handle<> h) {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _ready.push_back(h);
+    }
+    _cond.notify_one();
+  }
+
+  /// co_await pool.schedule() to continue on one of the workers
+  schedule_awaiter
+  schedule() noexcept {
+    return schedule_awaiter{*this};
+  }
+
+  /// Run t on the workers, without waiting for it. Exceptions escaping t
+  /// terminate the program.
+  void
+  spawn(task<void> t) {
+    run_detached(*this, std::move(t));
+  }
+
+  std::size_t
+  size() const {
+    return _workers.size();
+  }
+};
+
+template <typename T>
+detached_task
+complete_promise(task<T> t, std::promise<T> p) {
+  try {
+    if constexpr (std::is_void<T>::value) {
+      co_await std::move(t);
+      p.set_value();
+    } else {
+      p.set_value(co_await std::move(t));
+    }
+  } catch (...) {
+    p.set_exception(std::current_exception());
+  }
+}
+
+/// Run t, and block the calling (non-coroutine) thread until it's done
+template <typename T>
+T
+sync_wait(task<T> t) {
+  std::promise<T> p;
+  std::future<T> f = p.get_future();
+  complete_promise(std::move(t), std::move(p));
+  return f.get();
+}
+
+/// Unbounded queue whose pop() suspends the awaiting coroutine while the queue
+/// is empty. Suspended pops wait in FIFO order and push() hands its value
+/// straight to the oldest one, then resumes it: on the pool given to the
+/// constructor, or inline on the pushing thread if there is none.
+template <typename T>
+class async_queue
+{
+private:
+  class pop_awaiter
+  {
+    friend class async_queue;
+
+    async_queue &_queue;
+    std::coroutine_handle<> _handle;
+    std::optional<T> _value;
+    // the waiters form an intrusive list through their awaiters, which live in
+    // the frames of the suspended coroutines, so waiting allocates nothing
+    pop_awaiter *_next{nullptr};
+
+  public:
+    explicit pop_awaiter(async_queue &queue) : _queue(queue) {}
+
+    bool
+    await_ready() noexcept {
+      return false;
+    }
+
+    // returns false, and so doesn't suspend, if there was an element already
+    bool
+    await_suspend(std::coroutine_handle<> h) {
+      std::lock_guard<std::mutex> lk(_queue._m);
+      if (!_queue._items.empty()) {
+        _value.emplace(std::move(_queue._items.front()));
+        _queue._items.pop_front();
+        return false;
+      }
+      _handle = h;
+      if (_queue._waiters_tail != nullptr) {
+        _queue._waiters_tail->_next = this;
+      } else {
+        _queue._waiters_head = this;
+      }
+      _queue._waiters_tail = this;
+      return true;
+    }
+
+    T
+    await_resume() {
+      return std::move(*_value);
+    }
+  };
+
+  std::mutex _m;
+  std::deque<T> _items;
+  pop_awaiter *_waiters_head{nullptr};
+  pop_awaiter *_waiters_tail{nullptr};
+  coroutine_pool *_resume_on;
+
+public:
+  explicit async_queue(coroutine_pool *resume_on = nullptr)
+      : _resume_on(resume_on) {}
+
+  async_queue(async_queue const &) = delete;
+  async_queue(async_queue &&) = delete;
+  async_queue &
+  operator=(async_queue const &) = delete;
+  async_queue &
+  operator=(async_queue &&) = delete;
+  ~async_queue() = default;
+
+  void
+  push(T value) {
+    pop_awaiter *waiter = nullptr;
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      if (_waiters_head == nullptr) {
+        _items.push_back(std::move(value));
+        return;
+      }
+      waiter = _waiters_head;
+      _waiters_head = waiter->_next;
+      if (_waiters_head == nullptr) {
+        _waiters_tail = nullptr;
+      }
+      waiter->_value.emplace(std::move(value));
+    }
+    if (_resume_on != nullptr) {
+      _resume_on->schedule(waiter->_handle);
+    } else {
+      waiter->_handle.resume();
+    }
+  }
+
+  /// co_await q.pop() to get the oldest element, suspending until there is one
+  pop_awaiter
+  pop() {
+    return pop_awaiter(*this);
+  }
+
+  bool
+  empty() {
+    std::lock_guard<std::mutex> lk(_m);
+    return _items.empty();
+  }
+};
+
+task<int>
+square(coroutine_pool &pool, int x) {
+  co_await pool.schedule();
+  co_return x * x;
+}
+
+task<int>
+sum_of_squares(coroutine_pool &pool, int n) {
+  int sum = 0;
+  for (int i = 1; i <= n; ++i) {
+    sum += co_await square(pool, i);
+  }
+  co_return sum;
+}
+
+task<int>
+fails(coroutine_pool &pool) {
+  co_await pool.schedule();
+  throw std::runtime_error("task failed");
+}
+
+task<void>
+consumer(async_queue<long> &queue,
+         std::atomic<long> &total,
+         std::atomic<long> &remaining,
+         std::promise<void> &all_done) {
+  long const value = co_await queue.pop();
+  total += value;
+  if (--remaining == 0) {
+    all_done.set_value();
+  }
+}
+
+int
+main() {
+  // tasks awaiting tasks, hopping between the workers
+  {
+    coroutine_pool pool(4);
+    int const sum = sync_wait(sum_of_squares(pool, 10));
+    assert(sum == 385);
+    std::cout << "Sum of squares " << sum << '\n';
+
+    // exceptions travel to the awaiter
+    try {
+      sync_wait(fails(pool));
+      assert(false);
+    } catch (std::runtime_error const &e) {
+      std::cout << "Caught: " << e.what() << '\n';
+    }
+  }
+
+  // many more waiters than threads: every consumer is suspended in pop()
+  // until the producer hands it a value
+  {
+    static constexpr long NUM_CONSUMERS = 200'000;
+    std::atomic<long> total{0};
+    std::atomic<long> remaining{NUM_CONSUMERS};
+    std::promise<void> all_done;
+    std::future<void> done = all_done.get_future();
+    // declared after everything the consumers use, so that its workers are
+    // joined before any of it is destroyed
+    coroutine_pool pool(4);
+    async_queue<long> queue(&pool);
+
+    auto const start = std::chrono::steady_clock::now();
+    for (long i = 0; i < NUM_CONSUMERS; ++i) {
+      pool.spawn(consumer(queue, total, remaining, all_done));
+    }
+    for (long i = 1; i <= NUM_CONSUMERS; ++i) {
+      queue.push(i);
+    }
+    done.wait();
+    std::chrono::duration<double> const elapsed
+        = std::chrono::steady_clock::now() - start;
+
+    assert(total == NUM_CONSUMERS * (NUM_CONSUMERS + 1) / 2);
+    assert(queue.empty());
+    std::cout << NUM_CONSUMERS << " waiting consumers served by "
+              << pool.size() << " threads in " << elapsed.count() << "s\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,448 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef> // std::size_t
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A consumer of the threadsafe_queue in 03_thread_safe_queue.cpp can only block
+// on one queue at a time; watching several means polling try_pop() in a loop,
+// like the 100ms sleeps in 01_wait_for_flag.cpp. Channels add Go's close() (the
+// notify_production_done() of the queue) and let a select block on any number
+// of them at once: a waiting select is registered with every channel it
+// watches, and whichever channel becomes ready first wakes it.
+
+/// The waiting side of a select, which channels signal when they become ready
+class select_waiter
+{
+private:
+  std::mutex _m;
+  std::condition_variable _cond;
+  bool _signalled{false};
+
+public:
+  void
+  signal() {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _signalled = true;
+    }
+    _cond.notify_one();
+  }
+
+  /// Wait for a signal, without a deadline if deadline is empty. Returns false
+  /// on timeout.
+  bool
+  wait_until(
+      std::optional<std::chrono::steady_clock::time_point> const &deadline) {
+    std::unique_lock<std::mutex> lk(_m);
+    if (deadline) {
+      if (!_cond.wait_until(lk, *deadline, [this] { return _signalled; })) {
+        return false;
+      }
+    } else {
+      _cond.wait(lk, [this] { return _signalled; });
+    }
+    _signalled = false;
+    return true;
+  }
+};
+
+enum class recv_status
+{
+  ok,
+  empty,
+  closed
+};
+
+/// Multi-producer, multi-consumer channel with an optional capacity, past which
+/// send() blocks. After close() sends fail, and receives drain what is left and
+/// then report the channel closed instead of blocking.
+template <typename T>
+class channel
+{
+private:
+  mutable std::mutex _m;
+  std::condition_variable _not_empty;
+  std::condition_variable _not_full;
+  std::deque<T> _items;
+  std::size_t const _capacity;
+  bool _closed{false};
+  // selects currently blocked on this channel
+  std::vector<select_waiter *> _selectors;
+
+  // must be called with the mutex held
+  void
+  notify_ready() {
+    _not_empty.notify_one();
+    for (select_waiter *selector : _selectors) {
+      selector->signal();
+    }
+  }
+
+public:
+  explicit channel(
+      std::size_t capacity = std::numeric_limits<std::size_t>::max())
+      : _capacity(std::max<std::size_t>(capacity, 1)) {}
+
+  channel(channel const &) = delete;
+  channel(channel &&) = delete;
+  channel &
+  operator=(channel const &) = delete;
+  channel &
+  operator=(channel &&) = delete;
+  ~channel() = default;
+
+  /// Block while the channel is full. Returns false, and drops value, if the
+  /// channel is closed.
+  bool
+  send(T value) {
+    std::unique_lock<std::mutex> lk(_m);
+    _not_full.wait(lk, [this] { return _closed || _items.size() < _capacity; });
+    if (_closed) {
+      return false;
+    }
+    _items.push_back(std::move(value));
+    notify_ready();
+    return true;
+  }
+
+  /// Returns false, and drops value, if the channel is full or closed
+  bool
+  try_send(T value) {
+    std::lock_guard<std::mutex> lk(_m);
+    if (_closed || _items.size() >= _capacity) {
+      return false;
+    }
+    _items.push_back(std::move(value));
+    notify_ready();
+    return true;
+  }
+
+  /// Block until there is an element, or the channel is closed and drained, in
+  /// which case the result is empty
+  std::optional<T>
+  recv() {
+    std::unique_lock<std::mutex> lk(_m);
+    _not_empty.wait(lk, [this] { return _closed || !_items.empty(); });
+    if (_items.empty()) {
+      return std::nullopt;
+    }
+    std::optional<T> value(std::move(_items.front()));
+    _items.pop_front();
+    lk.unlock();
+    _not_full.notify_one();
+    return value;
+  }
+
+  recv_status
+  try_recv(T &value) {
+    std::unique_lock<std::mutex> lk(_m);
+    if (_items.empty()) {
+      return _closed ? recv_status::closed : recv_status::empty;
+    }
+    value = std::move(_items.front());
+    _items.pop_front();
+    lk.unlock();
+    _not_full.notify_one();
+    return recv_status::ok;
+  }
+
+  void
+  close() {
+    std::lock_guard<std::mutex> lk(_m);
+    _closed = true;
+    // everyone blocked on the channel has something to do now
+    _not_empty.notify_all();
+    _not_full.notify_all();
+    for (select_waiter *selector : _selectors) {
+      selector->signal();
+    }
+  }
+
+  bool
+  closed() const {
+    std::lock_guard<std::mutex> lk(_m);
+    return _closed;
+  }
+
+  void
+  add_selector(select_waiter *selector) {
+    std::lock_guard<std::mutex> lk(_m);
+    _selectors.push_back(selector);
+  }
+
+  void
+  remove_selector(select_waiter *selector) {
+    std::lock_guard<std::mutex> lk(_m);
+    _selectors.erase(
+        std::remove(_selectors.begin(), _selectors.end(), selector),
+        _selectors.end());
+  }
+};
+
+/// Receive from whichever of several channels is ready first, like Go's select.
+/// Every case has a handler that is called with the received element, or with
+/// an empty optional once its channel is closed and drained. In Go the case of
+/// a closed channel stays ready, and a loop over the select spins until the
+/// channel is set to nil; here the case disables itself once it reported the
+/// close, and disable() does what setting a channel to nil does.
+///   channel_select sel;
+///   sel.on_recv(control, [](std::optional<command> c) {...})
+///      .on_recv(data, [](std::optional<packet> p) {...});
+///   sel.wait();                        // block until a case fires
+///   sel.try_select();                  // with a default case
+///   sel.wait_for(100ms);               // with a timeout case
+/// All of them return the index of the case that fired, or nothing for the
+/// default and timeout cases, and at once when every case is disabled. When
+/// several cases are ready, they take turns.
+class channel_select
+{
+private:
+  struct recv_case_base
+  {
+    // the select skips the case, and doesn't wait on its channel
+    bool _enabled{true};
+
+    virtual ~recv_case_base() = default;
+    // run the handler and return true if the channel is ready
+    virtual bool
+    try_fire() = 0;
+    virtual void
+    attach(select_waiter *waiter) = 0;
+    virtual void
+    detach(select_waiter *waiter) = 0;
+  };
+
+  template <typename T, typename Handler>
+  struct recv_case : recv_case_base
+  {
+    channel<T> &_channel;
+    Handler _handler;
+
+    recv_case(channel<T> &ch, Handler handler)
+        : _channel(ch),
+          _handler(std::move(handler)) {}
+
+    bool
+    try_fire() override {
+      T value{};
+      switch (_channel.try_recv(value)) {
+      case recv_status::ok:
+        _handler(std::optional<T>(std::move(value)));
+        return true;
+      case recv_status::closed:
+        // it would report the close again every time otherwise
+        _enabled = false;
+        _handler(std::optional<T>());
+        return true;
+      case recv_status::empty:
+        break;
+      }
+      return false;
+    }
+
+    void
+    attach(select_waiter *waiter) override {
+      _channel.add_selector(waiter);
+    }
+
+    void
+    detach(select_waiter *waiter) override {
+      _channel.remove_selector(waiter);
+    }
+  };
+
+  std::vector<std::unique_ptr<recv_case_base>> _cases;
+  // case to try first, rotated so that a busy channel can't starve the others
+  std::size_t _next{0};
+
+  std::optional<std::size_t>
+  wait_until(
+      std::optional<std::chrono::steady_clock::time_point> const &deadline) {
+    while (true) {
+      if (std::optional<std::size_t> const fired = try_select()) {
+        return fired;
+      }
+      if (std::none_of(_cases.begin(), _cases.end(), [](auto const &c) {
+            return c->_enabled;
+          })) {
+        // nothing could ever wake us up
+        return std::nullopt;
+      }
+
+      select_waiter waiter;
+      for (auto &c : _cases) {
+        if (c->_enabled) {
+          c->attach(&waiter);
+        }
+      }
+      // a channel may have become ready before we were registered with it
+      std::optional<std::size_t> fired = try_select();
+      bool const timed_out = !fired && !waiter.wait_until(deadline);
+      // all of them, since a case disables itself when its channel closes
+      for (auto &c : _cases) {
+        c->detach(&waiter);
+      }
+
+      if (fired) {
+        return fired;
+      }
+      if (timed_out) {
+        return try_select();
+      }
+      // woken, but another consumer may have taken the element: try again
+    }
+  }
+
+public:
+  template <typename T, typename Handler>
+  channel_select &
+  on_recv(channel<T> &ch, Handler handler) {
+    _cases.push_back(
+        std::make_unique<recv_case<T, Handler>>(ch, std::move(handler)));
+    return *this;
+  }
+
+  /// Fire a ready case if there is one, without blocking
+  std::optional<std::size_t>
+  try_select() {
+    for (std::size_t i = 0; i < _cases.size(); ++i) {
+      std::size_t const index = (_next + i) % _cases.size();
+      if (_cases[index]->_enabled && _cases[index]->try_fire()) {
+        _next = index + 1;
+        return index;
+      }
+    }
+    return std::nullopt;
+  }
+
+  /// Stop selecting on the channel of case index, until enable(index)
+  void
+  disable(std::size_t index) {
+    _cases.at(index)->_enabled = false;
+  }
+
+  void
+  enable(std::size_t index) {
+    _cases.at(index)->_enabled = true;
+  }
+
+  /// Block until a case fires. Returns nothing if every case is disabled.
+  std::optional<std::size_t>
+  wait() {
+    return wait_until(std::nullopt);
+  }
+
+  /// Block until a case fires, or timeout expires
+  template <typename Rep, typename Period>
+  std::optional<std::size_t>
+  wait_for(std::chrono::duration<Rep, Period> const &timeout) {
+    return wait_until(std::chrono::steady_clock::now() + timeout);
+  }
+};
+
+int
+main() {
+  using namespace std::chrono_literals;
+
+  // default and timeout cases on channels with nothing in them
+  {
+    channel<int> idle;
+    channel_select sel;
+    sel.on_recv(idle, [](std::optional<int>) { assert(false); });
+    std::optional<std::size_t> const now = sel.try_select();
+    auto const start = std::chrono::steady_clock::now();
+    std::optional<std::size_t> const later = sel.wait_for(20ms);
+    std::chrono::duration<double> const waited
+        = std::chrono::steady_clock::now() - start;
+    assert(!now && !later);
+    // like a nil channel in Go, but with nothing left to wait on, no deadlock
+    sel.disable(0);
+    [[maybe_unused]] std::optional<std::size_t> const none = sel.wait();
+    assert(!none);
+    std::cout << "Nothing ready now (" << now.has_value()
+              << "), nor after " << waited.count() * 1e3 << "ms ("
+              << later.has_value() << ")\n";
+  }
+
+  // a router multiplexing a data and a control channel until both are closed
+  {
+    static constexpr int NUM_PRODUCERS = 4;
+    static constexpr int ITEMS_PER_PRODUCER = 10'000;
+
+    channel<int> data(64);
+    channel<std::string> control;
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < NUM_PRODUCERS; ++p) {
+      producers.emplace_back([&data, p] {
+        for (int i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+          data.send(p * ITEMS_PER_PRODUCER + i);
+        }
+      });
+    }
+    std::thread controller([&control] {
+      for (std::string cmd : {"pause", "resume", "flush"}) {
+        std::this_thread::sleep_for(5ms);
+        control.send(cmd);
+      }
+      control.close();
+    });
+
+    long sum = 0;
+    int received = 0;
+    std::vector<std::string> commands;
+
+    channel_select sel;
+    sel.on_recv(data,
+                [&](std::optional<int> value) {
+                  if (value) {
+                    sum += *value;
+                    ++received;
+                  }
+                })
+        .on_recv(control, [&](std::optional<std::string> cmd) {
+          if (cmd) {
+            commands.push_back(std::move(*cmd));
+          }
+        });
+
+    std::thread closer([&data, &producers] {
+      std::for_each(
+          producers.begin(), producers.end(), [](std::thread &t) { t.join(); });
+      data.close();
+    });
+
+    // a closed channel's case disables itself, so once data is closed the
+    // select sleeps on control alone, and it returns nothing once both are
+    int rounds = 0;
+    while (sel.wait()) {
+      ++rounds;
+    }
+    closer.join();
+    controller.join();
+
+    [[maybe_unused]] long const n = NUM_PRODUCERS * ITEMS_PER_PRODUCER;
+    assert(received == n && sum == n * (n - 1) / 2);
+    assert((commands == std::vector<std::string>{"pause", "resume", "flush"}));
+    // one round per element, command and close: no round found nothing to do
+    assert(rounds == received + static_cast<int>(commands.size()) + 2);
+    bool const sent_after_close = data.send(0);
+    assert(!sent_after_close);
+    std::cout << "Routed " << received << " items and " << commands.size()
+              << " commands, send after close "
+              << (sent_after_close ? "succeeded" : "failed") << '\n';
+  }
+
+  return 0;
+}
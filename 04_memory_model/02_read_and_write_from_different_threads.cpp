@@ -1,20 +1,85 @@
+#include <algorithm>
 #include <atomic>
-#include <chrono>
+#include <cassert>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <thread>
 #include <vector>
 
-std::vector<int> data;
-std::atomic<bool> data_ready(false);
+#include "seqlock.hpp"
+
+// instead of a vector and a data_ready flag that the reader polls every millisecond: the reader sleeps until the
+// writer publishes, and gets the value in the same step
+versioned_publish<int> data;
 
 void reader_thread() {
-  while (!data_ready.load()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
-  std::cout << "The answer = " << data[0] << "\n";
+  std::uint32_t version = 0;
+  int const answer = data.wait_and_load(version);
+  std::cout << "The answer = " << answer << "\n";
 }
 
 void writer_thread() {
-  data.push_back(42);
-  data_ready = true;
+  data.publish(42);
+}
+
+// a snapshot that a torn read would give away: ask is always bid + 1, and seq the number of the update
+struct quote {
+  std::uint64_t _seq;
+  double _bid;
+  double _ask;
+};
+
+int main() {
+  {
+    std::thread reader(reader_thread);
+    std::thread writer(writer_thread);
+    reader.join();
+    writer.join();
+  }
+
+  // one writer publishes quotes as fast as it can, readers copy them without writing shared memory, and one
+  // subscriber sleeps until the next quote
+  constexpr std::uint64_t UPDATES = 1'000'000;
+  versioned_publish<quote> quotes(quote{0, 0.0, 1.0});
+  std::atomic<bool> done{false};
+  std::atomic<unsigned long> torn{0};
+
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 2; ++r) {
+    readers.emplace_back([&quotes, &done, &torn] {
+      std::uint64_t last = 0;
+      while (!done.load(std::memory_order_relaxed)) {
+        quote const q = quotes.load();
+        if (q._ask != q._bid + 1.0 || q._seq < last) {
+          ++torn;
+        }
+        last = q._seq;
+      }
+    });
+  }
+  unsigned long wakeups = 0;
+  std::thread subscriber([&quotes, &torn, &wakeups] {
+    std::uint32_t version = 0;
+    quote q{};
+    while (q._seq != UPDATES) {
+      q = quotes.wait_and_load(version);
+      if (q._ask != q._bid + 1.0) {
+        ++torn;
+      }
+      ++wakeups;
+    }
+  });
+
+  for (std::uint64_t seq = 1; seq <= UPDATES; ++seq) {
+    double const bid = static_cast<double>(seq % 1000);
+    quotes.publish(quote{seq, bid, bid + 1.0});
+  }
+  subscriber.join();
+  done = true;
+  std::for_each(readers.begin(), readers.end(), std::mem_fn(&std::thread::join));
+
+  assert(torn == 0);
+  std::cout << UPDATES << " quotes published, the subscriber woke up for " << wakeups << " of them\n";
+  return 0;
 }
@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <sched.h> // sched_getcpu
+
+#include "cache_line.hpp"
+
+// A single atomic that every thread writes to bounces its cache line between
+// the cores on every update. The accumulators below split their state in
+// shards, each on its own cache line, and every thread only writes the shard it
+// maps to. Reads combine all the shards, which is fine for statistics that are
+// updated far more often than they are read.
+
+// Shard selectors, used as template policies: give each thread its own shard,
+// assigned round-robin the first time the thread touches any accumulator...
+struct per_thread_shard
+{
+  static std::size_t
+  index() {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t const idx
+        = next.fetch_add(1, std::memory_order_relaxed);
+    return idx;
+  }
+};
+
+// ...or use the shard of the CPU the thread is running on, which keeps the
+// number of shards bounded by the number of CPUs however many threads there
+// are. A thread can migrate between picking its shard and updating it, so the
+// updates still have to be atomic, but they stay uncontended.
+struct per_cpu_shard
+{
+  static std::size_t
+  index() {
+    int const cpu = sched_getcpu();
+    return cpu < 0 ? per_thread_shard::index() : static_cast<std::size_t>(cpu);
+  }
+};
+
+// number of shards to use by default: the number of hardware threads, rounded
+// up to a power of two so that picking a shard is a mask
+inline std::size_t
+default_num_shards() {
+  std::size_t shards = 1;
+  while (shards < std::thread::hardware_concurrency()) {
+    shards *= 2;
+  }
+  return shards;
+}
+
+template <typename T>
+struct alignas(CACHE_LINE_SIZE) padded_atomic
+{
+  std::atomic<T> _value;
+};
+
+// Counter with relaxed, contention-free add()s.
+// Every shard keeps a local delta, which is folded into the global count when
+// its magnitude reaches batch. read() only loads the global count, so it is as
+// cheap as reading a plain atomic but can be off by up to
+// (batch - 1) * num_shards. read_exact() also sums the local deltas, so once
+// the add()s stopped it returns the exact count; while they run, it misses the
+// deltas that are being folded, which are in neither place for a moment.
+// T has to be signed, since the deltas of a shard go below zero when the
+// counter is decremented: count things that go up and down, like the items in
+// flight, with a long rather than a std::size_t.
+// It is not a drop-in for every shared count: remaining_producers in
+// 02_condition_variable.cpp is decremented rarely and the consumers have to
+// see it reach exactly zero under the queue's mutex, which neither read() nor
+// read_exact() can promise; and z in 03_memory_ordering.cpp is there to show
+// what sequential consistency guarantees for one atomic, not to scale.
+template <typename T = long, typename ShardSelector = per_thread_shard>
+class sharded_counter
+{
+  static_assert(std::is_integral<T>::value && std::is_signed<T>::value,
+                "counters count up and down");
+
+private:
+  std::vector<padded_atomic<T>> _shards;
+  std::size_t const _mask;
+  T const _batch;
+  alignas(CACHE_LINE_SIZE) std::atomic<T> _global{0};
+
+public:
+  explicit sharded_counter(T batch = 64,
+                           std::size_t num_shards = default_num_shards())
+      : _shards(num_shards),
+        _mask(num_shards - 1),
+        _batch(batch) {
+    assert(num_shards != 0 && (num_shards & _mask) == 0);
+    for (padded_atomic<T> &shard : _shards) {
+      shard._value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  sharded_counter(sharded_counter const &) = delete;
+  sharded_counter(sharded_counter &&) = delete;
+  sharded_counter &
+  operator=(sharded_counter const &) = delete;
+  sharded_counter &
+  operator=(sharded_counter &&) = delete;
+  ~sharded_counter() = default;
+
+  void
+  add(T n = 1) {
+    std::atomic<T> &local = _shards[ShardSelector::index() & _mask]._value;
+    T const delta = local.fetch_add(n, std::memory_order_relaxed) + n;
+    if (delta >= _batch || delta <= -_batch) {
+      // other threads mapped to the same shard may have added in the meantime,
+      // so move whatever is there now
+      _global.fetch_add(local.exchange(0, std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+    }
+  }
+
+  void
+  operator++() {
+    add(1);
+  }
+
+  T
+  read() const {
+    return _global.load(std::memory_order_relaxed);
+  }
+
+  T
+  read_exact() const {
+    T sum = _global.load(std::memory_order_acquire);
+    for (padded_atomic<T> const &shard : _shards) {
+      sum += shard._value.load(std::memory_order_acquire);
+    }
+    return sum;
+  }
+};
+
+// Running minimum (Compare = std::less) or maximum (Compare = std::greater).
+// update() first reads its shard and only writes when the value improves on
+// it, so once the extremes have settled the updates don't write at all.
+template <typename T,
+          typename Compare = std::less<T>,
+          typename ShardSelector = per_thread_shard>
+class sharded_extremum
+{
+private:
+  std::vector<padded_atomic<T>> _shards;
+  std::size_t const _mask;
+  T const _identity;
+  Compare _compare;
+
+public:
+  // identity is the value no update can be worse than, e.g. the largest T for
+  // a minimum
+  explicit sharded_extremum(T identity,
+                            std::size_t num_shards = default_num_shards())
+      : _shards(num_shards),
+        _mask(num_shards - 1),
+        _identity(identity) {
+    assert(num_shards != 0 && (num_shards & _mask) == 0);
+    reset();
+  }
+
+  void
+  update(T value) {
+    std::atomic<T> &local = _shards[ShardSelector::index() & _mask]._value;
+    T current = local.load(std::memory_order_relaxed);
+    while (_compare(value, current)
+           && !local.compare_exchange_weak(
+               current, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  T
+  read() const {
+    T result = _identity;
+    for (padded_atomic<T> const &shard : _shards) {
+      T const value = shard._value.load(std::memory_order_relaxed);
+      if (_compare(value, result)) {
+        result = value;
+      }
+    }
+    return result;
+  }
+
+  void
+  reset() {
+    for (padded_atomic<T> &shard : _shards) {
+      shard._value.store(_identity, std::memory_order_relaxed);
+    }
+  }
+};
+
+template <typename T, typename ShardSelector = per_thread_shard>
+class sharded_min : public sharded_extremum<T, std::less<T>, ShardSelector>
+{
+public:
+  explicit sharded_min(std::size_t num_shards = default_num_shards())
+      : sharded_extremum<T, std::less<T>, ShardSelector>(
+          std::numeric_limits<T>::max(), num_shards) {}
+};
+
+template <typename T, typename ShardSelector = per_thread_shard>
+class sharded_max : public sharded_extremum<T, std::greater<T>, ShardSelector>
+{
+public:
+  explicit sharded_max(std::size_t num_shards = default_num_shards())
+      : sharded_extremum<T, std::greater<T>, ShardSelector>(
+          std::numeric_limits<T>::lowest(), num_shards) {}
+};
+
+// Histogram of unsigned 64-bit values in power-of-two buckets: bucket 0 counts
+// the zeros and bucket b the values in [2^(b-1), 2^b).
+template <typename ShardSelector = per_thread_shard>
+class sharded_histogram
+{
+public:
+  static constexpr std::size_t NUM_BUCKETS = 65;
+  using snapshot_type = std::array<std::uint64_t, NUM_BUCKETS>;
+
+private:
+  struct alignas(CACHE_LINE_SIZE) shard
+  {
+    std::array<std::atomic<std::uint64_t>, NUM_BUCKETS> _counts{};
+  };
+
+  std::vector<shard> _shards;
+  std::size_t const _mask;
+
+public:
+  explicit sharded_histogram(std::size_t num_shards = default_num_shards())
+      : _shards(num_shards),
+        _mask(num_shards - 1) {
+    assert(num_shards != 0 && (num_shards & _mask) == 0);
+  }
+
+  static std::size_t
+  bucket_of(std::uint64_t value) {
+    std::size_t bucket = 0;
+    while (value != 0) {
+      value >>= 1U;
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  void
+  record(std::uint64_t value) {
+    _shards[ShardSelector::index() & _mask]._counts[bucket_of(value)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  snapshot_type
+  read() const {
+    snapshot_type result{};
+    for (shard const &s : _shards) {
+      for (std::size_t b = 0; b < NUM_BUCKETS; ++b) {
+        result[b] += s._counts[b].load(std::memory_order_relaxed);
+      }
+    }
+    return result;
+  }
+};
+
+template <typename Func>
+double
+time_threads(unsigned num_threads, Func func) {
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back(func, t);
+  }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  std::chrono::duration<double> const elapsed
+      = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int
+main() {
+  static constexpr long OPS_PER_THREAD = 10'000'000;
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+  long const total = OPS_PER_THREAD * num_threads;
+
+  std::atomic<long> shared{0};
+  double const shared_time = time_threads(num_threads, [&shared](unsigned) {
+    for (long i = 0; i < OPS_PER_THREAD; ++i) {
+      shared.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  assert(shared == total);
+
+  sharded_counter<long> counter;
+  double const sharded_time = time_threads(num_threads, [&counter](unsigned) {
+    for (long i = 0; i < OPS_PER_THREAD; ++i) {
+      ++counter;
+    }
+  });
+  assert(counter.read_exact() == total);
+  assert(total - counter.read()
+         < 64L * static_cast<long>(default_num_shards()));
+
+  sharded_counter<long, per_cpu_shard> cpu_counter;
+  double const per_cpu_time
+      = time_threads(num_threads, [&cpu_counter](unsigned) {
+          for (long i = 0; i < OPS_PER_THREAD; ++i) {
+            ++cpu_counter;
+          }
+        });
+  assert(cpu_counter.read_exact() == total);
+
+  std::cout << num_threads << " threads, " << total << " increments\n";
+  std::cout << "  std::atomic:               " << shared_time << "s\n";
+  std::cout << "  sharded_counter per thread: " << sharded_time << "s\n";
+  std::cout << "  sharded_counter per CPU:    " << per_cpu_time << "s\n";
+
+  sharded_min<unsigned> lowest;
+  sharded_max<unsigned> highest;
+  sharded_histogram<> histogram;
+  time_threads(num_threads, [&](unsigned id) {
+    for (unsigned i = 1; i <= 1'000; ++i) {
+      unsigned const value = i * (id + 1);
+      lowest.update(value);
+      highest.update(value);
+      histogram.record(value);
+    }
+  });
+  assert(lowest.read() == 1);
+  assert(highest.read() == 1'000 * num_threads);
+
+  auto const counts = histogram.read();
+  std::uint64_t recorded = 0;
+  for (std::uint64_t c : counts) {
+    recorded += c;
+  }
+  assert(recorded == 1'000U * num_threads);
+  assert(counts[0] == 0 && counts[1] == 1);
+
+  std::cout << "Values in [" << lowest.read() << ", " << highest.read()
+            << "]\n";
+  // the last bucket holds the values >= 2^63, whose upper bound doesn't fit
+  for (std::size_t b = 0; b + 1 < counts.size(); ++b) {
+    if (counts[b] != 0) {
+      std::cout << "  < " << (std::uint64_t{1} << b) << ": " << counts[b]
+                << '\n';
+    }
+  }
+  if (counts.back() != 0) {
+    std::cout << "  >= 2^63: " << counts.back() << '\n';
+  }
+
+  return 0;
+}
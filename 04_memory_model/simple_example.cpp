@@ -1,27 +1,27 @@
 #include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <thread>
-#include <vector>
 
-void get_data(std::atomic<bool> &data_ready, std::vector<int> &data) {
-  // spinlock
-  while (!data_ready.load());
-  std::cout << data[0] << '\n';
+#include "seqlock.hpp"
+
+void get_data(versioned_publish<int> &data) {
+  // sleeps until set_data publishes, instead of spinning on a flag
+  std::uint32_t version = 0;
+  std::cout << data.wait_and_load(version) << '\n';
 }
 
-void set_data(std::atomic<bool> &data_ready, std::vector<int> &data) {
+void set_data(versioned_publish<int> &data) {
   using namespace std::chrono_literals;
   std::this_thread::sleep_for(200ms);
-  data.push_back(42);
-  data_ready.store(true);
+  data.publish(42);
 }
 
 int main() {
-  std::atomic<bool> data_ready{false};
-  std::vector<int> data;
+  versioned_publish<int> data;
 
-  std::jthread t1(get_data, std::ref(data_ready), std::ref(data));
-  std::jthread t2(set_data, std::ref(data_ready), std::ref(data));
+  std::jthread t1(get_data, std::ref(data));
+  std::jthread t2(set_data, std::ref(data));
 
   return 0;
 }
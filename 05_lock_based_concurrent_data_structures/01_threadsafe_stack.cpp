@@ -1,58 +1,68 @@
-#include <exception>
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <functional>
+#include <iostream>
 #include <mutex>
-#include <stack>
-
-struct empty_stack : std::exception {
-  char const *what() const throw();
-};
-
-template <typename T>
-class threadsafe_stack {
-private:
-  std::stack<T> _data;
-  mutable std::mutex _m;
-
-public:
-  /// Default constructor
-  threadsafe_stack() {}
-
-  /// Copy constructor
-  threadsafe_stack(threadsafe_stack const &other) {
-    std::lock_guard<std::mutex> lg(other._m);
-    _data = other._data;
-  }
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.hpp"
+#include "threadsafe/stack.hpp"
 
-  /// Copy assignment operator
-  threadsafe_stack &operator=(threadsafe_stack const &) = delete;
+// every thread pushes and then pops, so a pop never finds the stack empty
+template <typename Mutex, typename Pop>
+void run_pairs(std::string const &label, unsigned num_threads, Pop pop) {
+  static constexpr int PAIRS_PER_THREAD = 50'000;
 
-  void push(T new_value) {
-    std::lock_guard<std::mutex> lg(_m);
-    _data.push(std::move(new_value));
+  threadsafe_stack<int, Mutex> stack;
+  std::atomic<long> checksum{0};
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] {
+      perf_region region(label, 2 * PAIRS_PER_THREAD);
+      long sum = 0;
+      for (int i = 0; i < PAIRS_PER_THREAD; ++i) {
+        stack.push(i);
+        sum += pop(stack);
+      }
+      checksum += sum;
+    });
   }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
 
-  std::shared_ptr<T> pop() {
-    std::lock_guard<std::mutex> lg(_m);
-    if (_data.empty()) {
-      throw empty_stack();
-    }
+  assert(stack.empty());
+  assert(checksum == static_cast<long>(num_threads) * PAIRS_PER_THREAD *
+                         (PAIRS_PER_THREAD - 1) / 2);
+}
 
-    std::shared_ptr<T> const res(std::make_shared<T>(std::move(_data.top())));
-    _data.pop();
-    return res;
+int main() {
+  threadsafe_stack<int> stack;
+  try {
+    stack.pop();
+    assert(false);
+  } catch (empty_stack const &e) {
+    std::cout << "pop on an empty stack: " << e.what() << '\n';
   }
 
-  void pop(T &value) {
-    std::lock_guard<std::mutex> lg(_m);
-    if (_data.empty()) {
-      throw empty_stack();
-    }
-    value = std::move(_data.top());
-    _data.pop();
-  }
+  auto const pop_shared = [](auto &s) { return *s.pop(); };
+  auto const pop_into = [](auto &s) {
+    int value = 0;
+    s.pop(value);
+    return value;
+  };
 
-  bool empty() const {
-    std::lock_guard<std::mutex> lg(_m);
-    return _data.empty();
-  }
-};
+  // the same operations under each lock policy
+  unsigned const num_threads =
+      std::max(std::thread::hardware_concurrency(), 2U);
+  run_pairs<std::mutex>("stack mutex pop()", num_threads, pop_shared);
+  run_pairs<std::mutex>("stack mutex pop(T &)", num_threads, pop_into);
+  run_pairs<spinlock_mutex>("stack spinlock pop(T &)", num_threads, pop_into);
+  // on one thread, where a lock is pure overhead
+  run_pairs<std::mutex>("stack 1 thread mutex", 1, pop_into);
+  run_pairs<null_mutex>("stack 1 thread null_mutex", 1, pop_into);
+  perf_report(std::cout);
+
+  return 0;
+}
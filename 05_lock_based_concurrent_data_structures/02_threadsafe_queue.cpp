@@ -1,63 +1,68 @@
-#include <condition_variable>
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <functional>
+#include <iostream>
 #include <mutex>
-#include <queue>
+#include <string>
 #include <thread>
+#include <vector>
 
-template <typename T>
-class threadsafe_queue {
-private:
-  mutable std::mutex _m;
-  std::queue<std::shared_ptr<T>> _data;
-  std::condition_variable _cond;
-
-public:
-  threadsafe_queue() {}
-
-  void push(T value) {
-    std::shared_ptr<T> data(std::make_shared<T>(std::move(value)));
-    std::lock_guard<std::mutex> lg(_m);
-    _data.push(data);
-    _cond.notify_one();
-  }
+#include "perf_counters.hpp"
+#include "threadsafe/queue.hpp"
 
-  void wait_and_pop(T &value) {
-    std::unique_lock<std::mutex> lk(_m);
-    _cond.wait(lk, [this] { return !_data.empty(); });
-    value = std::move(*_data.front());
-    _data.pop();
-  }
+// every thread pushes and then pops, so a pop never finds the queue empty
+template <typename Mutex, typename Storage>
+void run_pairs(char const *label, unsigned num_threads) {
+  static constexpr int PAIRS_PER_THREAD = 50'000;
 
-  std::shared_ptr<T> wait_and_pop() {
-    std::unique_lock<std::mutex> lk(_m);
-    _cond.wait(lk, [this] { return !_data.empty(); });
-    std::shared_ptr<T> res(_data.front());
-    _data.pop();
-    return res;
+  threadsafe_queue<std::string, Mutex, default_wait_strategy<Mutex>, Storage>
+      queue;
+  std::atomic<std::size_t> total_length{0};
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] {
+      perf_region region(label, 2 * PAIRS_PER_THREAD);
+      std::size_t length = 0;
+      for (int i = 0; i < PAIRS_PER_THREAD; ++i) {
+        // long enough not to fit in the small string buffer
+        queue.push(std::string(32, 'x'));
+        auto const value = queue.try_pop();
+        assert(value);
+        length += value->size();
+      }
+      total_length += length;
+    });
   }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
 
-  bool try_pop(T &value) {
-    std::lock_guard<std::mutex> lk(_m);
-    if (_data.empty()) {
-      return false;
-    }
-    value = std::move(*_data.front());
-    _data.pop();
-    return true;
-  }
+  assert(queue.empty());
+  assert(total_length == num_threads * PAIRS_PER_THREAD * std::size_t{32});
+}
 
-  std::shared_ptr<T> try_pop() {
-    std::lock_guard<std::mutex> lk(_m);
-    if (_data.empty()) {
-      return std::shared_ptr<T>();
-    }
-    std::shared_ptr<T> res(_data.front());
-    _data.pop();
-    return res;
-  }
+int main() {
+  using namespace std::chrono_literals;
 
-  bool empty() const {
-    std::lock_guard<std::mutex> lk(_m);
-    return _data.empty();
-  }
-};
+  // a spinlock can't park on a condition variable, so the waits spin
+  threadsafe_queue<int, spinlock_mutex> spinning;
+  int value = 0;
+  [[maybe_unused]] bool const popped = spinning.wait_and_pop_for(value, 10ms);
+  assert(!popped);
+
+  unsigned const num_threads =
+      std::max(std::thread::hardware_concurrency(), 2U);
+  run_pairs<std::mutex, shared_storage>("queue mutex shared_storage",
+                                        num_threads);
+  run_pairs<std::mutex, value_storage>("queue mutex value_storage",
+                                       num_threads);
+  run_pairs<spinlock_mutex, value_storage>("queue spinlock value_storage",
+                                           num_threads);
+  // on one thread, where a lock is pure overhead
+  run_pairs<std::mutex, value_storage>("queue 1 thread mutex", 1);
+  run_pairs<null_mutex, value_storage>("queue 1 thread null_mutex", 1);
+  perf_report(std::cout);
+
+  return 0;
+}
@@ -1,18 +1,34 @@
 #include <algorithm>
 #include <cassert>
-#include <condition_variable>
+#include <chrono>
+#include <cstddef>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
-template <typename T>
+#include "storage_policy.hpp"
+#include "wait_strategy.hpp"
+
+// Storage decides whether the elements are kept in shared_ptrs or by value, and
+// so what the value-returning pops give back; see storage_policy.hpp. With
+// value_storage the only allocation left per element is its node.
+template <typename T,
+          typename WaitStrategy = blocking_wait,
+          typename Storage = shared_storage>
 class threadsafe_queue {
+public:
+  using element_type = typename Storage::template element<T>;
+
 private:
   struct node {
-    std::shared_ptr<T> _data;
+    // empty in the dummy node
+    element_type _data;
     std::unique_ptr<node> _next;
   };
 
@@ -20,7 +36,7 @@ private:
   mutable std::mutex _head_mtx;
   node *_tail;
   mutable std::mutex _tail_mtx;
-  std::condition_variable _data_cond;
+  WaitStrategy _waiter;
 
   node *get_tail() const {
     std::lock_guard<std::mutex> tail_lk(_tail_mtx);
@@ -35,7 +51,19 @@ private:
 
   std::unique_lock<std::mutex> wait_for_data() {
     std::unique_lock<std::mutex> head_lk(_head_mtx);
-    _data_cond.wait(head_lk, [&] { return _head.get() != get_tail(); });
+    _waiter.wait(head_lk, [&] { return _head.get() != get_tail(); });
+    return head_lk;
+  }
+
+  // returns a lock that doesn't own the head mutex if the timeout expired
+  template <typename Rep, typename Period>
+  std::unique_lock<std::mutex>
+  wait_for_data_for(std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<std::mutex> head_lk(_head_mtx);
+    if (!_waiter.wait_for(
+            head_lk, timeout, [&] { return _head.get() != get_tail(); })) {
+      head_lk.unlock();
+    }
     return head_lk;
   }
 
@@ -50,6 +78,18 @@ private:
     return pop_head();
   }
 
+  template <typename Rep, typename Period>
+  std::unique_ptr<node>
+  wait_pop_head_for(T &value,
+                    std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<std::mutex> head_lk(wait_for_data_for(timeout));
+    if (!head_lk.owns_lock()) {
+      return nullptr;
+    }
+    value = std::move(*_head->_data);
+    return pop_head();
+  }
+
   std::unique_ptr<node> try_pop_head() {
     std::lock_guard<std::mutex> head_lk(_head_mtx);
     if (_head.get() == get_tail()) {
@@ -83,18 +123,36 @@ public:
   // no move assignment operator
   threadsafe_queue &operator=(threadsafe_queue &&oher) = delete;
 
-  std::shared_ptr<T> wait_and_pop() {
+  element_type wait_and_pop() {
     std::unique_ptr<node> const old_head = wait_pop_head();
-    return old_head->_data;
+    return std::move(old_head->_data);
   }
 
   void wait_and_pop(T &value) {
     wait_pop_head(value);
   }
 
-  std::shared_ptr<T> try_pop() {
+  template <typename Rep, typename Period>
+  element_type
+  wait_and_pop_for(std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<std::mutex> head_lk(wait_for_data_for(timeout));
+    if (!head_lk.owns_lock()) {
+      return element_type();
+    }
+    std::unique_ptr<node> const old_head = pop_head();
+    return std::move(old_head->_data);
+  }
+
+  template <typename Rep, typename Period>
+  bool wait_and_pop_for(T &value,
+                        std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_ptr<node> const old_head = wait_pop_head_for(value, timeout);
+    return old_head != nullptr;
+  }
+
+  element_type try_pop() {
     std::unique_ptr<node> old_head = try_pop_head();
-    return old_head != nullptr ? old_head->_data : nullptr;
+    return old_head != nullptr ? std::move(old_head->_data) : element_type();
   }
 
   bool try_pop(T &value) {
@@ -104,16 +162,27 @@ public:
 
   /// Push to the tail of the queue
   void push(T new_value) {
-    std::shared_ptr<T> new_data(std::make_shared<T>(std::move(new_value)));
+    emplace(std::move(new_value));
+  }
+
+  /// Construct the element from args at the tail of the queue, outside the lock
+  template <typename... Args>
+  void emplace(Args &&...args) {
+    element_type new_data(
+        Storage::template make<T>(std::forward<Args>(args)...));
     std::unique_ptr<node> p(new node);
     {
       std::lock_guard<std::mutex> tail_lk(_tail_mtx);
-      _tail->_data = new_data;
+      _tail->_data = std::move(new_data);
       node *const new_tail = p.get();
       _tail->_next = std::move(p);
       _tail = new_tail;
     }
-    _data_cond.notify_one();
+    // the waiters check for data under the head mutex, not the tail one: a
+    // consumer that found the queue empty before the push above holds it until
+    // it sleeps, so taking it here means the notify can't come in between
+    std::lock_guard<std::mutex> head_lk(_head_mtx);
+    _waiter.notify_one();
   }
 
   bool empty() const {
@@ -122,33 +191,85 @@ public:
   }
 };
 
-void enqueue_jobs(threadsafe_queue<int> &queue, int from, int size) {
+template <typename Queue>
+void enqueue_jobs(Queue &queue, int from, int size) {
   for (int i = from, to = from + size; i < to; ++i) {
     queue.push(i);
   }
 }
 
-int main() {
-  threadsafe_queue<int> q;
+// the producers push the numbers [0, num_producers * batch_size) and the
+// consumer pops exactly that many, sleeping in WaitStrategy whenever it catches
+// up with them
+template <typename WaitStrategy>
+void run(char const *name) {
+  threadsafe_queue<int, WaitStrategy> q;
 
   std::vector<std::thread> threads;
-  auto num_threads = std::thread::hardware_concurrency();
+  unsigned int const num_producers
+      = std::max(std::thread::hardware_concurrency(), 2U) - 1;
 
-  constexpr int batch_size = 1000000;
-  for (unsigned int t = 0; t < num_threads - 1; ++t) {
-    threads.emplace_back(enqueue_jobs, std::ref(q), t * batch_size, batch_size);
+  constexpr int batch_size = 100000;
+  for (unsigned int t = 0; t < num_producers; ++t) {
+    threads.emplace_back(enqueue_jobs<threadsafe_queue<int, WaitStrategy>>,
+                         std::ref(q),
+                         static_cast<int>(t) * batch_size,
+                         batch_size);
   }
 
-  unsigned int count = 0;
+  long long const total = static_cast<long long>(num_producers) * batch_size;
+  long long sum = 0;
   int val = 0;
-  while (true) {
+  for (long long count = 0; count < total; ++count) {
     q.wait_and_pop(val);
-    std::cout << count++ << ": " << val << "\n";
+    sum += val;
+  }
+
+  std::for_each(
+      threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+
+  assert(sum == total * (total - 1) / 2);
+  assert(q.empty());
+  [[maybe_unused]] bool const timed_out
+      = !q.wait_and_pop_for(val, std::chrono::milliseconds(1));
+  assert(timed_out);
+
+  std::cout << name << ": " << total << " elements from " << num_producers
+            << " producers\n";
+}
+
+// with value_storage the elements are constructed in place in their nodes, and
+// the value-returning pops move them out into a std::optional
+void run_value_storage() {
+  threadsafe_queue<std::string, blocking_wait, value_storage> q;
+
+  constexpr int num_elements = 100000;
+  std::thread producer([&q] {
+    for (int i = 0; i < num_elements; ++i) {
+      q.emplace(static_cast<std::size_t>(i % 16), 'x');
+    }
+  });
+
+  std::size_t total_length = 0;
+  for (int i = 0; i < num_elements; ++i) {
+    std::optional<std::string> const s = q.wait_and_pop();
+    assert(s.has_value());
+    total_length += s->size();
   }
+  producer.join();
+
+  assert(total_length == num_elements / 16 * (15 * 16 / 2));
+  assert(!q.try_pop().has_value());
 
-  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  std::cout << "value_storage: " << num_elements << " emplaced elements, "
+            << total_length << " characters\n";
+}
 
-  assert(count == num_threads * batch_size);
+int main() {
+  run<blocking_wait>("blocking_wait");
+  run<spin_yield_wait<>>("spin_yield_wait");
+  run<spin_park_wait<>>("spin_park_wait");
+  run_value_storage();
 
   return 0;
 }
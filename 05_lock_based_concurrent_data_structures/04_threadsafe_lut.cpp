@@ -1,131 +1,159 @@
-#include <algorithm> // std::find_if
-#include <cstddef> // std::size_t
+#include <algorithm> // std::for_each
+#include <atomic>
+#include <cassert>
+#include <chrono>
 #include <functional>
-#include <list>
+#include <iostream>
 #include <map>
-#include <memory>
+#include <memory_resource>
 #include <mutex>
 #include <shared_mutex>
-#include <utility>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
-template <typename Key, typename Value, typename Hash = std::hash<Key>>
-class threadsafe_lut
-{
-private:
-  class bucket_type
-  {
-  private:
-    using bucket_value = std::pair<Key, Value>;
-    using bucket_data = std::list<bucket_value>;
-    using bucket_iterator = typename bucket_data::iterator;
-
-    bucket_data _data;
-    mutable std::shared_mutex _mtx;
-
-    bucket_iterator
-    find_entry_for(Key const &key) const {
-      return std::find_if(
-          _data.begin(), _data.end(), [&](bucket_value const &item) {
-            return item.first == key;
-          });
-    }
-
-  public:
-    Value
-    value_for(Key const &key, Value const &default_value) const {
-      std::shared_lock<std::shared_mutex> lk(_mtx);
-      bucket_iterator const found_entry = find_entry_for(key);
-      return (found_entry == _data.end()) ? default_value : found_entry->second;
-    }
+#include "perf_counters.hpp"
+#include "threadsafe/lut.hpp"
+#include "threadsafe/memory_resource.hpp"
+
+// operation mixes, every thread counting its own events
+template <typename Mutex>
+void
+run_mixes(std::string const &name) {
+  static constexpr int NUM_KEYS = 10'000;
+  static constexpr int OPS_PER_THREAD = 50'000;
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+  threadsafe_lut<int, int, std::hash<int>, Mutex> lut;
+  for (int key = 0; key < NUM_KEYS; ++key) {
+    lut.add_or_update_mapping(key, key);
+  }
 
-    void
-    add_or_update_mapping(Key const &key, Value const value) {
-      std::unique_lock<std::shared_mutex> lk(_mtx);
-      bucket_iterator const found_entry = find_entry_for(key);
-      if (found_entry == _data.end()) {
-        _data.push_back(bucket_value(key, value));
-      } else {
-        found_entry->second = value;
-      }
+  for (int write_percent : {0, 10, 50}) {
+    std::string const label
+        = name + " " + std::to_string(write_percent) + "% writes";
+    std::atomic<long> checksum{0};
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&, t] {
+        perf_region region(label, OPS_PER_THREAD);
+        long sum = 0;
+        unsigned state = t + 1;
+        for (int i = 0; i < OPS_PER_THREAD; ++i) {
+          // xorshift, cheap enough not to show up in the counts
+          state ^= state << 13U;
+          state ^= state >> 17U;
+          state ^= state << 5U;
+          int const key = static_cast<int>(state % NUM_KEYS);
+          if (static_cast<int>(state % 100) < write_percent) {
+            lut.add_or_update_mapping(key, key);
+          } else {
+            sum += lut.value_for(key);
+          }
+        }
+        checksum += sum;
+      });
     }
-
-    void
-    remove_mapping(Key const &key) {
-      std::unique_lock<std::shared_mutex> lk(_mtx);
-      bucket_iterator const found_entry = find_entry_for(key);
-      if (found_entry != _data.end()) {
-        _data.erase(found_entry);
+    std::for_each(
+        threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+    assert(checksum >= 0);
+  }
+}
+
+// threads inserting and removing entries at once, so that every operation
+// allocates or frees a node. Every thread removes the keys its neighbour
+// inserted, so half of the nodes are freed by another thread than their own
+void
+run_churn(std::string const &label, std::pmr::memory_resource *resource) {
+  static constexpr int KEYS_PER_THREAD = 20'000;
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+  // enough buckets to keep the lists short, and the allocations visible
+  threadsafe_lut<int, int> lut(4099, std::hash<int>(), resource);
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      perf_region region(label, 2 * KEYS_PER_THREAD);
+      int const mine = static_cast<int>(t) * KEYS_PER_THREAD;
+      int const neighbours
+          = static_cast<int>((t + 1) % num_threads) * KEYS_PER_THREAD;
+      for (int i = 0; i < KEYS_PER_THREAD; ++i) {
+        lut.add_or_update_mapping(mine + i, i);
+        lut.remove_mapping(neighbours + i);
       }
-    }
-  };
-
-  std::vector<std::unique_ptr<bucket_type>> _buckets;
-  Hash _hasher;
-
-  bucket_type &
-  get_bucket(Key const &key) const {
-    std::size_t const bucket_index = _hasher(key) % _buckets.size();
-    return *_buckets[bucket_index];
+    });
   }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+}
+
+int
+main() {
+  using namespace std::chrono_literals;
+  static constexpr unsigned NUM_THREADS = 16;
+
+  threadsafe_lut<int, int> lut;
+
+  // a stampede of misses on the same key computes the value once
+  std::atomic<unsigned> computations{0};
+  auto expensive_square = [&computations](int key) {
+    ++computations;
+    std::this_thread::sleep_for(50ms);
+    return key * key;
+  };
 
-public:
-  using key_type = Key;
-  using mapped_type = Value;
-  using hash_type = Hash;
-
-  // arbitrary prime number
-  static constexpr unsigned NUM_BUCKETS = 19;
-
-  explicit threadsafe_lut(unsigned num_buckets = NUM_BUCKETS,
-                          Hash const &hasher = Hash())
-      : _buckets(num_buckets),
-        _hasher(hasher) {
-    for (bucket_type &bucket : _buckets) {
-      bucket.reset(new bucket_type);
-    }
+  std::atomic<bool> all_correct{true};
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < NUM_THREADS; ++t) {
+    threads.emplace_back([&] {
+      if (lut.get_or_compute(7, expensive_square) != 49) {
+        all_correct = false;
+      }
+    });
   }
-
-  ~threadsafe_lut() = default;
-
-  threadsafe_lut(threadsafe_lut const &other) = delete;
-  threadsafe_lut &
-  operator=(threadsafe_lut const &other) = delete;
-  threadsafe_lut(threadsafe_lut &&other) = delete;
-  threadsafe_lut &
-  operator=(threadsafe_lut &&other) = delete;
-
-  Value
-  value_for(Key const &key, Value const &default_value = Value()) const {
-    return get_bucket(key).value_for(key, default_value);
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  assert(all_correct);
+  assert(computations == 1);
+  assert(lut.value_for(7) == 49);
+
+  std::cout << NUM_THREADS << " concurrent misses, " << computations
+            << " computations\n";
+
+  // a failed computation is reported to every waiter and not cached
+  auto failing = [](int) -> int { throw std::runtime_error("unavailable"); };
+  try {
+    lut.get_or_compute(8, failing);
+    assert(false);
+  } catch (std::runtime_error const &) {
   }
-
-  void
-  add_or_update_mapping(Key const &key, Value const &value) {
-    get_bucket(key).add_or_update_mapping(key, value);
+  assert(lut.value_for(8, -1) == -1);
+  [[maybe_unused]] int const recomputed
+      = lut.get_or_compute(8, expensive_square);
+  assert(recomputed == 64);
+
+  // a consistent snapshot of the whole table
+  lut.add_or_update_mapping(1, 1);
+  [[maybe_unused]] std::map<int, int> const snapshot = lut.get_map();
+  assert((snapshot == std::map<int, int>{{1, 1}, {7, 49}, {8, 64}}));
+
+  // readers share a bucket with a std::shared_mutex, and take turns with the
+  // other lock policies
+  run_mixes<std::shared_mutex>("lut shared_mutex");
+  run_mixes<std::mutex>("lut mutex");
+  run_mixes<spinlock_mutex>("lut spinlock");
+
+  // where the nodes come from when many threads insert at once
+  run_churn("lut churn new/delete", std::pmr::new_delete_resource());
+  {
+    std::pmr::synchronized_pool_resource pool;
+    run_churn("lut churn synchronized pool", &pool);
   }
-
-  void
-  remove_mapping(Key const &key) {
-    get_bucket(key).remove_mapping(key);
+  {
+    thread_arena_resource arenas;
+    run_churn("lut churn thread arenas", &arenas);
   }
+  perf_report(std::cout);
 
-  std::map<Key, Value>
-  get_map() const {
-    std::vector<std::unique_lock<std::shared_mutex>> locks;
-    locks.reserve(_buckets.size());
-    std::transform(_buckets.begin(),
-                   _buckets.end(),
-                   std::back_inserter(locks),
-                   [](auto const &bucket) { return bucket._mtx; });
-
-    std::map<Key, Value> res;
-    for (bucket_type const &bucket : _buckets) {
-      for (typename bucket_type::bucket_value const &kv : bucket._data) {
-        res.insert(kv);
-      }
-    }
-
-    return res;
-  }
-};
+  return 0;
+}
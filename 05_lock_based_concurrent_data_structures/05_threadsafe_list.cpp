@@ -1,88 +1,72 @@
-#include <memory>
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <iostream>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
-template <typename T>
-class threadsafe_list {
-  struct node {
-    std::mutex _m;
-    std::shared_ptr<T> _data;
-    std::unique_ptr<node> _next;
+#include "threadsafe/list.hpp"
+#include "threadsafe/memory_resource.hpp"
 
-    node() = default;
-    explicit node(T value) : _data(std::make_shared<T>(std::move(value))) {}
-    explicit node(T &&value) : _data(std::make_shared<T>(value)) {}
-  };
+template <typename Mutex, typename Storage>
+void exercise(threadsafe_list<int, Mutex, Storage> &list,
+              unsigned num_threads) {
+  static constexpr int VALUES_PER_THREAD = 1'000;
 
-  node _head;
-
-public:
-  threadsafe_list() = default;
-  ~threadsafe_list() {
-    remove_if([](node const &/*unused*/) { return true; });
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&list, t] {
+      for (int i = 0; i < VALUES_PER_THREAD; ++i) {
+        list.push_front(static_cast<int>(t) * VALUES_PER_THREAD + i);
+      }
+      // drop this thread's odd values while the others are still pushing
+      list.remove_if([t](int value) {
+        return value / VALUES_PER_THREAD == static_cast<int>(t) &&
+               value % 2 != 0;
+      });
+    });
   }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
 
-  threadsafe_list(threadsafe_list const &other) = delete;
-  threadsafe_list(threadsafe_list &&other) = delete;
-  threadsafe_list &operator=(threadsafe_list const &other) = delete;
-  threadsafe_list &operator=(threadsafe_list &&other) = delete;
+  long count = 0;
+  long odd = 0;
+  list.for_each([&count, &odd](int value) {
+    ++count;
+    odd += value % 2;
+  });
+  assert(odd == 0);
+  assert(count == static_cast<long>(num_threads) * VALUES_PER_THREAD / 2);
+  assert(list.find_first_if([](int value) { return value == 2; }));
+  assert(!list.find_first_if([](int value) { return value == 1; }));
+  std::cout << count << " values left on " << num_threads << " threads\n";
+}
 
-  void push_front(T value) {
-    std::unique_ptr<node> new_node(new node(std::move(value)));
-    std::lock_guard<std::mutex> lk(_head._m);
-    new_node->_next = std::move(_head._next);
-    _head._next = std::move(new_node);
-  }
+int main() {
+  unsigned const num_threads =
+      std::max(std::thread::hardware_concurrency(), 2U);
+  threadsafe_list<int> shared_list;
+  exercise(shared_list, num_threads);
 
-  void push_front(T &&value) {
-    std::unique_ptr<node> new_node(new node(std::move(value)));
-    std::lock_guard<std::mutex> lk(_head._m);
-    new_node->_next = std::move(_head._next);
-    _head._next = std::move(new_node);
+  // the nodes come from the arena of the thread that pushes them
+  thread_arena_resource arenas;
+  {
+    threadsafe_list<int, std::mutex, value_storage> arena_list(&arenas);
+    exercise(arena_list, num_threads);
   }
 
-  template <typename Function>
-  void for_each(Function f) {
-    node *current = &_head;
-    std::unique_lock<std::mutex> lk(_head._m);
-    while (node *const next = current->_next.get()) {
-      std::unique_lock<std::mutex> next_lk(next->_m);
-      lk.unlock();
-      f(*next->_data);
-      current = next;
-      lk = std::move(next_lk);
-    }
-  }
+  // one thread, no locking
+  threadsafe_list<int, null_mutex, value_storage> local_list;
+  exercise(local_list, 1);
 
-  template <typename Predicate>
-  std::shared_ptr<T> find_first_if(Predicate p) {
-    node *current = &_head;
-    std::unique_lock<std::mutex> lk(_head._m);
-    while (node *const next = current->_next.get()) {
-      std::unique_lock<std::mutex> next_lk(next->_m);
-      lk.unlock();
-      if (p(*next->_data)) {
-        return next->_data;
-      }
-      current = next;
-      lk = std::move(next_lk);
-    }
-    return nullptr;
-  }
+  threadsafe_list<std::string, null_mutex> words;
+  words.emplace_front(3, 'z');
+  words.push_front("list");
+  std::cout << "First three-letter word: "
+            << *words.find_first_if(
+                   [](std::string const &w) { return w.size() == 3; })
+            << '\n';
 
-  template <typename Predicate>
-  void remove_if(Predicate p) {
-    node *current = &_head;
-    std::unique_lock<std::mutex> lk(_head._m);
-    while (node *const next = current->_next.get()) {
-      std::unique_lock<std::mutex> next_lk(next->_m);
-      if (p(*next->_data)) {
-        current->_next = std::move(next->_next);
-        next_lk.unlock();
-      } else {
-        lk.unlock();
-        current = next;
-        lk = std::move(next_lk);
-      }
-    }
-  }
-};
+  return 0;
+}
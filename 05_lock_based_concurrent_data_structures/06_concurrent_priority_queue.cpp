@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cache_line.hpp"
+
+// Strict priority queue: a single binary heap behind a single mutex.
+// try_pop_min() always returns the element with the smallest priority (the
+// first one according to Compare), and elements with equal priorities come out
+// in the order they were pushed.
+template <typename Priority, typename T, typename Compare = std::less<Priority>>
+class locked_priority_queue
+{
+private:
+  struct entry
+  {
+    Priority _priority;
+    std::uint64_t _seq;
+    T _value;
+  };
+
+  // std::push_heap builds a max-heap, so order the entries in reverse
+  struct entry_compare
+  {
+    Compare _compare;
+
+    bool
+    operator()(entry const &lhs, entry const &rhs) const {
+      if (_compare(lhs._priority, rhs._priority)) {
+        return false;
+      }
+      if (_compare(rhs._priority, lhs._priority)) {
+        return true;
+      }
+      return lhs._seq > rhs._seq;
+    }
+  };
+
+  mutable std::mutex _m;
+  std::vector<entry> _heap;
+  std::uint64_t _next_seq{0};
+  entry_compare _entry_compare;
+
+  // must be called with _m held and _heap not empty
+  T
+  pop_top() {
+    std::pop_heap(_heap.begin(), _heap.end(), _entry_compare);
+    T value = std::move(_heap.back()._value);
+    _heap.pop_back();
+    return value;
+  }
+
+public:
+  explicit locked_priority_queue(Compare const &compare = Compare())
+      : _entry_compare{compare} {}
+
+  locked_priority_queue(locked_priority_queue const &) = delete;
+  locked_priority_queue(locked_priority_queue &&) = delete;
+  locked_priority_queue &
+  operator=(locked_priority_queue const &) = delete;
+  locked_priority_queue &
+  operator=(locked_priority_queue &&) = delete;
+  ~locked_priority_queue() = default;
+
+  void
+  push(Priority priority, T value) {
+    std::lock_guard<std::mutex> lk(_m);
+    _heap.push_back(entry{std::move(priority), _next_seq++, std::move(value)});
+    std::push_heap(_heap.begin(), _heap.end(), _entry_compare);
+  }
+
+  bool
+  try_pop_min(T &value) {
+    std::lock_guard<std::mutex> lk(_m);
+    if (_heap.empty()) {
+      return false;
+    }
+    value = pop_top();
+    return true;
+  }
+
+  std::shared_ptr<T>
+  try_pop_min() {
+    std::lock_guard<std::mutex> lk(_m);
+    if (_heap.empty()) {
+      return nullptr;
+    }
+    return std::make_shared<T>(pop_top());
+  }
+
+  bool
+  empty() const {
+    std::lock_guard<std::mutex> lk(_m);
+    return _heap.empty();
+  }
+};
+
+// Relaxed priority queue (MultiQueue): the elements are spread over
+// QueuesPerThread * hardware_concurrency independent heaps, each with its own
+// mutex.
+// push() inserts into a random heap, try_pop_min() peeks at the top of two
+// random heaps without locking them and pops from the better one. The popped
+// element is not always the global minimum, but its expected rank is small
+// and constant, while no single lock is shared by all threads.
+// The tops are peeked through atomics, so Priority has to be trivially
+// copyable.
+template <typename Priority,
+          typename T,
+          typename Compare = std::less<Priority>,
+          unsigned QueuesPerThread = 2>
+class multi_priority_queue
+{
+  static_assert(std::is_trivially_copyable<Priority>::value,
+                "the priority of the top of each heap is read lock-free");
+
+private:
+  struct entry
+  {
+    Priority _priority;
+    T _value;
+  };
+
+  struct entry_compare
+  {
+    Compare _compare;
+
+    bool
+    operator()(entry const &lhs, entry const &rhs) const {
+      return _compare(rhs._priority, lhs._priority);
+    }
+  };
+
+  struct alignas(CACHE_LINE_SIZE) sub_queue
+  {
+    std::mutex _m;
+    std::vector<entry> _heap;
+    // copies of the top priority and of the emptiness of _heap, updated with
+    // _m held and read without it to pick the heap to pop from
+    std::atomic<Priority> _top{};
+    std::atomic<bool> _empty{true};
+
+    void
+    publish_top() {
+      if (!_heap.empty()) {
+        _top.store(_heap.front()._priority, std::memory_order_relaxed);
+      }
+      _empty.store(_heap.empty(), std::memory_order_relaxed);
+    }
+  };
+
+  std::vector<sub_queue> _queues;
+  entry_compare _entry_compare;
+
+  // xorshift64, one state per thread: cheap and without any shared state
+  std::size_t
+  random_index() const {
+    thread_local std::uint64_t state =
+        std::hash<std::thread::id>()(std::this_thread::get_id())
+        | std::uint64_t{1};
+    state ^= state << 13U;
+    state ^= state >> 7U;
+    state ^= state << 17U;
+    return static_cast<std::size_t>(state % _queues.size());
+  }
+
+  // true if the top of lhs should be popped before the top of rhs
+  bool
+  better(sub_queue const &lhs, sub_queue const &rhs) const {
+    if (lhs._empty.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    if (rhs._empty.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    return _entry_compare._compare(lhs._top.load(std::memory_order_relaxed),
+                                   rhs._top.load(std::memory_order_relaxed));
+  }
+
+  // must be called with q._m held and q._heap not empty
+  T
+  pop_top(sub_queue &q) {
+    std::pop_heap(q._heap.begin(), q._heap.end(), _entry_compare);
+    T value = std::move(q._heap.back()._value);
+    q._heap.pop_back();
+    q.publish_top();
+    return value;
+  }
+
+  bool
+  try_pop_from(sub_queue &q, T &value) {
+    std::unique_lock<std::mutex> lk(q._m, std::try_to_lock);
+    if (!lk.owns_lock() || q._heap.empty()) {
+      return false;
+    }
+    value = pop_top(q);
+    return true;
+  }
+
+public:
+  explicit multi_priority_queue(unsigned num_threads
+                                = std::thread::hardware_concurrency(),
+                                Compare const &compare = Compare())
+      : _queues(std::max(2U, QueuesPerThread * std::max(num_threads, 1U))),
+        _entry_compare{compare} {}
+
+  multi_priority_queue(multi_priority_queue const &) = delete;
+  multi_priority_queue(multi_priority_queue &&) = delete;
+  multi_priority_queue &
+  operator=(multi_priority_queue const &) = delete;
+  multi_priority_queue &
+  operator=(multi_priority_queue &&) = delete;
+  ~multi_priority_queue() = default;
+
+  void
+  push(Priority priority, T value) {
+    // skip heaps that are being used by other threads instead of waiting
+    std::unique_lock<std::mutex> lk;
+    sub_queue *q = nullptr;
+    do {
+      q = &_queues[random_index()];
+      lk = std::unique_lock<std::mutex>(q->_m, std::try_to_lock);
+    } while (!lk.owns_lock());
+
+    q->_heap.push_back(entry{priority, std::move(value)});
+    std::push_heap(q->_heap.begin(), q->_heap.end(), _entry_compare);
+    q->publish_top();
+  }
+
+  bool
+  try_pop_min(T &value) {
+    // a few rounds of the two-choice pop, which is where almost all pops end
+    for (std::size_t attempt = 0; attempt < _queues.size(); ++attempt) {
+      sub_queue &first = _queues[random_index()];
+      sub_queue &second = _queues[random_index()];
+      sub_queue &chosen = better(second, first) ? second : first;
+      if (try_pop_from(chosen, value)) {
+        return true;
+      }
+    }
+
+    // the queue looks (nearly) empty, so sweep all heaps, this time waiting for
+    // their locks, before reporting that there's nothing to pop
+    for (sub_queue &q : _queues) {
+      std::lock_guard<std::mutex> lk(q._m);
+      if (!q._heap.empty()) {
+        value = pop_top(q);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::shared_ptr<T>
+  try_pop_min() {
+    T value;
+    if (!try_pop_min(value)) {
+      return nullptr;
+    }
+    return std::make_shared<T>(std::move(value));
+  }
+
+  bool
+  empty() const {
+    return std::all_of(_queues.begin(), _queues.end(), [](sub_queue const &q) {
+      return q._empty.load(std::memory_order_relaxed);
+    });
+  }
+};
+
+// The FIFO baseline, the same as threadsafe_queue in 02_threadsafe_queue.cpp
+// but storing the values directly, to compare against the cost of keeping the
+// elements ordered
+template <typename T>
+class fifo_queue
+{
+private:
+  std::mutex _m;
+  std::queue<T> _data;
+
+public:
+  void
+  push(unsigned /*priority*/, T value) {
+    std::lock_guard<std::mutex> lk(_m);
+    _data.push(std::move(value));
+  }
+
+  bool
+  try_pop_min(T &value) {
+    std::lock_guard<std::mutex> lk(_m);
+    if (_data.empty()) {
+      return false;
+    }
+    value = std::move(_data.front());
+    _data.pop();
+    return true;
+  }
+};
+
+// every thread pushes OPS_PER_THREAD elements with pseudo-random priorities and
+// pops after every push, the way a pool of workers that also produce work
+// would use the queue
+template <typename Queue>
+double
+benchmark(Queue &q, unsigned num_threads) {
+  static constexpr unsigned OPS_PER_THREAD = 200'000;
+  static constexpr unsigned PREFILL = 10'000;
+
+  for (unsigned i = 0; i < PREFILL; ++i) {
+    q.push((i * 2'654'435'761U) % 1'000U, i);
+  }
+
+  std::atomic<unsigned long> popped{0};
+  auto worker = [&q, &popped](unsigned id) {
+    unsigned long local_popped = 0;
+    unsigned value = 0;
+    for (unsigned i = 0; i < OPS_PER_THREAD; ++i) {
+      q.push(((id + i) * 2'654'435'761U) % 1'000U, i);
+      if (q.try_pop_min(value)) {
+        ++local_popped;
+      }
+    }
+    popped += local_popped;
+  };
+
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back(worker, t);
+  }
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+  std::chrono::duration<double> const elapsed
+      = std::chrono::steady_clock::now() - start;
+
+  unsigned value = 0;
+  while (q.try_pop_min(value)) {
+    ++popped;
+  }
+  assert(popped == PREFILL + static_cast<unsigned long>(num_threads)
+                                 * OPS_PER_THREAD);
+
+  return 2.0 * num_threads * OPS_PER_THREAD / elapsed.count();
+}
+
+int
+main() {
+  // the strict queue pops in priority order, and in push order on ties
+  locked_priority_queue<int, char> strict;
+  strict.push(3, 'd');
+  strict.push(1, 'b');
+  strict.push(0, 'a');
+  strict.push(1, 'c');
+  std::string order;
+  char c = 0;
+  while (strict.try_pop_min(c)) {
+    order.push_back(c);
+  }
+  assert(order == "abcd");
+
+  // the relaxed queue loses no elements
+  multi_priority_queue<int, int> relaxed(4);
+  for (int i = 0; i < 1'000; ++i) {
+    relaxed.push(i % 10, i);
+  }
+  int sum = 0;
+  int value = 0;
+  while (relaxed.try_pop_min(value)) {
+    sum += value;
+  }
+  assert(sum == 999 * 1'000 / 2);
+  assert(relaxed.empty());
+
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+  std::cout << "push + try_pop_min with " << num_threads << " threads\n";
+  {
+    fifo_queue<unsigned> q;
+    std::cout << "  FIFO queue:        " << benchmark(q, num_threads)
+              << " ops/s\n";
+  }
+  {
+    locked_priority_queue<unsigned, unsigned> q;
+    std::cout << "  locked heap:       " << benchmark(q, num_threads)
+              << " ops/s\n";
+  }
+  {
+    multi_priority_queue<unsigned, unsigned> q(num_threads);
+    std::cout << "  MultiQueue:        " << benchmark(q, num_threads)
+              << " ops/s\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.hpp"
+#include "threadsafe/multi_lane_queue.hpp"
+#include "threadsafe/queue.hpp"
+
+// Every queue of this chapter has a single head and a single tail, so all
+// producers and consumers take turns on the same lock and the same cache
+// lines, whatever the number of cores. multi_lane_queue spreads them over
+// independent lanes and gives up the global FIFO order for it, keeping only
+// the order of the elements of every producer.
+
+struct item
+{
+  unsigned _producer;
+  unsigned _seq;
+};
+
+// num_producers threads push ITEMS_PER_PRODUCER items each while num_consumers
+// threads pop them, checking that the items of every producer come out in the
+// order they were pushed when check_order is set
+template <typename Queue>
+void
+run_producers_consumers(char const *label,
+                        Queue &queue,
+                        unsigned num_producers,
+                        unsigned num_consumers,
+                        bool check_order) {
+  static constexpr unsigned ITEMS_PER_PRODUCER = 100'000;
+
+  std::atomic<unsigned long> popped{0};
+  std::atomic<unsigned long> out_of_order{0};
+  // A poison pill per consumer doesn't work with multi_lane_queue: the pills
+  // all go to the lane of the thread that pushes them, and a consumer that
+  // reaches that lane before another one is drained stops and leaves items
+  // behind. The consumers stop instead once the producers are done and a pop
+  // finds every lane empty.
+  std::atomic<bool> producers_done{false};
+  std::vector<std::thread> consumers;
+  for (unsigned c = 0; c < num_consumers; ++c) {
+    consumers.emplace_back([&] {
+      using namespace std::chrono_literals;
+      perf_region region(std::string(label) + " pop");
+      // the last sequence number seen from every producer
+      std::vector<unsigned> last_seq(num_producers, 0);
+      unsigned long local_popped = 0;
+      item it{};
+      while (true) {
+        // read before the pop: a pop that finds nothing after the producers
+        // finished means nothing is left
+        bool const done = producers_done.load(std::memory_order_acquire);
+        if (!queue.wait_and_pop_for(it, 1ms)) {
+          if (done) {
+            break;
+          }
+          continue;
+        }
+        if (check_order && it._seq <= last_seq[it._producer]) {
+          ++out_of_order;
+        }
+        last_seq[it._producer] = it._seq;
+        ++local_popped;
+      }
+      region.set_ops(local_popped);
+      popped += local_popped;
+    });
+  }
+
+  std::vector<std::thread> producers;
+  for (unsigned p = 0; p < num_producers; ++p) {
+    producers.emplace_back([label, &queue, p] {
+      perf_region region(std::string(label) + " push", ITEMS_PER_PRODUCER);
+      for (unsigned seq = 1; seq <= ITEMS_PER_PRODUCER; ++seq) {
+        queue.push(item{p, seq});
+      }
+    });
+  }
+  std::for_each(
+      producers.begin(), producers.end(), std::mem_fn(&std::thread::join));
+  producers_done.store(true, std::memory_order_release);
+  std::for_each(
+      consumers.begin(), consumers.end(), std::mem_fn(&std::thread::join));
+
+  assert(popped == static_cast<unsigned long>(num_producers)
+                       * ITEMS_PER_PRODUCER);
+  assert(out_of_order == 0);
+  assert(queue.empty());
+}
+
+int
+main() {
+  using namespace std::chrono_literals;
+
+  {
+    // one lane per thread, so the elements of a thread come back in order
+    multi_lane_queue<int, std::mutex, value_storage> queue(4);
+    for (int i = 0; i < 10; ++i) {
+      queue.push(i);
+    }
+    for (int i = 0; i < 10; ++i) {
+      [[maybe_unused]] std::optional<int> const value = queue.try_pop();
+      assert(value && *value == i);
+    }
+    [[maybe_unused]] std::optional<int> const drained = queue.try_pop();
+    assert(!drained);
+
+    int value = 0;
+    [[maybe_unused]] bool const popped = queue.wait_and_pop_for(value, 10ms);
+    assert(!popped);
+
+    // an element pushed from another lane is stolen by a waiting consumer
+    std::thread producer([&queue] {
+      std::this_thread::sleep_for(10ms);
+      queue.push(42);
+    });
+    queue.wait_and_pop(value);
+    assert(value == 42);
+    producer.join();
+  }
+
+  unsigned const num_threads
+      = std::max(std::thread::hardware_concurrency(), 2U);
+  {
+    threadsafe_queue<item, std::mutex, blocking_wait, value_storage> queue;
+    run_producers_consumers(
+        "threadsafe_queue", queue, num_threads, num_threads, true);
+  }
+  {
+    multi_lane_queue<item, std::mutex, value_storage> queue(num_threads);
+    run_producers_consumers(
+        "multi_lane_queue", queue, num_threads, num_threads, true);
+  }
+  {
+    multi_lane_queue<item, spinlock_mutex, value_storage> queue(num_threads);
+    run_producers_consumers(
+        "multi_lane spinlock", queue, num_threads, num_threads, true);
+  }
+  {
+    // producers that migrate between CPUs switch lanes, so no order check
+    multi_lane_queue<item, std::mutex, value_storage, per_cpu_lane> queue(
+        num_threads);
+    run_producers_consumers(
+        "multi_lane per_cpu", queue, num_threads, num_threads, false);
+  }
+  perf_report(std::cout);
+
+  return 0;
+}
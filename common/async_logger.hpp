@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef> // std::size_t, std::max_align_t
+#include <cstdint> // std::uint64_t
+#include <memory>
+#include <mutex>
+#include <new> // std::launder
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <climits>   // IOV_MAX
+#include <sys/uio.h> // writev
+#include <unistd.h>  // STDOUT_FILENO
+
+#include "cache_line.hpp"
+
+// Logging through std::cout from many threads serializes them all on the
+// stream, and usually on a mutex around it so that lines don't interleave.
+// Here a thread only copies the arguments of a line into a buffer of its own,
+// which nobody else writes to; turning them into text and writing it out is
+// left to a single background thread, which does it for all the threads at
+// once with one writev() per round.
+//
+//   log_line("Consumer ", id, " got ", value);
+//   log_flush(); // before writing to the same file in any other way
+//
+// The lines of one thread come out in order, but there is no order between
+// the lines of different threads. A thread whose buffer is full sleeps until
+// the writer has emptied it, so lines are never lost.
+
+/// Append the text of value to out. Arithmetic types and strings are formatted
+/// directly, anything else through its operator<<.
+template <typename T>
+void
+log_append(std::string &out, T const &value) {
+  if constexpr (std::is_same_v<T, bool>) {
+    out += value ? "true" : "false";
+  } else if constexpr (std::is_same_v<T, char>) {
+    out += value;
+  } else if constexpr (std::is_arithmetic_v<T>) {
+    std::array<char, 64> buf{};
+    auto const result
+        = std::to_chars(buf.data(), buf.data() + buf.size(), value);
+    out.append(buf.data(), result.ptr);
+  } else if constexpr (std::is_convertible_v<T const &, std::string_view>) {
+    out += std::string_view(value);
+  } else {
+    std::ostringstream os;
+    os << value;
+    out += os.str();
+  }
+}
+
+// what a line keeps of an argument until it is formatted: strings are copied,
+// because a pointer or a view may well be dangling by then
+template <typename T>
+using log_capture_t = std::conditional_t<
+    std::is_same_v<std::decay_t<T>, char const *>
+        || std::is_same_v<std::decay_t<T>, char *>
+        || std::is_same_v<std::decay_t<T>, std::string_view>,
+    std::string,
+    std::decay_t<T>>;
+
+// size of a record part, rounded up to keep the next part aligned for anything
+constexpr std::size_t
+log_aligned(std::size_t size) {
+  return (size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t)
+         * alignof(std::max_align_t);
+}
+
+/// Records of one thread: the owner appends, the writer consumes
+class log_buffer
+{
+public:
+  static constexpr std::size_t CAPACITY = 1U << 16U;
+
+private:
+  // formats the payload that follows the header into out and destroys it; a
+  // header without one only pads up to the end of the buffer
+  struct record_header
+  {
+    void (*_format)(void *payload, std::string &out);
+    std::size_t _size;
+  };
+
+  static constexpr std::size_t HEADER_SIZE
+      = log_aligned(sizeof(record_header));
+
+  template <typename Payload>
+  static void
+  format_payload(void *payload, std::string &out) {
+    Payload *const args = std::launder(static_cast<Payload *>(payload));
+    std::apply([&out](auto const &...arg) { (log_append(out, arg), ...); },
+               *args);
+    out += '\n';
+    args->~Payload();
+  }
+
+  std::unique_ptr<std::max_align_t[]> _data{
+      new std::max_align_t[CAPACITY / sizeof(std::max_align_t)]};
+  // bytes ever appended by the owner, and ever consumed by the writer
+  alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> _head{0};
+  alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> _tail{0};
+  std::atomic<bool> _closed{false};
+
+  void *
+  at(std::uint64_t position) {
+    return reinterpret_cast<std::byte *>(_data.get()) + position % CAPACITY;
+  }
+
+public:
+  /// Append a record. If the buffer is full, call on_full() and retry until
+  /// the writer has made room.
+  template <typename Payload, typename OnFull>
+  void
+  push(Payload &&payload, OnFull on_full) {
+    using payload_type = std::decay_t<Payload>;
+    static_assert(alignof(payload_type) <= alignof(std::max_align_t));
+    static constexpr std::size_t size
+        = HEADER_SIZE + log_aligned(sizeof(payload_type));
+    static_assert(size <= CAPACITY / 4, "log line arguments are too large");
+
+    std::uint64_t const head = _head.load(std::memory_order_relaxed);
+    // records don't wrap around: skip to the start if this one wouldn't fit
+    std::size_t const offset = head % CAPACITY;
+    std::size_t const skip = offset + size > CAPACITY ? CAPACITY - offset : 0;
+    while (head + skip + size - _tail.load(std::memory_order_acquire)
+           > CAPACITY) {
+      on_full();
+    }
+
+    if (skip != 0) {
+      ::new (at(head)) record_header{nullptr, skip};
+    }
+    std::byte *const record = static_cast<std::byte *>(at(head + skip));
+    ::new (static_cast<void *>(record))
+        record_header{&format_payload<payload_type>, size};
+    ::new (static_cast<void *>(record + HEADER_SIZE))
+        payload_type(std::forward<Payload>(payload));
+    _head.store(head + skip + size, std::memory_order_release);
+  }
+
+  /// Format every record appended so far into out, and free their space
+  void
+  consume(std::string &out) {
+    std::uint64_t const head = _head.load(std::memory_order_acquire);
+    std::uint64_t tail = _tail.load(std::memory_order_relaxed);
+    while (tail != head) {
+      record_header const header
+          = *std::launder(static_cast<record_header *>(at(tail)));
+      if (header._format != nullptr) {
+        header._format(static_cast<std::byte *>(at(tail)) + HEADER_SIZE, out);
+      }
+      tail += header._size;
+    }
+    _tail.store(tail, std::memory_order_release);
+  }
+
+  /// Called by the owner when it exits
+  void
+  close() {
+    _closed.store(true, std::memory_order_release);
+  }
+
+  bool
+  closed() const {
+    return _closed.load(std::memory_order_acquire);
+  }
+};
+
+class async_logger
+{
+private:
+  int const _fd;
+  std::chrono::milliseconds const _period;
+
+  std::mutex _buffers_m;
+  std::vector<std::shared_ptr<log_buffer>> _buffers;
+
+  std::mutex _m;
+  std::condition_variable _wake;
+  std::condition_variable _flushed_cond;
+  bool _stop{false};
+  // flushes asked for, and how many of them the writer had been asked for
+  // when it started its last finished round
+  std::uint64_t _flush_requests{0};
+  std::uint64_t _flushed{0};
+  std::thread _writer;
+
+  // the text of every buffer that had something, written with one writev()
+  void
+  write_round() {
+    std::vector<std::string> texts;
+    {
+      std::lock_guard<std::mutex> lk(_buffers_m);
+      texts.reserve(_buffers.size());
+      for (std::size_t i = 0; i < _buffers.size();) {
+        log_buffer &buffer = *_buffers[i];
+        // a buffer closed before it is consumed is empty after it
+        bool const closed = buffer.closed();
+        std::string text;
+        buffer.consume(text);
+        if (!text.empty()) {
+          texts.push_back(std::move(text));
+        }
+        if (closed) {
+          _buffers.erase(_buffers.begin() + static_cast<std::ptrdiff_t>(i));
+        } else {
+          ++i;
+        }
+      }
+    }
+
+    std::vector<iovec> iov;
+    iov.reserve(texts.size());
+    for (std::string &text : texts) {
+      iov.push_back({text.data(), text.size()});
+    }
+    write_all(iov);
+  }
+
+  void
+  write_all(std::vector<iovec> &iov) {
+    std::size_t first = 0;
+    while (first < iov.size()) {
+      int const count = static_cast<int>(
+          std::min<std::size_t>(iov.size() - first, IOV_MAX));
+      ssize_t written = ::writev(_fd, &iov[first], count);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // nowhere left to report it
+        return;
+      }
+      // skip what was written, which may end in the middle of an iovec
+      while (written > 0) {
+        auto const n = static_cast<std::size_t>(written);
+        if (n < iov[first].iov_len) {
+          iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + n;
+          iov[first].iov_len -= n;
+          break;
+        }
+        written -= static_cast<ssize_t>(iov[first].iov_len);
+        ++first;
+      }
+    }
+  }
+
+  void
+  run() {
+    std::unique_lock<std::mutex> lk(_m);
+    while (true) {
+      _wake.wait_for(
+          lk, _period, [this] { return _stop || _flushed != _flush_requests; });
+      bool const stop = _stop;
+      std::uint64_t const requests = _flush_requests;
+      lk.unlock();
+      write_round();
+      lk.lock();
+      _flushed = requests;
+      _flushed_cond.notify_all();
+      if (stop) {
+        return;
+      }
+    }
+  }
+
+  log_buffer &
+  this_thread_buffer() {
+    struct owner
+    {
+      std::shared_ptr<log_buffer> _buffer;
+      explicit owner(async_logger &logger)
+          : _buffer(std::make_shared<log_buffer>()) {
+        std::lock_guard<std::mutex> lk(logger._buffers_m);
+        logger._buffers.push_back(_buffer);
+      }
+      owner(owner const &) = delete;
+      owner(owner &&) = delete;
+      owner &
+      operator=(owner const &) = delete;
+      owner &
+      operator=(owner &&) = delete;
+      ~owner() {
+        _buffer->close();
+      }
+    };
+    thread_local owner o(*this);
+    return *o._buffer;
+  }
+
+  // writes to fd every period, or sooner when a buffer fills up; there is only
+  // the one instance, because a thread has a single buffer
+  explicit async_logger(
+      int fd = STDOUT_FILENO,
+      std::chrono::milliseconds period = std::chrono::milliseconds(10))
+      : _fd(fd),
+        _period(period),
+        _writer(&async_logger::run, this) {}
+
+public:
+  async_logger(async_logger const &) = delete;
+  async_logger(async_logger &&) = delete;
+  async_logger &
+  operator=(async_logger const &) = delete;
+  async_logger &
+  operator=(async_logger &&) = delete;
+
+  /// Writes out everything logged so far
+  ~async_logger() {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _stop = true;
+    }
+    _wake.notify_one();
+    _writer.join();
+  }
+
+  /// The logger writing to stdout
+  static async_logger &
+  instance() {
+    static async_logger logger;
+    return logger;
+  }
+
+  /// Log the concatenation of args, and a newline
+  template <typename... Args>
+  void
+  log(Args &&...args) {
+    this_thread_buffer().push(
+        std::tuple<log_capture_t<Args>...>(std::forward<Args>(args)...),
+        // a round consumes everything the buffers hold when it starts, so once
+        // one that starts after the request is done, the tail of this thread's
+        // buffer has moved. The request is made and waited for under _m, so the
+        // writer can't miss it.
+        [this] { flush(); });
+  }
+
+  /// Block until everything the calling thread logged so far is written
+  void
+  flush() {
+    std::unique_lock<std::mutex> lk(_m);
+    std::uint64_t const request = ++_flush_requests;
+    _wake.notify_one();
+    _flushed_cond.wait(lk, [this, request] { return _flushed >= request; });
+  }
+};
+
+template <typename... Args>
+void
+log_line(Args &&...args) {
+  async_logger::instance().log(std::forward<Args>(args)...);
+}
+
+inline void
+log_flush() {
+  async_logger::instance().flush();
+}
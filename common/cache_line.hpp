@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef> // std::size_t
+
+// size used to pad data that different threads write to, so that each of them
+// gets its own cache line and no false sharing happens.
+// std::hardware_destructive_interference_size would be the portable spelling,
+// but GCC warns about its use in headers, because the value is ABI dependent.
+static constexpr std::size_t CACHE_LINE_SIZE = 64;
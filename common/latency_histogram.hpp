@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath> // std::ceil
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Averages and throughput hide the tail, which is what the slowest requests
+// see. latency_histogram records every sample at a fixed relative precision,
+// so the high percentiles come out right however rare the outliers are.
+//
+// Measuring latency with a closed loop, where every request is only sent after
+// the previous one completed, hides stalls: while the system is stuck, the
+// load generator sends nothing, and the one slow sample stands in for all the
+// requests that should have been sent meanwhile (coordinated omission). Send
+// at a fixed rate instead, and measure every request from the time it was meant
+// to be sent.
+
+/// Log-linear histogram of latencies in nanoseconds, after HdrHistogram: the
+/// values below SUB_BUCKETS are counted exactly, and every power of two above
+/// that is split in SUB_BUCKETS / 2 buckets of equal width, so a value is
+/// recorded within 1 / (SUB_BUCKETS / 2) of itself, in a fixed amount of memory
+/// whatever the range. One histogram per thread, merged once the threads are
+/// done: recording isn't thread-safe.
+class latency_histogram
+{
+public:
+  static constexpr unsigned SUB_BUCKET_BITS = 8;
+  static constexpr std::uint64_t SUB_BUCKETS = std::uint64_t{1}
+                                               << SUB_BUCKET_BITS;
+
+private:
+  static constexpr std::uint64_t HALF = SUB_BUCKETS / 2;
+  // every power of two from SUB_BUCKET_BITS up to 63 adds HALF buckets
+  static constexpr std::size_t NUM_BUCKETS
+      = (64 - SUB_BUCKET_BITS + 2) * HALF;
+
+  std::vector<std::uint64_t> _counts;
+  std::uint64_t _total{0};
+  std::uint64_t _min{std::numeric_limits<std::uint64_t>::max()};
+  std::uint64_t _max{0};
+
+  static unsigned
+  highest_bit(std::uint64_t value) {
+    return 63U - static_cast<unsigned>(__builtin_clzll(value));
+  }
+
+  static std::uint64_t
+  bucket_of(std::uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    unsigned const shift = highest_bit(value) - (SUB_BUCKET_BITS - 1);
+    return (shift + 1) * HALF + (value >> shift) - HALF;
+  }
+
+  // the largest value that lands in bucket
+  static std::uint64_t
+  highest_in(std::size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    std::uint64_t const shift = bucket / HALF - 1;
+    std::uint64_t const lowest = (bucket % HALF + HALF) << shift;
+    return lowest + ((std::uint64_t{1} << shift) - 1);
+  }
+
+public:
+  latency_histogram()
+      : _counts(NUM_BUCKETS, 0) {}
+
+  void
+  record(std::uint64_t nanoseconds) {
+    ++_counts[bucket_of(nanoseconds)];
+    ++_total;
+    _min = std::min(_min, nanoseconds);
+    _max = std::max(_max, nanoseconds);
+  }
+
+  void
+  record(std::chrono::nanoseconds latency) {
+    record(static_cast<std::uint64_t>(
+        std::max(latency.count(), decltype(latency.count()){0})));
+  }
+
+  void
+  merge(latency_histogram const &other) {
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+      _counts[i] += other._counts[i];
+    }
+    _total += other._total;
+    _min = std::min(_min, other._min);
+    _max = std::max(_max, other._max);
+  }
+
+  void
+  clear() {
+    std::fill(_counts.begin(), _counts.end(), 0);
+    _total = 0;
+    _min = std::numeric_limits<std::uint64_t>::max();
+    _max = 0;
+  }
+
+  std::uint64_t
+  count() const {
+    return _total;
+  }
+
+  std::uint64_t
+  min() const {
+    return _total == 0 ? 0 : _min;
+  }
+
+  std::uint64_t
+  max() const {
+    return _max;
+  }
+
+  /// The smallest value that percentile percent of the samples are at or
+  /// below, rounded up to the end of its bucket
+  std::uint64_t
+  value_at_percentile(double percentile) const {
+    if (_total == 0) {
+      return 0;
+    }
+    auto const wanted = std::max<std::uint64_t>(
+        1,
+        static_cast<std::uint64_t>(
+            std::ceil(percentile / 100.0 * static_cast<double>(_total))));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+      seen += _counts[i];
+      if (seen >= wanted) {
+        return std::min(highest_in(i), _max);
+      }
+    }
+    return _max;
+  }
+};
+
+/// Print the column headers for latency_report_row()
+inline void
+latency_report_header(std::ostream &os) {
+  std::ios_base::fmtflags const flags = os.flags();
+  os << std::left << std::setw(36) << "latency (us)" << std::right
+     << std::setw(10) << "samples" << std::setw(10) << "p50" << std::setw(10)
+     << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max" << '\n';
+  os.flags(flags);
+}
+
+/// Print the count, p50, p99, p99.9 and max of histogram, in microseconds
+inline void
+latency_report_row(std::ostream &os,
+                   std::string const &label,
+                   latency_histogram const &histogram) {
+  std::ios_base::fmtflags const flags = os.flags();
+  std::streamsize const precision = os.precision();
+  auto const us
+      = [](std::uint64_t ns) { return static_cast<double>(ns) / 1e3; };
+  os << std::left << std::setw(36) << label << std::right << std::setw(10)
+     << histogram.count() << std::fixed << std::setprecision(1)
+     << std::setw(10) << us(histogram.value_at_percentile(50.0))
+     << std::setw(10) << us(histogram.value_at_percentile(99.0))
+     << std::setw(10) << us(histogram.value_at_percentile(99.9))
+     << std::setw(10) << us(histogram.max()) << '\n';
+  os.flags(flags);
+  os.precision(precision);
+}
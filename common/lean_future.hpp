@@ -0,0 +1,372 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint32_t
+#include <exception>
+#include <future> // std::future_error
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "wait_strategy.hpp" // cpu_relax
+
+// std::promise and std::future share a heap allocated state that a mutex and a
+// condition variable guard: every pair costs an allocation, and setting the
+// value and getting it take the lock. lean_promise and lean_future share a
+// pooled state instead, completed through one atomic word that also counts
+// the owners, so neither side ever takes a lock and a pair that is created,
+// fulfilled and read on the same threads allocates nothing after the first.
+// Needs C++20, for std::atomic::wait.
+
+namespace lean_future_detail {
+
+// bits of the state word
+inline constexpr std::uint32_t VALUE = 1; // set_value() was called
+inline constexpr std::uint32_t ERROR = 2; // set_exception() or broken promise
+inline constexpr std::uint32_t WAITING = 4; // the future sleeps in wait()
+inline constexpr std::uint32_t PROMISE_GONE = 8;
+inline constexpr std::uint32_t FUTURE_GONE = 16;
+inline constexpr std::uint32_t READY = VALUE | ERROR;
+
+struct no_value
+{};
+
+template <typename T>
+struct shared_state
+{
+  using value_type = std::conditional_t<std::is_void<T>::value, no_value, T>;
+
+  std::atomic<std::uint32_t> _state{0};
+  std::exception_ptr _error;
+  union
+  {
+    value_type _value;
+    // while the state sits in the pool
+    shared_state *_next_free;
+  };
+
+  shared_state() noexcept
+      : _next_free(nullptr) {}
+
+  // the value, if any, is destroyed by recycle()
+  ~shared_state() {}
+
+  shared_state(shared_state const &) = delete;
+  shared_state &
+  operator=(shared_state const &) = delete;
+};
+
+/// Per-thread free list of shared states. A state goes back to the pool of the
+/// thread that releases it last, which for a future read on the thread that
+/// made the promise is the thread that takes it again.
+template <typename T>
+class state_pool
+{
+  static constexpr std::size_t MAX_CACHED = 256;
+
+  // trivially destructible, so that it can still be used by the destructors of
+  // other thread_local objects once the reaper ran
+  struct free_list
+  {
+    shared_state<T> *_head;
+    std::size_t _size;
+    bool _closed;
+  };
+
+  struct reaper
+  {
+    ~reaper() {
+      free_list &list = local();
+      while (list._head != nullptr) {
+        shared_state<T> *const next = list._head->_next_free;
+        delete list._head;
+        list._head = next;
+      }
+      list._size = 0;
+      list._closed = true;
+    }
+  };
+
+  static free_list &
+  local() {
+    thread_local free_list list{nullptr, 0, false};
+    return list;
+  }
+
+public:
+  static shared_state<T> *
+  acquire() {
+    free_list &list = local();
+    if (list._head == nullptr) {
+      return new shared_state<T>();
+    }
+    shared_state<T> *const state = list._head;
+    list._head = state->_next_free;
+    --list._size;
+    return state;
+  }
+
+  static void
+  release(shared_state<T> *state) noexcept {
+    thread_local reaper the_reaper;
+    free_list &list = local();
+    if (list._closed || list._size == MAX_CACHED) {
+      delete state;
+      return;
+    }
+    state->_next_free = list._head;
+    list._head = state;
+    ++list._size;
+  }
+};
+
+/// Destroy what the state holds and return it to the pool. Called by whichever
+/// of the promise and the future lets go of it last.
+template <typename T>
+void
+recycle(shared_state<T> *state) noexcept {
+  if (state->_state.load(std::memory_order_relaxed) & VALUE) {
+    using value_type = typename shared_state<T>::value_type;
+    state->_value.~value_type();
+  }
+  state->_error = nullptr;
+  state->_state.store(0, std::memory_order_relaxed);
+  state_pool<T>::release(state);
+}
+
+/// Give up the promise's or the future's share of state
+template <typename T>
+void
+release(shared_state<T> *state, std::uint32_t gone) noexcept {
+  std::uint32_t const other_gone
+      = gone == PROMISE_GONE ? FUTURE_GONE : PROMISE_GONE;
+  // acq_rel: the last owner sees everything the other one wrote
+  if (state->_state.fetch_or(gone, std::memory_order_acq_rel) & other_gone) {
+    recycle(state);
+  }
+}
+
+} // namespace lean_future_detail
+
+template <typename T>
+class lean_promise;
+
+/// Move-only counterpart of std::future. wait() and get() spin for a while,
+/// since most futures are read shortly before they are fulfilled, and then
+/// sleep on the state word with std::atomic::wait. get() can only be called
+/// once.
+template <typename T>
+class lean_future
+{
+private:
+  using state_type = lean_future_detail::shared_state<T>;
+
+  static constexpr unsigned SPIN_ROUNDS = 128;
+
+  state_type *_state{nullptr};
+
+  explicit lean_future(state_type *state) noexcept
+      : _state(state) {}
+
+  friend class lean_promise<T>;
+
+  void
+  check_state() const {
+    if (_state == nullptr) {
+      throw std::future_error(std::future_errc::no_state);
+    }
+  }
+
+public:
+  lean_future() noexcept = default;
+
+  lean_future(lean_future &&other) noexcept
+      : _state(std::exchange(other._state, nullptr)) {}
+
+  lean_future &
+  operator=(lean_future &&other) noexcept {
+    if (this != &other) {
+      if (_state != nullptr) {
+        lean_future_detail::release(_state, lean_future_detail::FUTURE_GONE);
+      }
+      _state = std::exchange(other._state, nullptr);
+    }
+    return *this;
+  }
+
+  lean_future(lean_future const &) = delete;
+  lean_future &
+  operator=(lean_future const &) = delete;
+
+  ~lean_future() {
+    if (_state != nullptr) {
+      lean_future_detail::release(_state, lean_future_detail::FUTURE_GONE);
+    }
+  }
+
+  bool
+  valid() const noexcept {
+    return _state != nullptr;
+  }
+
+  bool
+  is_ready() const {
+    check_state();
+    return (_state->_state.load(std::memory_order_acquire)
+            & lean_future_detail::READY)
+           != 0;
+  }
+
+  void
+  wait() const {
+    using namespace lean_future_detail;
+    check_state();
+    std::atomic<std::uint32_t> &word = _state->_state;
+    std::uint32_t s = word.load(std::memory_order_acquire);
+    for (unsigned spins = 0; !(s & READY) && spins < SPIN_ROUNDS; ++spins) {
+      cpu_relax();
+      s = word.load(std::memory_order_acquire);
+    }
+    while (!(s & READY)) {
+      if (!(s & WAITING)) {
+        // the promise only calls notify_all() when it sees this bit, so it
+        // must be set before going to sleep on the word
+        s = word.fetch_or(WAITING, std::memory_order_acquire) | WAITING;
+        continue;
+      }
+      word.wait(s, std::memory_order_acquire);
+      s = word.load(std::memory_order_acquire);
+    }
+  }
+
+  /// Wait for the value and move it out, or rethrow the exception stored
+  /// instead. The future is no longer valid afterwards.
+  T
+  get() {
+    wait();
+    state_type *const state = std::exchange(_state, nullptr);
+    struct releaser
+    {
+      state_type *_owned;
+      ~releaser() {
+        lean_future_detail::release(_owned, lean_future_detail::FUTURE_GONE);
+      }
+    } const guard{state};
+    if (state->_state.load(std::memory_order_relaxed)
+        & lean_future_detail::ERROR) {
+      std::rethrow_exception(state->_error);
+    }
+    if constexpr (!std::is_void<T>::value) {
+      return std::move(state->_value);
+    }
+  }
+};
+
+/// Move-only counterpart of std::promise. Storing the value or the exception is
+/// one atomic read-modify-write on the state word, and a call to notify_all()
+/// only when the future went to sleep waiting for it. A promise destroyed
+/// without either stores a broken_promise std::future_error.
+template <typename T>
+class lean_promise
+{
+private:
+  using state_type = lean_future_detail::shared_state<T>;
+
+  state_type *_state;
+  bool _future_retrieved{false};
+
+  void
+  check_unsatisfied() const {
+    if (_state == nullptr) {
+      throw std::future_error(std::future_errc::no_state);
+    }
+    // only the promise sets the READY bits
+    if (_state->_state.load(std::memory_order_relaxed)
+        & lean_future_detail::READY) {
+      throw std::future_error(std::future_errc::promise_already_satisfied);
+    }
+  }
+
+  void
+  publish(std::uint32_t ready) {
+    using namespace lean_future_detail;
+    // release: the future reads the value or the exception once it sees ready
+    if (_state->_state.fetch_or(ready, std::memory_order_release) & WAITING) {
+      _state->_state.notify_all();
+    }
+  }
+
+  void
+  abandon() noexcept {
+    using namespace lean_future_detail;
+    if (_state == nullptr) {
+      return;
+    }
+    if (!_future_retrieved) {
+      // nobody can read the value: give up the share of the future too
+      release(_state, FUTURE_GONE);
+    } else if (!(_state->_state.load(std::memory_order_relaxed) & READY)) {
+      _state->_error = std::make_exception_ptr(
+          std::future_error(std::future_errc::broken_promise));
+      publish(ERROR);
+    }
+    release(_state, PROMISE_GONE);
+    _state = nullptr;
+  }
+
+public:
+  lean_promise()
+      : _state(lean_future_detail::state_pool<T>::acquire()) {}
+
+  lean_promise(lean_promise &&other) noexcept
+      : _state(std::exchange(other._state, nullptr))
+      , _future_retrieved(other._future_retrieved) {}
+
+  lean_promise &
+  operator=(lean_promise &&other) noexcept {
+    if (this != &other) {
+      abandon();
+      _state = std::exchange(other._state, nullptr);
+      _future_retrieved = other._future_retrieved;
+    }
+    return *this;
+  }
+
+  lean_promise(lean_promise const &) = delete;
+  lean_promise &
+  operator=(lean_promise const &) = delete;
+
+  ~lean_promise() {
+    abandon();
+  }
+
+  lean_future<T>
+  get_future() {
+    if (_state == nullptr) {
+      throw std::future_error(std::future_errc::no_state);
+    }
+    if (_future_retrieved) {
+      throw std::future_error(std::future_errc::future_already_retrieved);
+    }
+    _future_retrieved = true;
+    return lean_future<T>(_state);
+  }
+
+  template <typename... Args>
+  void
+  set_value(Args &&...args) {
+    check_unsatisfied();
+    using value_type = typename state_type::value_type;
+    ::new (static_cast<void *>(&_state->_value))
+        value_type(std::forward<Args>(args)...);
+    publish(lean_future_detail::VALUE);
+  }
+
+  void
+  set_exception(std::exception_ptr error) {
+    check_unsatisfied();
+    _state->_error = std::move(error);
+    publish(lean_future_detail::ERROR);
+  }
+};
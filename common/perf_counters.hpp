@@ -0,0 +1,350 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <iomanip>
+#include <ios>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h> // SYS_perf_event_open
+#include <unistd.h>      // close, read, syscall
+#endif
+
+// Hardware and software event counters of the calling thread, read through
+// perf_event_open(2), for finding out why one data structure is faster than
+// another: cycles, instructions, cache and branch misses per operation.
+// Counters that can't be opened, because the kernel doesn't allow it
+// (see /proc/sys/kernel/perf_event_paranoid), the machine has no PMU (most
+// VMs) or this isn't Linux, read as unavailable and are reported as such; the
+// wall time is always measured.
+//
+//   {
+//     perf_region region("queue push", NUM_OPS);
+//     ... NUM_OPS pushes ...
+//   }
+//   perf_report(std::cout);
+
+enum class perf_event
+{
+  cycles,
+  instructions,
+  l1d_misses,
+  llc_misses,
+  branch_misses,
+  context_switches
+};
+
+static constexpr std::size_t NUM_PERF_EVENTS = 6;
+
+inline char const *
+perf_event_name(perf_event event) {
+  static constexpr std::array<char const *, NUM_PERF_EVENTS> names{
+      "cycles", "instr", "L1d-miss", "LLC-miss", "br-miss", "ctx-sw"};
+  return names[static_cast<std::size_t>(event)];
+}
+
+struct perf_sample
+{
+  // the counts as read, or, for the difference of two reads, the counts in
+  // between scaled for the time the counters were multiplexed out
+  std::array<std::uint64_t, NUM_PERF_EVENTS> _counts{};
+  // how long each counter was enabled, and how long of that it counted
+  std::array<std::uint64_t, NUM_PERF_EVENTS> _time_enabled{};
+  std::array<std::uint64_t, NUM_PERF_EVENTS> _time_running{};
+  std::array<bool, NUM_PERF_EVENTS> _valid{};
+  std::chrono::nanoseconds _wall_time{0};
+};
+
+/// The events counted between start and end, two reads of the same counters.
+/// The counts are scaled by the share of the interval each counter ran: each
+/// read scaled by its own ratio could make end - start negative when the
+/// kernel multiplexes the counters differently in between.
+inline perf_sample
+perf_delta(perf_sample const &start, perf_sample const &end) {
+  perf_sample delta;
+  for (std::size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+    delta._valid[i] = start._valid[i] && end._valid[i];
+    if (!delta._valid[i]) {
+      continue;
+    }
+    std::uint64_t const count = end._counts[i] - start._counts[i];
+    std::uint64_t const enabled = end._time_enabled[i] - start._time_enabled[i];
+    std::uint64_t const running = end._time_running[i] - start._time_running[i];
+    delta._time_enabled[i] = enabled;
+    delta._time_running[i] = running;
+    delta._counts[i]
+        = running == 0 || running == enabled
+              ? count
+              : static_cast<std::uint64_t>(static_cast<double>(count)
+                                           * static_cast<double>(enabled)
+                                           / static_cast<double>(running));
+  }
+  return delta;
+}
+
+/// The counters of one thread. They are opened when the thread first uses
+/// them and count until it exits; regions are differences between two reads.
+class perf_counters
+{
+private:
+  std::array<int, NUM_PERF_EVENTS> _fds;
+
+#if defined(__linux__)
+  static int
+  open_event(std::uint32_t type, std::uint64_t config) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_hv = 1;
+    // when there are more events than hardware counters the kernel multiplexes
+    // them, and these let us scale the counts back up
+    attr.read_format
+        = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // context switches happen in the kernel, so try to count there first; the
+    // hardware events only count user space, which is all that unprivileged
+    // users may count
+    if (type == PERF_TYPE_SOFTWARE) {
+      int const fd = static_cast<int>(::syscall(
+          SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+      if (fd >= 0) {
+        return fd;
+      }
+    }
+    attr.exclude_kernel = 1;
+    return static_cast<int>(
+        ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+  }
+
+  static std::uint64_t
+  cache_miss(std::uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8U)
+           | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16U);
+  }
+#endif
+
+public:
+  perf_counters() {
+    _fds.fill(-1);
+#if defined(__linux__)
+    _fds[static_cast<std::size_t>(perf_event::cycles)]
+        = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    _fds[static_cast<std::size_t>(perf_event::instructions)]
+        = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    _fds[static_cast<std::size_t>(perf_event::l1d_misses)]
+        = open_event(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D));
+    _fds[static_cast<std::size_t>(perf_event::llc_misses)]
+        = open_event(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL));
+    _fds[static_cast<std::size_t>(perf_event::branch_misses)]
+        = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    _fds[static_cast<std::size_t>(perf_event::context_switches)]
+        = open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+#endif
+  }
+
+  perf_counters(perf_counters const &) = delete;
+  perf_counters(perf_counters &&) = delete;
+  perf_counters &
+  operator=(perf_counters const &) = delete;
+  perf_counters &
+  operator=(perf_counters &&) = delete;
+
+  ~perf_counters() {
+#if defined(__linux__)
+    for (int fd : _fds) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+#endif
+  }
+
+  /// The counters of the calling thread
+  static perf_counters &
+  this_thread() {
+    thread_local perf_counters counters;
+    return counters;
+  }
+
+  bool
+  available(perf_event event) const {
+    return _fds[static_cast<std::size_t>(event)] >= 0;
+  }
+
+  /// Current raw values, with the times to scale them by: see perf_delta()
+  perf_sample
+  read() const {
+    perf_sample sample;
+#if defined(__linux__)
+    for (std::size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+      // value, time enabled, time running
+      std::array<std::uint64_t, 3> data{};
+      if (_fds[i] < 0
+          || ::read(_fds[i], data.data(), sizeof(data))
+                 != static_cast<ssize_t>(sizeof(data))) {
+        continue;
+      }
+      sample._valid[i] = true;
+      sample._counts[i] = data[0];
+      sample._time_enabled[i] = data[1];
+      sample._time_running[i] = data[2];
+    }
+#endif
+    return sample;
+  }
+};
+
+/// Totals of all the regions with the same label, across all threads
+class perf_registry
+{
+public:
+  struct totals
+  {
+    perf_sample _sample;
+    std::uint64_t _ops{0};
+    std::uint64_t _regions{0};
+  };
+
+private:
+  std::mutex _m;
+  // per label, and per thread under the label
+  std::map<std::string, totals> _by_label;
+  std::map<std::pair<std::string, std::thread::id>, totals> _by_thread;
+
+  static void
+  accumulate(totals &t, perf_sample const &delta, std::uint64_t ops) {
+    for (std::size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+      // a label only has a count if every region under it had one
+      t._sample._valid[i]
+          = delta._valid[i] && (t._regions == 0 || t._sample._valid[i]);
+      t._sample._counts[i] += delta._counts[i];
+      t._sample._time_enabled[i] += delta._time_enabled[i];
+      t._sample._time_running[i] += delta._time_running[i];
+    }
+    t._sample._wall_time += delta._wall_time;
+    t._ops += ops;
+    ++t._regions;
+  }
+
+  static void
+  print_row(std::ostream &os, std::string const &label, totals const &t) {
+    double const ops = t._ops == 0 ? 1.0 : static_cast<double>(t._ops);
+    os << std::left << std::setw(28) << label << std::right << std::setw(10)
+       << t._ops << std::setw(10) << std::fixed << std::setprecision(1)
+       << static_cast<double>(t._sample._wall_time.count()) / ops;
+    for (std::size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+      os << std::setw(10);
+      if (t._sample._valid[i]) {
+        os << std::setprecision(2)
+           << static_cast<double>(t._sample._counts[i]) / ops;
+      } else {
+        os << "n/a";
+      }
+    }
+    os << '\n';
+  }
+
+public:
+  static perf_registry &
+  instance() {
+    static perf_registry registry;
+    return registry;
+  }
+
+  void
+  add(std::string const &label, perf_sample const &delta, std::uint64_t ops) {
+    std::lock_guard<std::mutex> lk(_m);
+    accumulate(_by_label[label], delta, ops);
+    accumulate(_by_thread[{label, std::this_thread::get_id()}], delta, ops);
+  }
+
+  /// Print the counts per operation of every label, and with per_thread of
+  /// every thread under it
+  void
+  report(std::ostream &os, bool per_thread = false) {
+    std::lock_guard<std::mutex> lk(_m);
+    std::ios_base::fmtflags const flags = os.flags();
+    std::streamsize const precision = os.precision();
+    os << std::left << std::setw(28) << "per op" << std::right << std::setw(10)
+       << "ops" << std::setw(10) << "ns";
+    for (std::size_t i = 0; i < NUM_PERF_EVENTS; ++i) {
+      os << std::setw(10) << perf_event_name(static_cast<perf_event>(i));
+    }
+    os << '\n';
+
+    for (auto const &label : _by_label) {
+      print_row(os, label.first, label.second);
+      if (!per_thread) {
+        continue;
+      }
+      unsigned index = 0;
+      for (auto it = _by_thread.lower_bound({label.first, std::thread::id()});
+           it != _by_thread.end() && it->first.first == label.first;
+           ++it) {
+        print_row(os, "  thread " + std::to_string(index++), it->second);
+      }
+    }
+    os.flags(flags);
+    os.precision(precision);
+  }
+
+  void
+  clear() {
+    std::lock_guard<std::mutex> lk(_m);
+    _by_label.clear();
+    _by_thread.clear();
+  }
+};
+
+/// Counts the events of the calling thread from construction to destruction,
+/// and adds them to the totals of label, as ops operations
+class perf_region
+{
+private:
+  std::string _label;
+  std::uint64_t _ops;
+  perf_sample _start;
+  std::chrono::steady_clock::time_point _start_time;
+
+public:
+  explicit perf_region(std::string label, std::uint64_t ops = 1)
+      : _label(std::move(label)),
+        _ops(ops),
+        _start(perf_counters::this_thread().read()),
+        _start_time(std::chrono::steady_clock::now()) {}
+
+  perf_region(perf_region const &) = delete;
+  perf_region(perf_region &&) = delete;
+  perf_region &
+  operator=(perf_region const &) = delete;
+  perf_region &
+  operator=(perf_region &&) = delete;
+
+  /// For regions whose number of operations is only known at the end
+  void
+  set_ops(std::uint64_t ops) {
+    _ops = ops;
+  }
+
+  ~perf_region() {
+    auto const end_time = std::chrono::steady_clock::now();
+    perf_sample delta
+        = perf_delta(_start, perf_counters::this_thread().read());
+    delta._wall_time = end_time - _start_time;
+    perf_registry::instance().add(_label, delta, _ops);
+  }
+};
+
+inline void
+perf_report(std::ostream &os, bool per_thread = false) {
+  perf_registry::instance().report(os, per_thread);
+}
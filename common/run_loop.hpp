@@ -0,0 +1,287 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>   // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h> // eventfd
+#include <unistd.h>      // close, read, write
+
+#include "unique_function.hpp"
+
+// An event loop that polls its queue wakes up for nothing while it is idle,
+// and one that locks the queue for every task contends with the posters on
+// every task of a burst. run_loop sleeps in epoll_wait until a poster writes
+// to its eventfd or one of the file descriptors it watches becomes readable,
+// and on every wake-up takes all the posted tasks at once, with one lock.
+
+enum class run_priority
+{
+  normal,
+  high
+};
+
+/// Single-threaded executor: the thread that calls run() runs every posted
+/// task and every watch handler, in the order they were posted, high priority
+/// ones first. post() and friends can be called from any thread, including
+/// from the tasks themselves.
+///
+/// A task posted with a key the same lane still has waiting is dropped: the
+/// one already waiting will run, and must read the state it acts on when it
+/// does. A repaint requested a thousand times between two frames paints once.
+class run_loop
+{
+public:
+  using task = unique_function<void()>;
+
+private:
+  static constexpr int MAX_EVENTS = 64;
+
+  struct lane
+  {
+    std::vector<task> _tasks;
+    // keys of the coalesced tasks in _tasks
+    std::unordered_set<std::uint64_t> _keys;
+  };
+
+  int _event_fd{-1};
+  int _epoll_fd{-1};
+
+  std::mutex _m;
+  lane _high;   // guarded by _m
+  lane _normal; // guarded by _m
+  // cleared by the loop before it takes the tasks, so a poster that finds it
+  // set knows the loop will see its task without being woken again
+  std::atomic<bool> _signalled{false};
+  // high priority tasks were posted since the loop last took them, checked
+  // between the tasks of a normal priority batch
+  std::atomic<bool> _high_posted{false};
+
+  // only used by the thread in run()
+  std::vector<task> _batch;
+  std::unordered_map<int, task> _watches;
+  bool _stop{false};
+
+  lane &
+  lane_of(run_priority priority) {
+    return priority == run_priority::high ? _high : _normal;
+  }
+
+  void
+  signal() {
+    if (_signalled.exchange(true)) {
+      return;
+    }
+    std::uint64_t const one = 1;
+    if (::write(_event_fd, &one, sizeof(one)) != sizeof(one)) {
+      throw std::system_error(errno, std::generic_category(), "eventfd write");
+    }
+  }
+
+  void
+  enqueue(run_priority priority, task &&t) {
+    lane_of(priority)._tasks.push_back(std::move(t));
+    if (priority == run_priority::high) {
+      _high_posted.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  // swap the tasks of l into _batch, so the two vectors keep trading their
+  // buffers and a steady flow of tasks allocates nothing
+  void
+  take(lane &l) {
+    // left over by a task that threw
+    _batch.clear();
+    _batch.swap(l._tasks);
+    l._keys.clear();
+  }
+
+  void
+  run_batch() {
+    for (task &t : _batch) {
+      t();
+    }
+    _batch.clear();
+  }
+
+  void
+  run_tasks() {
+    // before taking the tasks: a task posted after the swap must signal again
+    _signalled.store(false);
+    std::vector<task> normal;
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      take(_high);
+      normal.swap(_normal._tasks);
+      _normal._keys.clear();
+      _high_posted.store(false, std::memory_order_relaxed);
+    }
+    run_batch();
+    for (task &t : normal) {
+      if (_high_posted.load(std::memory_order_relaxed)) {
+        {
+          std::lock_guard<std::mutex> lk(_m);
+          take(_high);
+          _high_posted.store(false, std::memory_order_relaxed);
+        }
+        run_batch();
+      }
+      t();
+    }
+    // hand the buffer back to the lane if it didn't get a bigger one meanwhile
+    normal.clear();
+    std::lock_guard<std::mutex> lk(_m);
+    if (_normal._tasks.empty()
+        && _normal._tasks.capacity() < normal.capacity()) {
+      _normal._tasks.swap(normal);
+    }
+  }
+
+  void
+  consume_signal() {
+    std::uint64_t count = 0;
+    // EAGAIN: a task posted meanwhile already took it
+    if (::read(_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      throw std::system_error(errno, std::generic_category(), "eventfd read");
+    }
+  }
+
+public:
+  run_loop() {
+    _event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_event_fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    _epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll_fd < 0) {
+      int const err = errno;
+      ::close(_event_fd);
+      throw std::system_error(err, std::generic_category(), "epoll_create1");
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = _event_fd;
+    if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _event_fd, &event) != 0) {
+      int const err = errno;
+      ::close(_epoll_fd);
+      ::close(_event_fd);
+      throw std::system_error(err, std::generic_category(), "epoll_ctl");
+    }
+  }
+
+  run_loop(run_loop const &) = delete;
+  run_loop &
+  operator=(run_loop const &) = delete;
+
+  /// Tasks that are still waiting are destroyed without running
+  ~run_loop() {
+    ::close(_epoll_fd);
+    ::close(_event_fd);
+  }
+
+  void
+  post(task t, run_priority priority = run_priority::normal) {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      enqueue(priority, std::move(t));
+    }
+    signal();
+  }
+
+  /// Post t unless a task posted with key is still waiting in the same lane.
+  /// Returns whether t was posted.
+  bool
+  post_coalesced(std::uint64_t key,
+                 task t,
+                 run_priority priority = run_priority::normal) {
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      if (!lane_of(priority)._keys.insert(key).second) {
+        return false;
+      }
+      enqueue(priority, std::move(t));
+    }
+    signal();
+    return true;
+  }
+
+  /// Call on_readable on the loop thread whenever fd is readable, until
+  /// unwatch(fd). The handler must consume what it was woken for: the fd is
+  /// watched level-triggered.
+  void
+  watch(int fd, task on_readable) {
+    post(
+        [this, fd, handler = std::move(on_readable)]() mutable {
+          epoll_event event{};
+          event.events = EPOLLIN;
+          event.data.fd = fd;
+          if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            throw std::system_error(
+                errno, std::generic_category(), "epoll_ctl");
+          }
+          _watches[fd] = std::move(handler);
+        },
+        run_priority::high);
+  }
+
+  void
+  unwatch(int fd) {
+    post(
+        [this, fd] {
+          if (_watches.erase(fd) != 0) {
+            ::epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+          }
+        },
+        run_priority::high);
+  }
+
+  /// Make run() return once the tasks posted before are done. Tasks posted
+  /// after stay for the next call of run().
+  void
+  stop() {
+    post([this] { _stop = true; });
+  }
+
+  /// Run the loop on the calling thread until stop(). If a task throws, the
+  /// exception leaves run() and the rest of its batch is dropped.
+  void
+  run() {
+    _stop = false;
+    std::array<epoll_event, MAX_EVENTS> events;
+    while (!_stop) {
+      int const num_events
+          = ::epoll_wait(_epoll_fd, events.data(), MAX_EVENTS, -1);
+      if (num_events < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::generic_category(), "epoll_wait");
+      }
+      bool signalled = false;
+      for (std::size_t i = 0; i < static_cast<std::size_t>(num_events); ++i) {
+        int const fd = events[i].data.fd;
+        if (fd == _event_fd) {
+          consume_signal();
+          signalled = true;
+          continue;
+        }
+        auto const watch = _watches.find(fd);
+        if (watch != _watches.end()) {
+          watch->second();
+        }
+      }
+      if (signalled) {
+        run_tasks();
+      }
+    }
+  }
+};
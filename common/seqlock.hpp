@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint32_t, std::uint64_t
+#include <cstring> // std::memcpy
+#include <type_traits>
+
+#include "cache_line.hpp"
+#include "wait_strategy.hpp" // cpu_relax
+
+// A reader-writer lock makes every reader write the lock word, so readers on
+// different cores bounce its cache line between them even though none of them
+// changes the data. With a seqlock the writer bumps a sequence number before
+// and after it writes, and readers only read: they copy the data, and copy it
+// again if the sequence says a write overlapped the copy.
+//
+// The data is kept in atomic words rather than as a plain T, because the
+// readers race with the writer, and a racing plain copy is undefined behavior.
+// The writer stores the words with release, so that a reader that sees one new
+// word also sees the odd sequence number the writer stored before it, and
+// readers load them with acquire, so that the sequence is read again after
+// them. On x86 these are plain loads and stores.
+
+/// Publication of trivially copyable snapshots by a single writer to any
+/// number of readers. store() never waits, load() never writes shared memory
+/// and only retries while a store is in progress.
+template <typename T>
+class alignas(CACHE_LINE_SIZE) seqlock
+{
+  static_assert(std::is_trivially_copyable<T>::value,
+                "seqlock copies T word by word");
+  static_assert(std::is_default_constructible<T>::value,
+                "seqlock::load() copies into a default constructed T");
+
+private:
+  static constexpr std::size_t NUM_WORDS
+      = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+  using words = std::array<std::uint64_t, NUM_WORDS>;
+
+  std::array<std::atomic<std::uint64_t>, NUM_WORDS> _words;
+
+protected:
+  // odd while a store is in progress, so completed stores are _seq / 2. 32
+  // bits, because std::atomic::wait sleeps on a futex for those; a reader would
+  // have to sleep through 2^31 stores to mistake a new sequence for its own.
+  std::atomic<std::uint32_t> _seq{0};
+
+  void
+  write(T const &value, std::memory_order closing_order) noexcept {
+    words buf{};
+    std::memcpy(buf.data(), &value, sizeof(T));
+    std::uint32_t const seq = _seq.load(std::memory_order_relaxed);
+    _seq.store(seq + 1, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < NUM_WORDS; ++i) {
+      _words[i].store(buf[i], std::memory_order_release);
+    }
+    _seq.store(seq + 2, closing_order);
+  }
+
+  /// One attempt at a consistent copy: false if a store overlapped it.
+  /// seq is the sequence number the copy belongs to.
+  bool
+  try_read(T &value, std::uint32_t &seq) const noexcept {
+    seq = _seq.load(std::memory_order_acquire);
+    if (seq & 1U) {
+      return false;
+    }
+    words buf;
+    for (std::size_t i = 0; i < NUM_WORDS; ++i) {
+      buf[i] = _words[i].load(std::memory_order_acquire);
+    }
+    if (_seq.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+    std::memcpy(&value, buf.data(), sizeof(T));
+    return true;
+  }
+
+  T
+  read(std::uint32_t &seq) const noexcept {
+    T value{};
+    while (!try_read(value, seq)) {
+      cpu_relax();
+    }
+    return value;
+  }
+
+public:
+  explicit seqlock(T const &initial = T{}) noexcept {
+    words buf{};
+    std::memcpy(buf.data(), &initial, sizeof(T));
+    for (std::size_t i = 0; i < NUM_WORDS; ++i) {
+      _words[i].store(buf[i], std::memory_order_relaxed);
+    }
+  }
+
+  seqlock(seqlock const &) = delete;
+  seqlock &
+  operator=(seqlock const &) = delete;
+
+  /// Only ever called by one thread at a time
+  void
+  store(T const &value) noexcept {
+    write(value, std::memory_order_release);
+  }
+
+  T
+  load() const noexcept {
+    std::uint32_t seq = 0;
+    return read(seq);
+  }
+
+  /// Copy the data into value unless a store is in progress
+  bool
+  try_load(T &value) const noexcept {
+    std::uint32_t seq = 0;
+    return try_read(value, seq);
+  }
+
+  /// The number of completed stores, modulo 2^31
+  std::uint32_t
+  version() const noexcept {
+    return _seq.load(std::memory_order_acquire) / 2;
+  }
+};
+
+/// A seqlock that readers can also sleep on until the next value is published,
+/// with std::atomic::wait on the sequence number. The readers that sleep
+/// count themselves, and publish() only makes the notify_all() system call
+/// when some do. Needs C++20.
+template <typename T>
+class versioned_publish : public seqlock<T>
+{
+private:
+  static constexpr unsigned SPIN_ROUNDS = 128;
+
+  mutable std::atomic<std::uint32_t> _sleepers{0};
+
+public:
+  using seqlock<T>::seqlock;
+
+  /// Only ever called by one thread at a time
+  void
+  publish(T const &value) noexcept {
+    // seq_cst, like the increment of _sleepers: either the writer sees the
+    // sleeper, or the sleeper sees the new sequence before going to sleep
+    this->write(value, std::memory_order_seq_cst);
+    if (_sleepers.load(std::memory_order_seq_cst) != 0) {
+      this->_seq.notify_all();
+    }
+  }
+
+  /// Wait until a version other than version is published, and return the
+  /// value with version set to its version. Returns at once if that already
+  /// happened, so a reader that passes back the version it got never sleeps
+  /// through an update, but only sees the latest of those published while it
+  /// was busy.
+  T
+  wait_and_load(std::uint32_t &version) const noexcept {
+    std::uint32_t seq = this->_seq.load(std::memory_order_acquire);
+    for (unsigned spins = 0; seq / 2 == version && spins < SPIN_ROUNDS;
+         ++spins) {
+      cpu_relax();
+      seq = this->_seq.load(std::memory_order_acquire);
+    }
+    while (seq / 2 == version) {
+      _sleepers.fetch_add(1, std::memory_order_seq_cst);
+      this->_seq.wait(seq, std::memory_order_seq_cst);
+      _sleepers.fetch_sub(1, std::memory_order_relaxed);
+      seq = this->_seq.load(std::memory_order_acquire);
+    }
+    T const value = this->read(seq);
+    version = seq / 2;
+    return value;
+  }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <utility>
+
+// Storage policies decide how the data structures hold their elements and what
+// the pops that return the element give back. Both element types are nullable,
+// so "nothing popped" is a default-constructed element.
+
+/// Every element lives in its own std::shared_ptr, which a pop hands out
+/// without copying or moving the element, at the cost of one allocation and
+/// reference counting per element
+struct shared_storage
+{
+  template <typename T>
+  using element = std::shared_ptr<T>;
+
+  template <typename T, typename... Args>
+  static element<T>
+  make(Args &&...args) {
+    return std::make_shared<T>(std::forward<Args>(args)...);
+  }
+};
+
+/// Elements are stored by value and pops move them out into a std::optional,
+/// so for movable types pushing and popping allocate nothing per element
+struct value_storage
+{
+  template <typename T>
+  using element = std::optional<T>;
+
+  template <typename T, typename... Args>
+  static element<T>
+  make(Args &&...args) {
+    return element<T>(std::in_place, std::forward<Args>(args)...);
+  }
+};
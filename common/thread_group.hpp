@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef> // std::size_t
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h> // pthread_setaffinity_np, pthread_setname_np
+#include <sched.h>   // cpu_set_t, sched_getaffinity
+
+// Threads started with std::thread may run on any CPU and the scheduler
+// migrates them freely, also across sockets, where they lose their warm caches
+// and end up far from the memory they first touched. thread_group starts
+// threads pinned to CPUs, names them so they are recognizable in top, perf and
+// gdb, and joins them when it goes out of scope.
+
+/// Parse a kernel CPU list, e.g. "0-3,8,10-11"
+inline std::vector<unsigned>
+parse_cpu_list(std::string const &list) {
+  std::vector<unsigned> cpus;
+  std::istringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    std::size_t const dash = range.find('-');
+    auto const first = static_cast<unsigned>(std::stoul(range.substr(0, dash)));
+    auto const last
+        = dash == std::string::npos
+              ? first
+              : static_cast<unsigned>(std::stoul(range.substr(dash + 1)));
+    for (unsigned cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+/// CPUs the calling thread is allowed to run on, in increasing order
+inline std::vector<unsigned>
+allowed_cpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    throw std::system_error(
+        errno, std::generic_category(), "sched_getaffinity");
+  }
+  std::vector<unsigned> cpus;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+/// CPUs of every NUMA node, as read from sysfs. Machines (or containers)
+/// without the NUMA sysfs entries are reported as a single node with all the
+/// allowed CPUs.
+inline std::map<unsigned, std::vector<unsigned>>
+numa_nodes() {
+  namespace fs = std::filesystem;
+  std::map<unsigned, std::vector<unsigned>> nodes;
+  std::error_code ec;
+  for (fs::directory_iterator it("/sys/devices/system/node", ec), end;
+       !ec && it != end;
+       it.increment(ec)) {
+    std::string const name = it->path().filename().string();
+    if (name.size() <= 4 || name.rfind("node", 0) != 0
+        || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+      continue;
+    }
+    std::ifstream cpulist(it->path() / "cpulist");
+    std::string list;
+    if (std::getline(cpulist, list)) {
+      nodes[static_cast<unsigned>(std::stoul(name.substr(4)))]
+          = parse_cpu_list(list);
+    }
+  }
+  if (nodes.empty()) {
+    nodes[0] = allowed_cpus();
+  }
+  return nodes;
+}
+
+enum class placement
+{
+  // no pinning, the scheduler is free to move the threads
+  none,
+  // every thread is pinned to a single CPU, round-robin over the CPUs
+  per_cpu,
+  // threads are spread round-robin over the NUMA nodes, each may run on any
+  // CPU of its node
+  per_numa_node
+};
+
+class thread_group
+{
+private:
+  std::string _name;
+  // CPU sets the threads are pinned to, the i-th thread gets the set
+  // i % size(); empty for placement::none
+  std::vector<std::vector<unsigned>> _slots;
+  std::vector<std::thread> _threads;
+
+  static void
+  pin_and_name(std::vector<unsigned> const &cpus, std::string const &name) {
+    if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (unsigned cpu : cpus) {
+        CPU_SET(cpu, &set);
+      }
+      // the CPUs were validated when the group was created, if they have been
+      // taken away since, the thread just runs unpinned
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    // thread names are limited to 15 characters
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  }
+
+public:
+  /// Threads will be named name-0, name-1... and placed on cpus, which must be
+  /// a subset of the CPUs the calling thread is allowed to run on.
+  explicit thread_group(std::string name,
+                        placement where = placement::per_cpu,
+                        std::vector<unsigned> cpus = allowed_cpus())
+      : _name(std::move(name)) {
+    std::vector<unsigned> const allowed = allowed_cpus();
+    for (unsigned cpu : cpus) {
+      if (std::find(allowed.begin(), allowed.end(), cpu) == allowed.end()) {
+        throw std::invalid_argument("CPU " + std::to_string(cpu)
+                                    + " is not available to thread_group");
+      }
+    }
+    if (where != placement::none && cpus.empty()) {
+      throw std::invalid_argument("thread_group needs at least one CPU");
+    }
+
+    if (where == placement::per_cpu) {
+      for (unsigned cpu : cpus) {
+        _slots.push_back({cpu});
+      }
+    } else if (where == placement::per_numa_node) {
+      for (auto const &node : numa_nodes()) {
+        std::vector<unsigned> slot;
+        std::copy_if(node.second.begin(),
+                     node.second.end(),
+                     std::back_inserter(slot),
+                     [&cpus](unsigned cpu) {
+                       return std::find(cpus.begin(), cpus.end(), cpu)
+                              != cpus.end();
+                     });
+        if (!slot.empty()) {
+          _slots.push_back(std::move(slot));
+        }
+      }
+      if (_slots.empty()) {
+        // none of the CPUs belongs to a known node
+        _slots.push_back(std::move(cpus));
+      }
+    }
+  }
+
+  thread_group(thread_group const &) = delete;
+  thread_group(thread_group &&) = delete;
+  thread_group &
+  operator=(thread_group const &) = delete;
+  thread_group &
+  operator=(thread_group &&) = delete;
+
+  ~thread_group() {
+    join();
+  }
+
+  /// Start a thread running func(args...). The thread is pinned and named
+  /// before func starts, so everything it allocates and first touches is
+  /// already local to its CPUs.
+  template <typename Func, typename... Args>
+  void
+  spawn(Func &&func, Args &&...args) {
+    std::size_t const index = _threads.size();
+    std::vector<unsigned> cpus = cpus_of(index);
+    std::string name = _name + '-' + std::to_string(index);
+    _threads.emplace_back(
+        [cpus = std::move(cpus), name = std::move(name)](auto &&f,
+                                                         auto &&...as) {
+          pin_and_name(cpus, name);
+          std::invoke(std::forward<decltype(f)>(f),
+                      std::forward<decltype(as)>(as)...);
+        },
+        std::forward<Func>(func),
+        std::forward<Args>(args)...);
+  }
+
+  /// CPUs the index-th thread is (or will be) pinned to, empty if unpinned
+  std::vector<unsigned>
+  cpus_of(std::size_t index) const {
+    return _slots.empty() ? std::vector<unsigned>()
+                          : _slots[index % _slots.size()];
+  }
+
+  /// Number of distinct CPU sets the threads are spread over
+  std::size_t
+  num_slots() const {
+    return _slots.size();
+  }
+
+  std::size_t
+  size() const {
+    return _threads.size();
+  }
+
+  /// Wait for all the threads started so far
+  void
+  join() {
+    for (std::thread &t : _threads) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+};
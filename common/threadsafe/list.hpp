@@ -0,0 +1,151 @@
+#pragma once
+
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <utility>
+
+#include "lock_policy.hpp"
+#include "storage_policy.hpp"
+
+/// Singly linked list with a lock per node, so that threads can work on
+/// different parts of it at once. Mutex is the lock policy, see
+/// lock_policy.hpp, and every node has one. Storage decides whether the
+/// elements are kept in shared_ptrs or by value, see storage_policy.hpp:
+/// find_first_if() hands out the element that is still in the list with
+/// shared_storage, and a copy of it with value_storage. The nodes are allocated
+/// from the memory resource given on construction, see memory_resource.hpp;
+/// with value_storage they hold the elements too.
+template <typename T,
+          typename Mutex = std::mutex,
+          typename Storage = shared_storage>
+class threadsafe_list
+{
+public:
+  using element_type = typename Storage::template element<T>;
+  using mutex_type = Mutex;
+
+private:
+  struct node;
+
+  // gives the node back to the resource it came from
+  struct node_deleter
+  {
+    // never null, not even in the empty node_ptrs, which never call it
+    std::pmr::memory_resource *_resource{std::pmr::get_default_resource()};
+
+    void
+    operator()(node *n) const {
+      std::pmr::polymorphic_allocator<node> alloc(_resource);
+      std::destroy_at(n);
+      alloc.deallocate(n, 1);
+    }
+  };
+
+  using node_ptr = std::unique_ptr<node, node_deleter>;
+
+  struct node
+  {
+    Mutex _m;
+    // empty in the head node
+    element_type _data;
+    node_ptr _next;
+
+    node() = default;
+    explicit node(element_type data)
+        : _data(std::move(data)) {}
+  };
+
+  std::pmr::memory_resource *const _resource;
+  node _head;
+
+public:
+  explicit threadsafe_list(
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : _resource(resource) {}
+  ~threadsafe_list() {
+    remove_if([](T const & /*unused*/) { return true; });
+  }
+
+  threadsafe_list(threadsafe_list const &other) = delete;
+  threadsafe_list(threadsafe_list &&other) = delete;
+  threadsafe_list &
+  operator=(threadsafe_list const &other) = delete;
+  threadsafe_list &
+  operator=(threadsafe_list &&other) = delete;
+
+  void
+  push_front(T value) {
+    emplace_front(std::move(value));
+  }
+
+  /// Construct the element from args at the front of the list
+  template <typename... Args>
+  void
+  emplace_front(Args &&...args) {
+    element_type data(Storage::template make<T>(std::forward<Args>(args)...));
+    std::pmr::polymorphic_allocator<node> alloc(_resource);
+    node *const n = alloc.allocate(1);
+    try {
+      alloc.construct(n, std::move(data));
+    } catch (...) {
+      alloc.deallocate(n, 1);
+      throw;
+    }
+    node_ptr new_node(n, node_deleter{_resource});
+    std::lock_guard<Mutex> lk(_head._m);
+    new_node->_next = std::move(_head._next);
+    _head._next = std::move(new_node);
+  }
+
+  template <typename Function>
+  void
+  for_each(Function f) {
+    node *current = &_head;
+    std::unique_lock<Mutex> lk(_head._m);
+    while (node *const next = current->_next.get()) {
+      std::unique_lock<Mutex> next_lk(next->_m);
+      lk.unlock();
+      f(*next->_data);
+      current = next;
+      lk = std::move(next_lk);
+    }
+  }
+
+  template <typename Predicate>
+  element_type
+  find_first_if(Predicate p) {
+    node *current = &_head;
+    std::unique_lock<Mutex> lk(_head._m);
+    while (node *const next = current->_next.get()) {
+      std::unique_lock<Mutex> next_lk(next->_m);
+      lk.unlock();
+      if (p(*next->_data)) {
+        return next->_data;
+      }
+      current = next;
+      lk = std::move(next_lk);
+    }
+    return element_type();
+  }
+
+  template <typename Predicate>
+  void
+  remove_if(Predicate p) {
+    node *current = &_head;
+    std::unique_lock<Mutex> lk(_head._m);
+    while (node *const next = current->_next.get()) {
+      std::unique_lock<Mutex> next_lk(next->_m);
+      if (p(*next->_data)) {
+        // unlink the node, but only destroy it once its mutex is unlocked
+        node_ptr const old_next = std::move(current->_next);
+        current->_next = std::move(next->_next);
+        next_lk.unlock();
+      } else {
+        lk.unlock();
+        current = next;
+        lk = std::move(next_lk);
+      }
+    }
+  }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
+
+#include "wait_strategy.hpp"
+
+// The data structures of this library take the mutex they lock as a template
+// parameter, so the choice is made at compile time and costs nothing at run
+// time:
+//   std::mutex          the default, parks contending threads in the kernel
+//   std::shared_mutex   lets the readers of threadsafe_lut run side by side
+//   spinlock_mutex      for critical sections shorter than a context switch
+//   null_mutex          no locking at all, for single-threaded use
+// Anything with lock(), unlock() and try_lock() works. Read-only operations
+// take a shared lock if the mutex has lock_shared(), and an exclusive one
+// otherwise.
+
+/// Test-and-test-and-set spinlock. While the lock is taken, waiting threads
+/// only read it, so they spin in their own cache instead of bouncing the line
+/// between the cores with failed exchanges.
+class spinlock_mutex
+{
+private:
+  std::atomic<bool> _locked{false};
+
+public:
+  void
+  lock() {
+    while (_locked.exchange(true, std::memory_order_acquire)) {
+      spin_until([this] { return !_locked.load(std::memory_order_relaxed); });
+    }
+  }
+
+  bool
+  try_lock() {
+    return !_locked.load(std::memory_order_relaxed)
+           && !_locked.exchange(true, std::memory_order_acquire);
+  }
+
+  void
+  unlock() {
+    _locked.store(false, std::memory_order_release);
+  }
+};
+
+/// Satisfies every mutex requirement and does nothing, for data structures
+/// that are only ever used by one thread
+struct null_mutex
+{
+  void
+  lock() {}
+
+  bool
+  try_lock() {
+    return true;
+  }
+
+  void
+  unlock() {}
+
+  void
+  lock_shared() {}
+
+  bool
+  try_lock_shared() {
+    return true;
+  }
+
+  void
+  unlock_shared() {}
+};
+
+template <typename Mutex, typename = void>
+struct is_shared_mutex : std::false_type
+{};
+
+template <typename Mutex>
+struct is_shared_mutex<
+    Mutex,
+    std::void_t<decltype(std::declval<Mutex &>().lock_shared())>>
+    : std::true_type
+{};
+
+/// The lock for read-only access: shared if Mutex supports it
+template <typename Mutex>
+using shared_lock_t = std::conditional_t<is_shared_mutex<Mutex>::value,
+                                         std::shared_lock<Mutex>,
+                                         std::unique_lock<Mutex>>;
+
+/// How a queue waits for data by default: parked on a condition variable,
+/// which only works with a std::mutex, and spinning with any other
+template <typename Mutex>
+using default_wait_strategy
+    = std::conditional_t<std::is_same_v<Mutex, std::mutex>,
+                         blocking_wait,
+                         spin_yield_wait<>>;
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm> // std::find_if
+#include <cstddef>   // std::size_t
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "lock_policy.hpp"
+
+/// Hash map with a lock per bucket. Mutex is the lock policy, see
+/// lock_policy.hpp: with the default std::shared_mutex the lookups of a bucket
+/// run side by side, with a mutex without lock_shared() they take turns. The
+/// entries are allocated from the memory resource given on construction, see
+/// memory_resource.hpp.
+template <typename Key,
+          typename Value,
+          typename Hash = std::hash<Key>,
+          typename Mutex = std::shared_mutex>
+class threadsafe_lut
+{
+private:
+  class bucket_type
+  {
+  public:
+    using bucket_value = std::pair<Key, Value>;
+
+  private:
+    using bucket_data = std::pmr::list<bucket_value>;
+    using bucket_iterator = typename bucket_data::iterator;
+    using bucket_const_iterator = typename bucket_data::const_iterator;
+    // computations started by get_or_compute() that haven't finished yet
+    using in_flight_data
+        = std::pmr::list<std::pair<Key, std::shared_future<Value>>>;
+
+    bucket_data _data;
+    in_flight_data _in_flight;
+    mutable Mutex _mtx;
+
+    bucket_iterator
+    find_entry_for(Key const &key) {
+      return std::find_if(
+          _data.begin(), _data.end(), [&](bucket_value const &item) {
+            return item.first == key;
+          });
+    }
+
+    bucket_const_iterator
+    find_entry_for(Key const &key) const {
+      return std::find_if(
+          _data.begin(), _data.end(), [&](bucket_value const &item) {
+            return item.first == key;
+          });
+    }
+
+    typename in_flight_data::iterator
+    find_in_flight_for(Key const &key) {
+      return std::find_if(
+          _in_flight.begin(),
+          _in_flight.end(),
+          [&](typename in_flight_data::value_type const &item) {
+            return item.first == key;
+          });
+    }
+
+  public:
+    explicit bucket_type(std::pmr::memory_resource *resource)
+        : _data(resource),
+          _in_flight(resource) {}
+
+    Value
+    value_for(Key const &key, Value const &default_value) const {
+      shared_lock_t<Mutex> lk(_mtx);
+      bucket_const_iterator const found_entry = find_entry_for(key);
+      return (found_entry == _data.end()) ? default_value : found_entry->second;
+    }
+
+    template <typename Factory>
+    Value
+    get_or_compute(Key const &key, Factory &factory) {
+      {
+        shared_lock_t<Mutex> lk(_mtx);
+        bucket_const_iterator const found_entry = find_entry_for(key);
+        if (found_entry != _data.end()) {
+          return found_entry->second;
+        }
+      }
+
+      std::unique_lock<Mutex> lk(_mtx);
+      // somebody may have stored the value, or started computing it, while
+      // the lock was released
+      bucket_iterator const found_entry = find_entry_for(key);
+      if (found_entry != _data.end()) {
+        return found_entry->second;
+      }
+      auto const in_flight = find_in_flight_for(key);
+      if (in_flight != _in_flight.end()) {
+        std::shared_future<Value> const result = in_flight->second;
+        lk.unlock();
+        return result.get();
+      }
+
+      std::promise<Value> promise;
+      // list iterators stay valid, and once this entry is erased another
+      // computation of key may add its own, so keep this one's position
+      typename in_flight_data::iterator const mine = _in_flight.emplace(
+          _in_flight.end(), key, promise.get_future().share());
+      lk.unlock();
+
+      // the factory runs without the bucket lock, so that other keys of this
+      // bucket can still be read and written while it runs
+      bool finished = false;
+      try {
+        Value value = factory(key);
+        lk.lock();
+        if (find_entry_for(key) == _data.end()) {
+          _data.push_back(bucket_value(key, value));
+        }
+        _in_flight.erase(mine);
+        lk.unlock();
+        finished = true;
+        promise.set_value(value);
+        return value;
+      } catch (...) {
+        if (finished) {
+          // copying the value threw after the entry was gone: a promise that
+          // wasn't set tells the waiters broken_promise when it is destroyed
+          throw;
+        }
+        // the waiters get the exception, and the next call tries again
+        if (!lk.owns_lock()) {
+          lk.lock();
+        }
+        _in_flight.erase(mine);
+        lk.unlock();
+        promise.set_exception(std::current_exception());
+        throw;
+      }
+    }
+
+    void
+    add_or_update_mapping(Key const &key, Value const value) {
+      std::unique_lock<Mutex> lk(_mtx);
+      bucket_iterator const found_entry = find_entry_for(key);
+      if (found_entry == _data.end()) {
+        _data.push_back(bucket_value(key, value));
+      } else {
+        found_entry->second = value;
+      }
+    }
+
+    void
+    remove_mapping(Key const &key) {
+      std::unique_lock<Mutex> lk(_mtx);
+      bucket_iterator const found_entry = find_entry_for(key);
+      if (found_entry != _data.end()) {
+        _data.erase(found_entry);
+      }
+    }
+
+    // for get_map(), which locks every bucket itself
+    Mutex &
+    mutex() const {
+      return _mtx;
+    }
+
+    bucket_data const &
+    data() const {
+      return _data;
+    }
+  };
+
+  std::vector<std::unique_ptr<bucket_type>> _buckets;
+  Hash _hasher;
+
+  bucket_type &
+  get_bucket(Key const &key) const {
+    std::size_t const bucket_index = _hasher(key) % _buckets.size();
+    return *_buckets[bucket_index];
+  }
+
+public:
+  using key_type = Key;
+  using mapped_type = Value;
+  using hash_type = Hash;
+  using mutex_type = Mutex;
+
+  // arbitrary prime number
+  static constexpr unsigned NUM_BUCKETS = 19;
+
+  explicit threadsafe_lut(
+      unsigned num_buckets = NUM_BUCKETS,
+      Hash const &hasher = Hash(),
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : _buckets(num_buckets),
+        _hasher(hasher) {
+    for (std::unique_ptr<bucket_type> &bucket : _buckets) {
+      bucket.reset(new bucket_type(resource));
+    }
+  }
+
+  explicit threadsafe_lut(std::pmr::memory_resource *resource)
+      : threadsafe_lut(NUM_BUCKETS, Hash(), resource) {}
+
+  ~threadsafe_lut() = default;
+
+  threadsafe_lut(threadsafe_lut const &other) = delete;
+  threadsafe_lut &
+  operator=(threadsafe_lut const &other) = delete;
+  threadsafe_lut(threadsafe_lut &&other) = delete;
+  threadsafe_lut &
+  operator=(threadsafe_lut &&other) = delete;
+
+  Value
+  value_for(Key const &key, Value const &default_value = Value()) const {
+    return get_bucket(key).value_for(key, default_value);
+  }
+
+  /// Return the value for key, calling factory(key) to compute and store it if
+  /// there is none. Concurrent calls for the same missing key run the factory
+  /// only once: the others wait for its result, or its exception.
+  template <typename Factory>
+  Value
+  get_or_compute(Key const &key, Factory factory) {
+    return get_bucket(key).get_or_compute(key, factory);
+  }
+
+  void
+  add_or_update_mapping(Key const &key, Value const &value) {
+    get_bucket(key).add_or_update_mapping(key, value);
+  }
+
+  void
+  remove_mapping(Key const &key) {
+    get_bucket(key).remove_mapping(key);
+  }
+
+  /// A consistent snapshot of the whole table: every bucket stays locked until
+  /// all of them are copied
+  std::map<Key, Value>
+  get_map() const {
+    // always locked in the same order, so two snapshots can't deadlock
+    std::vector<shared_lock_t<Mutex>> locks;
+    locks.reserve(_buckets.size());
+    for (std::unique_ptr<bucket_type> const &bucket : _buckets) {
+      locks.emplace_back(bucket->mutex());
+    }
+
+    std::map<Key, Value> res;
+    for (std::unique_ptr<bucket_type> const &bucket : _buckets) {
+      for (typename bucket_type::bucket_value const &kv : bucket->data()) {
+        res.insert(kv);
+      }
+    }
+
+    return res;
+  }
+};
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef> // std::size_t, std::max_align_t, std::byte
+#include <cstdint> // std::uint64_t
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Memory resources for the node-based containers of this library, which
+// allocate a node per element. With the global allocator, many threads
+// inserting at once contend on the heap and scatter the nodes of a container
+// all over it. Every container takes a std::pmr::memory_resource:
+//   std::pmr::synchronized_pool_resource   pools of blocks per size behind a
+//                                          lock, shared by every thread
+//   thread_arena_resource                  an arena per thread, no lock on
+//                                          allocation or on freeing a block
+//                                          the same thread allocated
+// Blocks still allocated when a resource is destroyed are released with it.
+
+/// A resource that gives every thread its own arena of small blocks, so that
+/// threads never contend when they allocate. A block freed by the thread that
+/// allocated it goes straight back to its arena; a block freed by another
+/// thread is pushed onto a lock-free list of its arena, which its owner takes
+/// back on one of its next allocations. The arena of a thread that exits is
+/// adopted by the next thread that needs one, so memory keeps being reused.
+/// Allocations larger than MAX_BLOCK_SIZE or with more than fundamental
+/// alignment go to the upstream resource, which must be thread-safe.
+class thread_arena_resource : public std::pmr::memory_resource
+{
+public:
+  static constexpr std::size_t MAX_BLOCK_SIZE = 256;
+  static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+private:
+  static constexpr std::size_t GRANULE = alignof(std::max_align_t);
+  static constexpr std::size_t NUM_CLASSES = MAX_BLOCK_SIZE / GRANULE;
+
+  class arena;
+
+  // in front of every small block, so that a deallocation knows whose it is
+  struct alignas(std::max_align_t) block_header
+  {
+    arena *_owner;
+    std::size_t _size_class;
+  };
+
+  // what a free block holds instead of user data
+  struct free_block
+  {
+    free_block *_next;
+  };
+
+  static std::size_t
+  size_class(std::size_t bytes) {
+    return bytes == 0 ? 0 : (bytes - 1) / GRANULE;
+  }
+
+  static bool
+  is_small(std::size_t bytes, std::size_t alignment) {
+    return bytes <= MAX_BLOCK_SIZE && alignment <= GRANULE;
+  }
+
+  static block_header *
+  header_of(void *p) {
+    return static_cast<block_header *>(p) - 1;
+  }
+
+  class arena
+  {
+  private:
+    std::pmr::memory_resource *const _upstream;
+    // only touched by the thread that owns the arena
+    std::array<free_block *, NUM_CLASSES> _free{};
+    std::vector<void *> _chunks;
+    std::byte *_bump{nullptr};
+    std::byte *_bump_end{nullptr};
+    // blocks freed by other threads
+    std::atomic<free_block *> _remote_free{nullptr};
+    std::atomic<bool> _abandoned{false};
+    // by the destructor of its resource
+    std::atomic<bool> _released{false};
+
+    void
+    take_remote_frees() {
+      free_block *b = _remote_free.exchange(nullptr, std::memory_order_acquire);
+      while (b != nullptr) {
+        free_block *const next = b->_next;
+        std::size_t const c = header_of(b)->_size_class;
+        b->_next = _free[c];
+        _free[c] = b;
+        b = next;
+      }
+    }
+
+    void *
+    carve(std::size_t c) {
+      std::size_t const size = sizeof(block_header) + (c + 1) * GRANULE;
+      if (_bump == nullptr
+          || static_cast<std::size_t>(_bump_end - _bump) < size) {
+        void *const chunk = _upstream->allocate(CHUNK_SIZE, GRANULE);
+        _chunks.push_back(chunk);
+        _bump = static_cast<std::byte *>(chunk);
+        _bump_end = _bump + CHUNK_SIZE;
+      }
+      auto *const header = ::new (static_cast<void *>(_bump)) block_header{
+          this, c};
+      _bump += size;
+      return header + 1;
+    }
+
+  public:
+    explicit arena(std::pmr::memory_resource *upstream)
+        : _upstream(upstream) {}
+
+    arena(arena const &) = delete;
+    arena(arena &&) = delete;
+    arena &
+    operator=(arena const &) = delete;
+    arena &
+    operator=(arena &&) = delete;
+
+    ~arena() {
+      release();
+    }
+
+    /// Give every chunk back to the upstream resource
+    void
+    release() {
+      for (void *chunk : _chunks) {
+        _upstream->deallocate(chunk, CHUNK_SIZE, GRANULE);
+      }
+      _chunks.clear();
+      _free.fill(nullptr);
+      _bump = nullptr;
+      _bump_end = nullptr;
+      _remote_free.store(nullptr, std::memory_order_relaxed);
+      _released.store(true, std::memory_order_release);
+    }
+
+    bool
+    released() const {
+      return _released.load(std::memory_order_acquire);
+    }
+
+    void *
+    allocate(std::size_t c) {
+      if (_free[c] == nullptr) {
+        take_remote_frees();
+      }
+      if (free_block *const b = _free[c]) {
+        _free[c] = b->_next;
+        return b;
+      }
+      return carve(c);
+    }
+
+    /// Called by the owner
+    void
+    deallocate_local(void *p) {
+      std::size_t const c = header_of(p)->_size_class;
+      auto *const b = ::new (p) free_block{_free[c]};
+      _free[c] = b;
+    }
+
+    /// Called by any other thread
+    void
+    deallocate_remote(void *p) {
+      auto *const b = ::new (p) free_block{nullptr};
+      b->_next = _remote_free.load(std::memory_order_relaxed);
+      while (!_remote_free.compare_exchange_weak(
+          b->_next, b, std::memory_order_release, std::memory_order_relaxed)) {
+      }
+    }
+
+    void
+    abandon() {
+      _abandoned.store(true, std::memory_order_release);
+    }
+
+    bool
+    try_adopt() {
+      bool expected = true;
+      return _abandoned.compare_exchange_strong(
+          expected, false, std::memory_order_acquire);
+    }
+  };
+
+  // the arenas a thread owns, one per resource it used, given up on exit
+  struct thread_arenas
+  {
+    std::vector<std::pair<std::uint64_t, std::shared_ptr<arena>>> _arenas;
+
+    thread_arenas() = default;
+    thread_arenas(thread_arenas const &) = delete;
+    thread_arenas(thread_arenas &&) = delete;
+    thread_arenas &
+    operator=(thread_arenas const &) = delete;
+    thread_arenas &
+    operator=(thread_arenas &&) = delete;
+
+    ~thread_arenas() {
+      for (auto &entry : _arenas) {
+        entry.second->abandon();
+      }
+    }
+
+    // forget the arenas of resources that were destroyed since
+    void
+    prune() {
+      _arenas.erase(std::remove_if(_arenas.begin(),
+                                   _arenas.end(),
+                                   [](auto const &entry) {
+                                     return entry.second->released();
+                                   }),
+                    _arenas.end());
+    }
+
+    arena *
+    find(std::uint64_t id) {
+      for (auto &entry : _arenas) {
+        if (entry.first == id) {
+          return entry.second.get();
+        }
+      }
+      return nullptr;
+    }
+  };
+
+  static thread_arenas &
+  this_thread_arenas() {
+    thread_local thread_arenas arenas;
+    return arenas;
+  }
+
+  static std::uint64_t
+  next_id() {
+    static std::atomic<std::uint64_t> id{0};
+    return ++id;
+  }
+
+  std::pmr::memory_resource *const _upstream;
+  // never reused, unlike the address of a destroyed resource
+  std::uint64_t const _id{next_id()};
+  std::mutex _m;
+  std::vector<std::shared_ptr<arena>> _arenas;
+
+  arena &
+  local_arena() {
+    thread_arenas &mine = this_thread_arenas();
+    if (arena *const a = mine.find(_id)) {
+      return *a;
+    }
+
+    mine.prune();
+    std::shared_ptr<arena> a;
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      for (std::shared_ptr<arena> const &candidate : _arenas) {
+        if (candidate->try_adopt()) {
+          a = candidate;
+          break;
+        }
+      }
+      if (!a) {
+        a = std::make_shared<arena>(_upstream);
+        _arenas.push_back(a);
+      }
+    }
+    mine._arenas.emplace_back(_id, a);
+    return *a;
+  }
+
+protected:
+  void *
+  do_allocate(std::size_t bytes, std::size_t alignment) override {
+    if (!is_small(bytes, alignment)) {
+      return _upstream->allocate(bytes, alignment);
+    }
+    return local_arena().allocate(size_class(bytes));
+  }
+
+  void
+  do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override {
+    if (!is_small(bytes, alignment)) {
+      _upstream->deallocate(p, bytes, alignment);
+      return;
+    }
+    arena *const owner = header_of(p)->_owner;
+    if (owner == this_thread_arenas().find(_id)) {
+      owner->deallocate_local(p);
+    } else {
+      owner->deallocate_remote(p);
+    }
+  }
+
+  bool
+  do_is_equal(std::pmr::memory_resource const &other) const noexcept override {
+    return this == &other;
+  }
+
+public:
+  explicit thread_arena_resource(
+      std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+      : _upstream(upstream) {}
+
+  thread_arena_resource(thread_arena_resource const &) = delete;
+  thread_arena_resource(thread_arena_resource &&) = delete;
+  thread_arena_resource &
+  operator=(thread_arena_resource const &) = delete;
+  thread_arena_resource &
+  operator=(thread_arena_resource &&) = delete;
+
+  ~thread_arena_resource() override {
+    // the threads may keep their arenas a while longer, but empty
+    for (std::shared_ptr<arena> const &a : _arenas) {
+      a->release();
+    }
+  }
+
+  std::pmr::memory_resource *
+  upstream_resource() const {
+    return _upstream;
+  }
+};
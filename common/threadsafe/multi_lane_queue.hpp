@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef> // std::size_t
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sched.h> // sched_getcpu
+
+#include "cache_line.hpp"
+#include "lock_policy.hpp"
+#include "storage_policy.hpp"
+#include "wait_strategy.hpp"
+
+// Lane selectors, used as template policies by multi_lane_queue to pick the
+// home lane of a thread, which it pushes to and pops from first: give each
+// thread its own lane, assigned round-robin the first time the thread uses any
+// queue...
+struct per_thread_lane
+{
+  static std::size_t
+  index() {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t const idx
+        = next.fetch_add(1, std::memory_order_relaxed);
+    return idx;
+  }
+};
+
+// ...or the lane of the CPU the thread is running on, so that the lanes stay
+// in the caches of the cores that use them. A producer that migrates to
+// another CPU switches lanes, and its elements may then be popped out of order.
+struct per_cpu_lane
+{
+  static std::size_t
+  index() {
+    int const cpu = sched_getcpu();
+    return cpu < 0 ? per_thread_lane::index() : static_cast<std::size_t>(cpu);
+  }
+};
+
+/// Queue made of independent lanes, each a queue behind its own lock on its
+/// own cache line, so that threads working on different lanes never touch the
+/// same memory. Every thread pushes to its home lane, chosen by LaneSelector,
+/// and pops from it too, stealing from the other lanes when it is empty.
+/// There is no global FIFO order: the elements of one producer come out in the
+/// order it pushed them, as long as it keeps its home lane, but the elements
+/// of different producers can overtake each other. Mutex is the lock policy of
+/// the lanes, see lock_policy.hpp, and Storage decides how the elements are
+/// kept, see storage_policy.hpp. Consumers that find every lane empty park on
+/// a condition variable that producers only notify when somebody is parked.
+template <typename T,
+          typename Mutex = std::mutex,
+          typename Storage = shared_storage,
+          typename LaneSelector = per_thread_lane>
+class multi_lane_queue
+{
+public:
+  using element_type = typename Storage::template element<T>;
+  using mutex_type = Mutex;
+
+private:
+  struct alignas(CACHE_LINE_SIZE) lane
+  {
+    Mutex _m;
+    std::queue<element_type> _data;
+    // copy of _data.empty(), updated with _m held and read without it, so
+    // that stealing consumers skip the empty lanes without locking them
+    std::atomic<bool> _empty{true};
+  };
+
+  // rounds over the lanes before a waiting consumer parks
+  static constexpr unsigned SPIN_ROUNDS = 64;
+
+  std::vector<lane> _lanes;
+  // consumers parked in wait_and_pop(), only modified with _sleep_m held
+  std::atomic<unsigned> _sleepers{0};
+  std::mutex _sleep_m;
+  std::condition_variable _wake;
+
+  lane &
+  home_lane() {
+    return _lanes[LaneSelector::index() % _lanes.size()];
+  }
+
+  // must be called with l._m held and l._data not empty
+  static element_type
+  pop_front(lane &l) {
+    element_type res(std::move(l._data.front()));
+    l._data.pop();
+    l._empty.store(l._data.empty(), std::memory_order_relaxed);
+    return res;
+  }
+
+  // the home lane first, then the others in order, skipping the ones that
+  // look empty unless check_all is set
+  element_type
+  pop_any(bool check_all) {
+    std::size_t const home = LaneSelector::index() % _lanes.size();
+    for (std::size_t i = 0; i < _lanes.size(); ++i) {
+      lane &l = _lanes[(home + i) % _lanes.size()];
+      if (!check_all && l._empty.load(std::memory_order_relaxed)) {
+        continue;
+      }
+      std::lock_guard<Mutex> lk(l._m);
+      if (!l._data.empty()) {
+        return pop_front(l);
+      }
+    }
+    return element_type();
+  }
+
+  element_type
+  wait_and_pop_until(std::chrono::steady_clock::time_point const *deadline) {
+    while (true) {
+      for (unsigned round = 0; round < SPIN_ROUNDS; ++round) {
+        if (element_type res = pop_any(false)) {
+          return res;
+        }
+        cpu_relax();
+      }
+
+      std::unique_lock<std::mutex> lk(_sleep_m);
+      _sleepers.fetch_add(1, std::memory_order_relaxed);
+      // a producer either pushed to a lane before it is locked below, and the
+      // element is found, or after, and then it sees _sleepers raised: the
+      // lane lock orders the two
+      element_type res = pop_any(true);
+      if (!res) {
+        if (deadline == nullptr) {
+          _wake.wait(lk);
+        } else if (_wake.wait_until(lk, *deadline)
+                   == std::cv_status::timeout) {
+          _sleepers.fetch_sub(1, std::memory_order_relaxed);
+          lk.unlock();
+          return pop_any(true);
+        }
+      }
+      _sleepers.fetch_sub(1, std::memory_order_relaxed);
+      if (res) {
+        return res;
+      }
+    }
+  }
+
+public:
+  explicit multi_lane_queue(unsigned num_lanes
+                            = std::thread::hardware_concurrency())
+      : _lanes(std::max(num_lanes, 1U)) {}
+
+  multi_lane_queue(multi_lane_queue const &) = delete;
+  multi_lane_queue(multi_lane_queue &&) = delete;
+  multi_lane_queue &
+  operator=(multi_lane_queue const &) = delete;
+  multi_lane_queue &
+  operator=(multi_lane_queue &&) = delete;
+  ~multi_lane_queue() = default;
+
+  void
+  push(T value) {
+    emplace(std::move(value));
+  }
+
+  /// Construct the element from args, outside the lock, and append it to the
+  /// home lane of the calling thread
+  template <typename... Args>
+  void
+  emplace(Args &&...args) {
+    element_type data(Storage::template make<T>(std::forward<Args>(args)...));
+    {
+      lane &l = home_lane();
+      std::lock_guard<Mutex> lk(l._m);
+      l._data.push(std::move(data));
+      l._empty.store(false, std::memory_order_relaxed);
+    }
+    if (_sleepers.load(std::memory_order_relaxed) != 0) {
+      std::lock_guard<std::mutex> lk(_sleep_m);
+      _wake.notify_one();
+    }
+  }
+
+  bool
+  try_pop(T &value) {
+    element_type res = pop_any(false);
+    if (!res) {
+      return false;
+    }
+    value = std::move(*res);
+    return true;
+  }
+
+  element_type
+  try_pop() {
+    return pop_any(false);
+  }
+
+  void
+  wait_and_pop(T &value) {
+    value = std::move(*wait_and_pop());
+  }
+
+  element_type
+  wait_and_pop() {
+    return wait_and_pop_until(nullptr);
+  }
+
+  template <typename Rep, typename Period>
+  bool
+  wait_and_pop_for(T &value,
+                   std::chrono::duration<Rep, Period> const &timeout) {
+    element_type res = wait_and_pop_for(timeout);
+    if (!res) {
+      return false;
+    }
+    value = std::move(*res);
+    return true;
+  }
+
+  template <typename Rep, typename Period>
+  element_type
+  wait_and_pop_for(std::chrono::duration<Rep, Period> const &timeout) {
+    std::chrono::steady_clock::time_point const deadline
+        = std::chrono::steady_clock::now()
+          + std::chrono::ceil<std::chrono::steady_clock::duration>(timeout);
+    return wait_and_pop_until(&deadline);
+  }
+
+  bool
+  empty() const {
+    return std::all_of(_lanes.begin(), _lanes.end(), [](lane const &l) {
+      return l._empty.load(std::memory_order_relaxed);
+    });
+  }
+
+  std::size_t
+  num_lanes() const {
+    return _lanes.size();
+  }
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <queue>
+#include <utility>
+
+#include "lock_policy.hpp"
+#include "storage_policy.hpp"
+#include "wait_strategy.hpp"
+
+/// Queue behind a single lock. Mutex is the lock policy, see lock_policy.hpp;
+/// WaitStrategy decides how the waiting pops wait, see wait_strategy.hpp, and
+/// must work with a std::unique_lock<Mutex>; Storage decides whether the
+/// elements are kept in shared_ptrs or by value, and so what the
+/// value-returning pops give back, see storage_policy.hpp.
+template <typename T,
+          typename Mutex = std::mutex,
+          typename WaitStrategy = default_wait_strategy<Mutex>,
+          typename Storage = shared_storage>
+class threadsafe_queue
+{
+public:
+  using element_type = typename Storage::template element<T>;
+  using mutex_type = Mutex;
+
+private:
+  mutable Mutex _m;
+  std::queue<element_type> _data;
+  WaitStrategy _waiter;
+
+public:
+  threadsafe_queue() = default;
+
+  void
+  push(T value) {
+    emplace(std::move(value));
+  }
+
+  /// Construct the element from args, outside the lock
+  template <typename... Args>
+  void
+  emplace(Args &&...args) {
+    element_type data(Storage::template make<T>(std::forward<Args>(args)...));
+    std::lock_guard<Mutex> lg(_m);
+    _data.push(std::move(data));
+    _waiter.notify_one();
+  }
+
+  void
+  wait_and_pop(T &value) {
+    std::unique_lock<Mutex> lk(_m);
+    _waiter.wait(lk, [this] { return !_data.empty(); });
+    value = std::move(*_data.front());
+    _data.pop();
+  }
+
+  element_type
+  wait_and_pop() {
+    std::unique_lock<Mutex> lk(_m);
+    _waiter.wait(lk, [this] { return !_data.empty(); });
+    element_type res(std::move(_data.front()));
+    _data.pop();
+    return res;
+  }
+
+  template <typename Rep, typename Period>
+  bool
+  wait_and_pop_for(T &value,
+                   std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<Mutex> lk(_m);
+    if (!_waiter.wait_for(lk, timeout, [this] { return !_data.empty(); })) {
+      return false;
+    }
+    value = std::move(*_data.front());
+    _data.pop();
+    return true;
+  }
+
+  template <typename Rep, typename Period>
+  element_type
+  wait_and_pop_for(std::chrono::duration<Rep, Period> const &timeout) {
+    std::unique_lock<Mutex> lk(_m);
+    if (!_waiter.wait_for(lk, timeout, [this] { return !_data.empty(); })) {
+      return element_type();
+    }
+    element_type res(std::move(_data.front()));
+    _data.pop();
+    return res;
+  }
+
+  bool
+  try_pop(T &value) {
+    std::lock_guard<Mutex> lk(_m);
+    if (_data.empty()) {
+      return false;
+    }
+    value = std::move(*_data.front());
+    _data.pop();
+    return true;
+  }
+
+  element_type
+  try_pop() {
+    std::lock_guard<Mutex> lk(_m);
+    if (_data.empty()) {
+      return element_type();
+    }
+    element_type res(std::move(_data.front()));
+    _data.pop();
+    return res;
+  }
+
+  bool
+  empty() const {
+    shared_lock_t<Mutex> lk(_m);
+    return _data.empty();
+  }
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stack>
+#include <utility>
+
+#include "lock_policy.hpp"
+
+struct empty_stack : std::exception
+{
+  char const *
+  what() const noexcept override {
+    return "empty stack";
+  }
+};
+
+/// Stack behind a single lock; the pops throw empty_stack when there is
+/// nothing to pop. Mutex is the lock policy, see lock_policy.hpp.
+template <typename T, typename Mutex = std::mutex>
+class threadsafe_stack
+{
+private:
+  std::stack<T> _data;
+  mutable Mutex _m;
+
+public:
+  using mutex_type = Mutex;
+
+  threadsafe_stack() = default;
+
+  threadsafe_stack(threadsafe_stack const &other) {
+    std::lock_guard<Mutex> lg(other._m);
+    _data = other._data;
+  }
+
+  threadsafe_stack &
+  operator=(threadsafe_stack const &) = delete;
+
+  void
+  push(T new_value) {
+    std::lock_guard<Mutex> lg(_m);
+    _data.push(std::move(new_value));
+  }
+
+  std::shared_ptr<T>
+  pop() {
+    std::lock_guard<Mutex> lg(_m);
+    if (_data.empty()) {
+      throw empty_stack();
+    }
+
+    std::shared_ptr<T> const res(std::make_shared<T>(std::move(_data.top())));
+    _data.pop();
+    return res;
+  }
+
+  void
+  pop(T &value) {
+    std::lock_guard<Mutex> lg(_m);
+    if (_data.empty()) {
+      throw empty_stack();
+    }
+    value = std::move(_data.top());
+    _data.pop();
+  }
+
+  bool
+  empty() const {
+    shared_lock_t<Mutex> lk(_m);
+    return _data.empty();
+  }
+};
@@ -0,0 +1,513 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <fstream>
+#include <iomanip>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc
+#endif
+
+#if defined(__linux__)
+#include <pthread.h> // pthread_getname_np
+#include <unistd.h>  // getpid
+#endif
+
+#include "cache_line.hpp"
+
+// Tracing that is cheap enough to leave in the code being observed. Every
+// thread writes fixed-size events into its own ring, which nobody else writes
+// to, so recording an event takes no lock and no read-modify-write: a
+// timestamp and a handful of stores. An exporter, on demand or on a background
+// thread, copies the rings out and writes them as Chrome trace JSON, which
+// chrome://tracing and ui.perfetto.dev open.
+// When a ring fills up before it is exported the oldest events are
+// overwritten, and counted as dropped, rather than the writer ever waiting.
+//
+//   trace_exporter exporter("queue.trace.json");
+//   ...
+//   {
+//     trace_scope scope("wait_and_pop");
+//     ... = q.wait_and_pop();
+//   }
+//   trace_instant("pushed", value);
+//
+// Event names are not copied: they must be string literals, or otherwise
+// outlive the export.
+
+/// Raw timestamp: the TSC where there is one, nanoseconds otherwise. The
+/// exporter converts ticks to time by comparing against the steady clock.
+inline std::uint64_t
+trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+#endif
+}
+
+struct trace_event
+{
+  char const *_name;
+  std::uint64_t _ticks;
+  std::uint64_t _arg;
+  // 'B'egin, 'E'nd or 'i'nstant, as in the trace format
+  char _phase;
+};
+
+/// Events of one thread. Only the owning thread records, and only one exporter
+/// at a time drains.
+class trace_ring
+{
+public:
+  static constexpr std::size_t CAPACITY = 1U << 14U;
+
+private:
+  // every field is an atomic, so that an exporter reading a slot the owner is
+  // overwriting is a torn read that gets thrown away, not a data race
+  struct slot
+  {
+    std::atomic<char const *> _name{nullptr};
+    std::atomic<std::uint64_t> _ticks{0};
+    std::atomic<std::uint64_t> _arg{0};
+    std::atomic<char> _phase{0};
+  };
+
+  std::unique_ptr<slot[]> _slots{new slot[CAPACITY]};
+
+  // written by the owner only: the number of events it started writing, and
+  // the number it finished writing
+  alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t> _started{0};
+  std::atomic<std::uint64_t> _committed{0};
+
+  // touched by the exporter only
+  alignas(CACHE_LINE_SIZE) std::uint64_t _exported{0};
+  std::uint64_t _dropped{0};
+  bool _name_exported{false};
+  std::vector<trace_event> _scratch;
+
+  std::atomic<bool> _closed{false};
+  unsigned const _tid;
+  std::string const _thread_name;
+
+public:
+  trace_ring(unsigned tid, std::string thread_name)
+      : _tid(tid),
+        _thread_name(std::move(thread_name)) {}
+
+  void
+  record(char phase, char const *name, std::uint64_t arg) {
+    std::uint64_t const index = _committed.load(std::memory_order_relaxed);
+    _started.store(index + 1, std::memory_order_relaxed);
+
+    // an exporter that sees any of these stores also sees the one above, and
+    // so knows that the slot may be torn; on x86 they are plain stores anyway
+    slot &s = _slots[index & (CAPACITY - 1)];
+    s._name.store(name, std::memory_order_release);
+    s._ticks.store(trace_ticks(), std::memory_order_release);
+    s._arg.store(arg, std::memory_order_release);
+    s._phase.store(phase, std::memory_order_release);
+    _committed.store(index + 1, std::memory_order_release);
+  }
+
+  /// Called by the owner when it exits
+  void
+  close() {
+    _closed.store(true, std::memory_order_release);
+  }
+
+  bool
+  closed() const {
+    return _closed.load(std::memory_order_acquire);
+  }
+
+  unsigned
+  tid() const {
+    return _tid;
+  }
+
+  std::string const &
+  thread_name() const {
+    return _thread_name;
+  }
+
+  std::uint64_t
+  dropped() const {
+    return _dropped;
+  }
+
+  /// Call visit(event) for every event recorded since the last drain that
+  /// hasn't been overwritten in the meantime
+  template <typename Visitor>
+  void
+  drain(Visitor visit) {
+    std::uint64_t const end = _committed.load(std::memory_order_acquire);
+    std::uint64_t const oldest = end > CAPACITY ? end - CAPACITY : 0;
+    std::uint64_t const begin = std::max(_exported, oldest);
+    _dropped += begin - _exported;
+
+    _scratch.clear();
+    for (std::uint64_t i = begin; i < end; ++i) {
+      slot const &s = _slots[i & (CAPACITY - 1)];
+      _scratch.push_back({s._name.load(std::memory_order_acquire),
+                          s._ticks.load(std::memory_order_acquire),
+                          s._arg.load(std::memory_order_acquire),
+                          s._phase.load(std::memory_order_acquire)});
+    }
+
+    // the owner may have lapped us while we were copying: anything in a slot
+    // it has started to overwrite since is garbage
+    std::uint64_t const started = _started.load(std::memory_order_relaxed);
+    std::uint64_t const first_intact
+        = std::max(begin, started > CAPACITY ? started - CAPACITY : 0);
+    _dropped += std::min(first_intact, end) - begin;
+    for (std::uint64_t i = first_intact; i < end; ++i) {
+      visit(_scratch[i - begin]);
+    }
+    _exported = end;
+  }
+
+  bool
+  take_name_export() {
+    return !std::exchange(_name_exported, true);
+  }
+};
+
+/// Every ring, including those of threads that have exited but have events
+/// that weren't exported yet
+class trace_registry
+{
+private:
+  std::mutex _m;
+  std::vector<std::shared_ptr<trace_ring>> _rings;
+  unsigned _next_tid{1};
+  std::atomic<bool> _enabled{false};
+  // to convert ticks to time
+  std::uint64_t const _start_ticks{trace_ticks()};
+  std::chrono::steady_clock::time_point const _start_time{
+      std::chrono::steady_clock::now()};
+
+  static std::string
+  current_thread_name() {
+#if defined(__linux__)
+    char name[16]{};
+    if (::pthread_getname_np(::pthread_self(), name, sizeof(name)) == 0) {
+      return name;
+    }
+#endif
+    return {};
+  }
+
+public:
+  static trace_registry &
+  instance() {
+    static trace_registry registry;
+    return registry;
+  }
+
+  bool
+  enabled() const {
+    return _enabled.load(std::memory_order_relaxed);
+  }
+
+  void
+  enable(bool on) {
+    _enabled.store(on, std::memory_order_relaxed);
+  }
+
+  std::shared_ptr<trace_ring>
+  add_ring() {
+    std::string name = current_thread_name();
+    std::lock_guard<std::mutex> lk(_m);
+    unsigned const tid = _next_tid++;
+    if (name.empty()) {
+      name = "thread " + std::to_string(tid);
+    }
+    _rings.push_back(std::make_shared<trace_ring>(tid, std::move(name)));
+    return _rings.back();
+  }
+
+  /// Drain every ring, calling visit(ring, event), and forget the rings of
+  /// threads that have exited once they are empty. Returns the number of events
+  /// dropped since the last call.
+  template <typename Visitor>
+  std::uint64_t
+  drain(Visitor visit) {
+    std::lock_guard<std::mutex> lk(_m);
+    std::uint64_t dropped = 0;
+    for (std::size_t i = 0; i < _rings.size();) {
+      trace_ring &ring = *_rings[i];
+      // a ring closed before the drain has nothing left in it after it
+      bool const closed = ring.closed();
+      std::uint64_t const dropped_before = ring.dropped();
+      ring.drain([&](trace_event const &e) { visit(ring, e); });
+      dropped += ring.dropped() - dropped_before;
+      if (closed) {
+        _rings.erase(_rings.begin() + static_cast<std::ptrdiff_t>(i));
+      } else {
+        ++i;
+      }
+    }
+    return dropped;
+  }
+
+  /// Ticks per microsecond, measured over the life of the registry
+  double
+  ticks_per_us() const {
+    std::chrono::duration<double, std::micro> const elapsed
+        = std::chrono::steady_clock::now() - _start_time;
+    double const ticks = static_cast<double>(trace_ticks() - _start_ticks);
+    return elapsed.count() > 0 && ticks > 0 ? ticks / elapsed.count() : 1e3;
+  }
+
+  std::uint64_t
+  start_ticks() const {
+    return _start_ticks;
+  }
+};
+
+/// The ring of the calling thread, created on its first event
+inline trace_ring &
+this_thread_trace_ring() {
+  struct owner
+  {
+    std::shared_ptr<trace_ring> _ring{trace_registry::instance().add_ring()};
+    owner() = default;
+    owner(owner const &) = delete;
+    owner(owner &&) = delete;
+    owner &
+    operator=(owner const &) = delete;
+    owner &
+    operator=(owner &&) = delete;
+    ~owner() {
+      _ring->close();
+    }
+  };
+  thread_local owner o;
+  return *o._ring;
+}
+
+inline void
+trace_enable(bool on = true) {
+  trace_registry::instance().enable(on);
+}
+
+inline void
+trace_begin(char const *name, std::uint64_t arg = 0) {
+  if (trace_registry::instance().enabled()) {
+    this_thread_trace_ring().record('B', name, arg);
+  }
+}
+
+inline void
+trace_end(char const *name) {
+  if (trace_registry::instance().enabled()) {
+    this_thread_trace_ring().record('E', name, 0);
+  }
+}
+
+inline void
+trace_instant(char const *name, std::uint64_t arg = 0) {
+  if (trace_registry::instance().enabled()) {
+    this_thread_trace_ring().record('i', name, arg);
+  }
+}
+
+/// A begin event now and the matching end event at the end of the scope
+class trace_scope
+{
+private:
+  char const *_name;
+  bool const _active;
+
+public:
+  explicit trace_scope(char const *name, std::uint64_t arg = 0)
+      : _name(name),
+        _active(trace_registry::instance().enabled()) {
+    if (_active) {
+      this_thread_trace_ring().record('B', _name, arg);
+    }
+  }
+
+  trace_scope(trace_scope const &) = delete;
+  trace_scope(trace_scope &&) = delete;
+  trace_scope &
+  operator=(trace_scope const &) = delete;
+  trace_scope &
+  operator=(trace_scope &&) = delete;
+
+  ~trace_scope() {
+    if (_active) {
+      this_thread_trace_ring().record('E', _name, 0);
+    }
+  }
+};
+
+// write s as the contents of a JSON string: quotes, backslashes and control
+// characters in thread names or event names would otherwise end the string or
+// make the whole document invalid
+inline void
+write_json_escaped(std::ostream &os, char const *s) {
+  static constexpr char HEX[] = "0123456789abcdef";
+  for (; *s != '\0'; ++s) {
+    unsigned char const c = static_cast<unsigned char>(*s);
+    if (c == '"' || c == '\\') {
+      os << '\\' << *s;
+    } else if (c < 0x20) {
+      os << "\\u00" << HEX[c >> 4] << HEX[c & 0xf];
+    } else {
+      os << *s;
+    }
+  }
+}
+
+// write the events recorded since the last call as comma-separated trace event
+// objects; first tells whether a comma is needed before the first of them
+inline std::uint64_t
+write_trace_events(std::ostream &os, bool &first) {
+  trace_registry &registry = trace_registry::instance();
+  double const ticks_per_us = registry.ticks_per_us();
+  std::uint64_t const start = registry.start_ticks();
+#if defined(__linux__)
+  long const pid = ::getpid();
+#else
+  long const pid = 1;
+#endif
+
+  std::ios_base::fmtflags const flags = os.flags();
+  std::streamsize const precision = os.precision();
+  os << std::fixed << std::setprecision(3);
+
+  auto const separator = [&os, &first] {
+    os << (first ? "\n" : ",\n");
+    first = false;
+  };
+
+  std::uint64_t const dropped
+      = registry.drain([&](trace_ring &ring, trace_event const &e) {
+          if (ring.take_name_export()) {
+            separator();
+            os << R"({"name":"thread_name","ph":"M","pid":)" << pid
+               << R"(,"tid":)" << ring.tid() << R"(,"args":{"name":")";
+            write_json_escaped(os, ring.thread_name().c_str());
+            os << R"("}})";
+          }
+          // the TSCs of different cores may be slightly apart
+          std::uint64_t const ticks = e._ticks > start ? e._ticks - start : 0;
+          separator();
+          os << R"({"name":")";
+          write_json_escaped(os, e._name);
+          os << R"(","ph":")" << e._phase << R"(","ts":)"
+             << static_cast<double>(ticks) / ticks_per_us << R"(,"pid":)"
+             << pid << R"(,"tid":)" << ring.tid();
+          if (e._phase == 'i') {
+            os << R"(,"s":"t")";
+          }
+          if (e._phase != 'E') {
+            os << R"(,"args":{"arg":)" << e._arg << '}';
+          }
+          os << '}';
+        });
+
+  os.flags(flags);
+  os.precision(precision);
+  return dropped;
+}
+
+/// Write the events recorded since the last export as a Chrome trace JSON
+/// document. Returns the number of events lost to full rings.
+inline std::uint64_t
+trace_export(std::ostream &os) {
+  bool first = true;
+  os << R"({"traceEvents":[)";
+  std::uint64_t const dropped = write_trace_events(os, first);
+  os << "\n]}\n";
+  return dropped;
+}
+
+/// Enables tracing, and while alive exports the rings to path every period on
+/// a background thread, so that they don't fill up on a long run. The file is
+/// in the JSON array trace format, which is a valid trace even if the process
+/// dies before the closing bracket is written.
+class trace_exporter
+{
+private:
+  std::ofstream _out;
+  std::chrono::milliseconds const _period;
+  std::mutex _m;
+  std::condition_variable _cond;
+  bool _stop{false};
+  bool _first{true};
+  std::uint64_t _dropped{0};
+  std::thread _thread;
+
+  void
+  flush() {
+    _dropped += write_trace_events(_out, _first);
+    _out.flush();
+  }
+
+  void
+  run() {
+    std::unique_lock<std::mutex> lk(_m);
+    while (!_cond.wait_for(lk, _period, [this] { return _stop; })) {
+      flush();
+    }
+  }
+
+public:
+  explicit trace_exporter(
+      std::string const &path,
+      std::chrono::milliseconds period = std::chrono::milliseconds(100))
+      : _out(path),
+        _period(period) {
+    if (!_out) {
+      throw std::ios_base::failure("cannot open " + path);
+    }
+    _out << '[';
+    trace_enable(true);
+    _thread = std::thread(&trace_exporter::run, this);
+  }
+
+  trace_exporter(trace_exporter const &) = delete;
+  trace_exporter(trace_exporter &&) = delete;
+  trace_exporter &
+  operator=(trace_exporter const &) = delete;
+  trace_exporter &
+  operator=(trace_exporter &&) = delete;
+
+  ~trace_exporter() {
+    trace_enable(false);
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      _stop = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+    flush();
+    _out << "\n]\n";
+  }
+
+  /// Events lost to full rings so far
+  std::uint64_t
+  dropped() {
+    std::lock_guard<std::mutex> lk(_m);
+    return _dropped;
+  }
+};
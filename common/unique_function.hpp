@@ -0,0 +1,181 @@
+#pragma once
+
+#include <array>
+#include <cstddef> // std::size_t, std::max_align_t, std::byte, std::nullptr_t
+#include <functional> // std::bad_function_call, std::invoke
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// std::function has to be copyable, so it can't hold a std::packaged_task or a
+// lambda that captured a std::unique_ptr, and libstdc++ only keeps callables
+// of up to two pointers inside it: anything bigger is allocated on the heap.
+// A task queue moves every task in and out once and never copies it, so it
+// pays for neither with unique_function.
+
+template <typename Signature, std::size_t Capacity = 48>
+class unique_function;
+
+/// Move-only std::function. Callables of up to Capacity bytes that can be
+/// moved without throwing are stored inside the object, bigger ones on the
+/// heap. The pointers to the call and to the move/destroy of the stored
+/// callable are members too, not behind a vtable, so with the default
+/// Capacity the whole object is one 64 byte cache line and a call is one
+/// indirect jump. Calling an empty unique_function throws
+/// std::bad_function_call.
+template <typename R, typename... Args, std::size_t Capacity>
+class unique_function<R(Args...), Capacity>
+{
+private:
+  enum class operation
+  {
+    move,
+    destroy
+  };
+
+  using invoke_fn = R (*)(void *, Args &&...);
+  // move: move-construct the callable of from into to and destroy it
+  // destroy: destroy the callable of from
+  using manage_fn = void (*)(operation, void *from, void *to) noexcept;
+
+  template <typename F>
+  static constexpr bool stored_inline
+      = sizeof(F) <= Capacity && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible<F>::value;
+
+  alignas(std::max_align_t) std::array<std::byte, Capacity> _storage;
+  invoke_fn _invoke{&invoke_empty};
+  manage_fn _manage{nullptr};
+
+  template <typename F>
+  static F *
+  target(void *storage) {
+    if constexpr (stored_inline<F>) {
+      return std::launder(static_cast<F *>(storage));
+    } else {
+      return *std::launder(static_cast<F **>(storage));
+    }
+  }
+
+  template <typename F>
+  static R
+  invoke(void *storage, Args &&...args) {
+    if constexpr (std::is_void<R>::value) {
+      std::invoke(*target<F>(storage), std::forward<Args>(args)...);
+    } else {
+      return std::invoke(*target<F>(storage), std::forward<Args>(args)...);
+    }
+  }
+
+  template <typename F>
+  static void
+  manage(operation op, void *from, void *to) noexcept {
+    if constexpr (stored_inline<F>) {
+      F *const f = target<F>(from);
+      if (op == operation::move) {
+        ::new (to) F(std::move(*f));
+      }
+      f->~F();
+    } else {
+      if (op == operation::move) {
+        ::new (to) F *(target<F>(from));
+      } else {
+        delete target<F>(from);
+      }
+    }
+  }
+
+  [[noreturn]] static R
+  invoke_empty(void * /*storage*/, Args &&.../*args*/) {
+    throw std::bad_function_call();
+  }
+
+  void
+  take(unique_function &other) noexcept {
+    if (other._manage == nullptr) {
+      return;
+    }
+    other._manage(operation::move, other._storage.data(), _storage.data());
+    _invoke = other._invoke;
+    _manage = other._manage;
+    other._invoke = &invoke_empty;
+    other._manage = nullptr;
+  }
+
+  void
+  reset() noexcept {
+    if (_manage == nullptr) {
+      return;
+    }
+    _manage(operation::destroy, _storage.data(), nullptr);
+    _invoke = &invoke_empty;
+    _manage = nullptr;
+  }
+
+public:
+  unique_function() noexcept = default;
+
+  unique_function(std::nullptr_t) noexcept {}
+
+  template <typename F,
+            typename D = std::decay_t<F>,
+            typename = std::enable_if_t<
+                !std::is_same<D, unique_function>::value
+                && std::is_invocable_r<R, D &, Args...>::value>>
+  unique_function(F &&f) {
+    // F rather than D: a function reference decays to a pointer, but is
+    // never null
+    using P = std::remove_cv_t<std::remove_reference_t<F>>;
+    if constexpr (std::is_pointer<P>::value
+                  || std::is_member_pointer<P>::value) {
+      // like std::function, a null function pointer makes an empty function
+      if (f == nullptr) {
+        return;
+      }
+    }
+    if constexpr (stored_inline<D>) {
+      ::new (static_cast<void *>(_storage.data())) D(std::forward<F>(f));
+    } else {
+      ::new (static_cast<void *>(_storage.data()))
+          D *(new D(std::forward<F>(f)));
+    }
+    _invoke = &invoke<D>;
+    _manage = &manage<D>;
+  }
+
+  unique_function(unique_function &&other) noexcept {
+    take(other);
+  }
+
+  unique_function &
+  operator=(unique_function &&other) noexcept {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  unique_function &
+  operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  unique_function(unique_function const &) = delete;
+  unique_function &
+  operator=(unique_function const &) = delete;
+
+  ~unique_function() {
+    reset();
+  }
+
+  explicit operator bool() const noexcept {
+    return _manage != nullptr;
+  }
+
+  R
+  operator()(Args... args) {
+    return _invoke(_storage.data(), std::forward<Args>(args)...);
+  }
+};
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // _mm_pause
+#endif
+
+// Wait strategies decide what a consumer does while a queue is empty. Every
+// strategy exposes the same interface, so a queue can take one as a template
+// policy:
+//   wait(lk, pred)                  block until pred() holds
+//   wait_for(lk, timeout, pred)     same, but give up after timeout and return
+//                                   the value of pred()
+//   notify_one() / notify_all()     called by producers after publishing data
+// lk is always a locked std::unique_lock guarding the data pred() reads, and it
+// is locked again when the wait returns. The strategies that park on a
+// condition variable need a std::unique_lock<std::mutex>, the spinning ones
+// take a std::unique_lock of any mutex.
+
+/// Tell the CPU we are in a spin-wait loop, so that it can back off the
+/// pipeline and leave resources to the sibling hyper-thread
+inline void
+cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+/// Spin for a while, then start yielding the core, until pred() is true. For
+/// waits on plain atomics, where there is no mutex to hand to a wait strategy.
+template <typename Predicate>
+void
+spin_until(Predicate pred) {
+  static constexpr unsigned SPIN_LIMIT = 1024;
+  for (unsigned spins = 0; !pred(); ++spins) {
+    if (spins < SPIN_LIMIT) {
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/// Park on a std::condition_variable. Uses no CPU while waiting, but every
+/// wake-up goes through the kernel scheduler.
+class blocking_wait
+{
+  std::condition_variable _cond;
+
+public:
+  template <typename Predicate>
+  void
+  wait(std::unique_lock<std::mutex> &lk, Predicate pred) {
+    _cond.wait(lk, pred);
+  }
+
+  template <typename Rep, typename Period, typename Predicate>
+  bool
+  wait_for(std::unique_lock<std::mutex> &lk,
+           std::chrono::duration<Rep, Period> const &timeout,
+           Predicate pred) {
+    return _cond.wait_for(lk, timeout, pred);
+  }
+
+  void
+  notify_one() {
+    _cond.notify_one();
+  }
+
+  void
+  notify_all() {
+    _cond.notify_all();
+  }
+};
+
+/// Backoff for spinning_wait that never gives up the core
+struct busy_spin_backoff
+{
+  static void
+  pause(unsigned /*spins*/) {
+    cpu_relax();
+  }
+};
+
+/// Backoff for spinning_wait that spins for a while and then yields the core to
+/// other runnable threads on every iteration
+template <unsigned SpinLimit = 1024>
+struct yield_backoff
+{
+  static void
+  pause(unsigned spins) {
+    if (spins < SpinLimit) {
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+};
+
+/// Spin on a signal counter with the queue mutex released, so that waiting
+/// consumers never contend with producers for the lock. Producers only pay for
+/// one atomic increment when they notify.
+template <typename Backoff>
+class spinning_wait
+{
+  std::atomic<unsigned long> _signals{0};
+
+  template <typename Lock, typename Predicate>
+  bool
+  wait_until(Lock &lk,
+             std::chrono::steady_clock::time_point const *deadline,
+             Predicate pred) {
+    while (true) {
+      // read the counter before checking the predicate: if a producer
+      // publishes after the check, its increment is guaranteed to be seen
+      // below, even when the data is guarded by a different mutex than lk
+      unsigned long const seen = _signals.load(std::memory_order_acquire);
+      if (pred()) {
+        return true;
+      }
+
+      lk.unlock();
+      for (unsigned spins = 0;
+           _signals.load(std::memory_order_acquire) == seen;
+           ++spins) {
+        if (deadline != nullptr
+            && std::chrono::steady_clock::now() >= *deadline) {
+          lk.lock();
+          return pred();
+        }
+        Backoff::pause(spins);
+      }
+      lk.lock();
+    }
+  }
+
+public:
+  template <typename Lock, typename Predicate>
+  void
+  wait(Lock &lk, Predicate pred) {
+    wait_until(lk, nullptr, pred);
+  }
+
+  template <typename Lock, typename Rep, typename Period, typename Predicate>
+  bool
+  wait_for(Lock &lk,
+           std::chrono::duration<Rep, Period> const &timeout,
+           Predicate pred) {
+    auto const deadline = std::chrono::steady_clock::now() + timeout;
+    return wait_until(lk, &deadline, pred);
+  }
+
+  void
+  notify_one() {
+    _signals.fetch_add(1, std::memory_order_release);
+  }
+
+  void
+  notify_all() {
+    _signals.fetch_add(1, std::memory_order_release);
+  }
+};
+
+/// Lowest latency, burns a whole core per waiting consumer. Only use it on
+/// dedicated cores.
+using busy_spin_wait = spinning_wait<busy_spin_backoff>;
+
+/// Spin briefly and then keep yielding, so that an oversubscribed machine still
+/// makes progress
+template <unsigned SpinLimit = 1024>
+using spin_yield_wait = spinning_wait<yield_backoff<SpinLimit>>;
+
+/// Spin for up to SpinLimit iterations to catch data that arrives quickly, then
+/// park on a condition variable. Producers only make the notify call when
+/// somebody is actually parked.
+template <unsigned SpinLimit = 1024>
+class spin_park_wait
+{
+  std::atomic<unsigned long> _signals{0};
+  std::atomic<unsigned> _parked{0};
+  std::condition_variable _cond;
+
+  template <typename Predicate>
+  bool
+  spin(std::unique_lock<std::mutex> &lk, Predicate &pred) {
+    unsigned spins = 0;
+    while (spins < SpinLimit) {
+      unsigned long const seen = _signals.load(std::memory_order_seq_cst);
+      if (pred()) {
+        return true;
+      }
+
+      lk.unlock();
+      while (spins < SpinLimit
+             && _signals.load(std::memory_order_acquire) == seen) {
+        cpu_relax();
+        ++spins;
+      }
+      lk.lock();
+    }
+    return false;
+  }
+
+  void
+  signal() {
+    _signals.fetch_add(1, std::memory_order_seq_cst);
+  }
+
+public:
+  template <typename Predicate>
+  void
+  wait(std::unique_lock<std::mutex> &lk, Predicate pred) {
+    if (spin(lk, pred)) {
+      return;
+    }
+
+    // _parked is only modified with lk held, and it is published before the
+    // predicate is checked again, so a producer either sees a parked consumer
+    // or the consumer sees the producer's data
+    _parked.fetch_add(1, std::memory_order_seq_cst);
+    _cond.wait(lk, pred);
+    _parked.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  template <typename Rep, typename Period, typename Predicate>
+  bool
+  wait_for(std::unique_lock<std::mutex> &lk,
+           std::chrono::duration<Rep, Period> const &timeout,
+           Predicate pred) {
+    auto const deadline = std::chrono::steady_clock::now() + timeout;
+    if (spin(lk, pred)) {
+      return true;
+    }
+
+    _parked.fetch_add(1, std::memory_order_seq_cst);
+    bool const ready = _cond.wait_until(lk, deadline, pred);
+    _parked.fetch_sub(1, std::memory_order_relaxed);
+    return ready;
+  }
+
+  void
+  notify_one() {
+    signal();
+    if (_parked.load(std::memory_order_seq_cst) != 0) {
+      _cond.notify_one();
+    }
+  }
+
+  void
+  notify_all() {
+    signal();
+    if (_parked.load(std::memory_order_seq_cst) != 0) {
+      _cond.notify_all();
+    }
+  }
+};